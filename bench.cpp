@@ -0,0 +1,515 @@
+/***************************************************************
+ * bench.cpp
+ * Benchmark do caminho quente (roteamento, parse, conversão CAN->JSON
+ * e publicação) sem precisar de um Mosquitto rodando: as mensagens
+ * entram direto em BrokerLogicCallback::message_arrived e saem num
+ * mqtt::async_client falso, que só conta as publicações.
+ *
+ * Para compilar:
+ *
+ *   g++ -std=c++17 -O2 -pthread bench.cpp -o broker_bench \
+ *       -I/usr/local/include -L/usr/local/lib \
+ *       -lpaho-mqttpp3 -lpaho-mqtt3as
+ *
+ * Execute:
+ *   ./broker_bench [--messages N] [--workers N] [--input arquivo]
+ *                  [--json]
+ *
+ *   --messages N   mensagens por classe de tópico (padrão: 200000)
+ *   --workers N    workers da medição de vazão do pool (padrão: nº de
+ *                  núcleos); a latência é sempre medida inline
+ *   --input arq    payloads gravados no lugar dos sintéticos, uma
+ *                  mensagem por linha: "<tópico> <payload>", com o
+ *                  payload em hexadecimal nos tópicos binários, ou uma
+ *                  captura do broker (--capture: arquivo .cap ou o
+ *                  prefixo dos segmentos); a gravação é repetida até
+ *                  N mensagens por classe
+ *   --json         resultado em JSON (uma entrada por classe), para
+ *                  comparar entre versões
+ *
+ * Para cada classe (handler da rota, mais canToJson/canToJsonSim e a
+ * decodificação das leituras, frame a frame e em lote com cada kernel
+ * SIMD disponível, isolados) mede mensagens/s, latência p50/p99/p999 em ns e alocações
+ * por mensagem (todas as threads, incluindo a de publicação; o token do
+ * client falso conta 1 por publicação, no lugar do que o Paho aloca).
+ *
+ ***************************************************************/
+
+#define BROKER_NO_MAIN
+#include "broker.cpp"
+
+#include <new>
+
+/* -----------------------------------------------------------------------
+   Contagem de alocações: substitui o operator new global.
+   -----------------------------------------------------------------------*/
+static std::atomic<uint64_t> g_allocations{0};
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }
+// Fora de linha: inlinado no delete, o free() confunde o
+// -Wmismatched-new-delete do GCC
+__attribute__((noinline)) static void releaseBlock(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p) noexcept { releaseBlock(p); }
+void operator delete[](void* p) noexcept { releaseBlock(p); }
+void operator delete(void* p, size_t) noexcept { releaseBlock(p); }
+void operator delete[](void* p, size_t) noexcept { releaseBlock(p); }
+
+/* -----------------------------------------------------------------------
+   Client falso: confirma cada publicação na hora e só conta.
+   -----------------------------------------------------------------------*/
+class BenchClient : public mqtt::async_client {
+public:
+    BenchClient() : mqtt::async_client("tcp://localhost:1883", "CppBrokerBench") {}
+
+    mqtt::delivery_token_ptr publish(mqtt::const_message_ptr msg) override {
+        published_.fetch_add(1, std::memory_order_relaxed);
+        return std::make_shared<mqtt::delivery_token>(*this, std::move(msg));
+    }
+
+    mqtt::delivery_token_ptr publish(mqtt::const_message_ptr msg, void* userContext,
+                                     mqtt::iaction_listener& cb) override {
+        auto tok = std::make_shared<mqtt::delivery_token>(*this, std::move(msg));
+        tok->set_user_context(userContext);
+        published_.fetch_add(1, std::memory_order_relaxed);
+        cb.on_success(*tok);
+        return tok;
+    }
+
+    uint64_t published() const { return published_.load(std::memory_order_relaxed); }
+
+    // Espera até count publicações (ou o prazo); false se o prazo venceu
+    bool waitFor(uint64_t count, std::chrono::seconds deadline = std::chrono::seconds(30)) const {
+        auto until = std::chrono::steady_clock::now() + deadline;
+        while (published() < count) {
+            if (std::chrono::steady_clock::now() > until) return false;
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        return true;
+    }
+
+private:
+    std::atomic<uint64_t> published_{0};
+};
+
+/* -----------------------------------------------------------------------
+   Entradas: payloads sintéticos por classe ou gravados em arquivo.
+   -----------------------------------------------------------------------*/
+struct BenchCase {
+    std::string Name;
+    std::vector<mqtt::const_message_ptr> Messages;
+    bool Invalid = false;   // entradas rejeitadas: nada é publicado (sem dead-letter)
+    bool Mqtt5 = false;     // conexão MQTT 5 com aliases de tópico
+};
+
+struct BenchResult {
+    std::string Name;
+    size_t      Messages = 0;
+    double      MsgPerSec = 0;         // inline, no thread chamador
+    double      PoolMsgPerSec = 0;     // com o pool de workers (0 = não medido)
+    uint64_t    P50 = 0, P99 = 0, P999 = 0;
+    double      AllocsPerMsg = 0;
+};
+
+static bool hexDecode(std::string_view hex, std::string& out) {
+    if (hex.size() % 2) return false;
+    out.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        unsigned value = 0;
+        auto res = std::from_chars(hex.data() + i, hex.data() + i + 2, value, 16);
+        if (res.ec != std::errc() || res.ptr != hex.data() + i + 2) return false;
+        out.push_back(static_cast<char>(value));
+    }
+    return true;
+}
+
+static std::string encodeFrame(uint32_t arb, uint8_t algorithm, int64_t timestampUs,
+                               std::initializer_list<uint8_t> data) {
+    std::string frame(CAN_BIN_FRAME_SIZE, '\0');
+    auto* p = reinterpret_cast<uint8_t*>(&frame[0]);
+    for (int i = 0; i < 4; ++i) p[i] = static_cast<uint8_t>(arb >> (8 * i));
+    p[4] = static_cast<uint8_t>(data.size());
+    p[5] = algorithm;
+    for (int i = 0; i < 8; ++i) p[8 + i] = static_cast<uint8_t>(static_cast<uint64_t>(timestampUs) >> (8 * i));
+    size_t k = 16;
+    for (uint8_t b : data) p[k++] = b;
+    return frame;
+}
+
+// Uma variação por ArbitrationId conhecido, repetida até n mensagens.
+// Os casos "_bad" alternam os erros de entrada mais comuns, para comparar
+// o custo de rejeitar com o de converter. can_json_alias repete can_json
+// numa conexão MQTT 5: quase toda publicação sai só com o alias.
+static std::vector<BenchCase> syntheticCases(size_t n) {
+    std::vector<BenchCase> cases(8);
+    cases[0].Name = "can_json";
+    cases[1].Name = "sim_can_json";
+    cases[2].Name = "can_bin";
+    cases[3].Name = "sim_can_bin";
+    cases[4].Name = "passthrough";
+    cases[5].Name = "can_json_bad";
+    cases[5].Invalid = true;
+    cases[6].Name = "can_bin_bad";
+    cases[6].Invalid = true;
+    cases[7].Name = "can_json_alias";
+    cases[7].Mqtt5 = true;
+
+    const char* const badJson[] = {
+        "{\"AlgorithmID\":\"BlindSpotDetection\",\"CAN_Message\":{\"ArbitrationId\":256,\"Data\":[1,2",
+        "{\"AlgorithmID\":\"BlindSpotDetection\",\"CAN_Message\":{\"ArbitrationId\":256,\"Data\":[1,\"2\",3]}}",
+        "{\"AlgorithmID\":\"BlindSpotDetection\",\"CAN_Message\":{\"ArbitrationId\":256,\"Data\":[1,300,3]}}",
+        "{\"AlgorithmID\":\"BlindSpotDetection\",\"CAN_Message\":{\"ArbitrationId\":\"0x100\",\"Data\":[1]}}",
+    };
+
+    int64_t now = timestampService().nowMicros();
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t arb = 0x100 + static_cast<uint32_t>(i % 4);
+        uint8_t lo = static_cast<uint8_t>(i), hi = static_cast<uint8_t>(i >> 8) & 0x0F;
+        std::string arbText = std::to_string(arb);
+        std::string data = "[1," + std::to_string(lo) + "," + std::to_string(hi) + ",1]";
+
+        cases[0].Messages.push_back(mqtt::make_message("can/messages",
+            "{\"AlgorithmID\":\"BlindSpotDetection\",\"CAN_Message\":{\"ArbitrationId\":"
+            + arbText + ",\"Data\":" + data + "}}"));
+        cases[1].Messages.push_back(mqtt::make_message("sim/canmessages",
+            "{\"algorithm_id\":\"BlindSpotDetection\",\"can_message\":{\"arbitration_id\":"
+            + arbText + ",\"data\":" + data + "}}"));
+        cases[2].Messages.push_back(mqtt::make_message("can/bin",
+            encodeFrame(arb, 1, now + static_cast<int64_t>(i), {1, lo, hi, 1})));
+        cases[3].Messages.push_back(mqtt::make_message("sim/canbin",
+            encodeFrame(arb, 1, now + static_cast<int64_t>(i), {1, lo, hi, 1})));
+        cases[4].Messages.push_back(mqtt::make_message("sim/speed", std::to_string(i % 200)));
+        cases[5].Messages.push_back(mqtt::make_message("can/messages", badJson[i % 4]));
+        std::string badFrame = encodeFrame(arb, 1, now + static_cast<int64_t>(i), {1, lo, hi, 1});
+        if (i % 2) badFrame[4] = 9;        // DLC acima de 8
+        else badFrame.resize(16);          // frame truncado
+        cases[6].Messages.push_back(mqtt::make_message("can/bin", badFrame));
+    }
+    cases[7].Messages = cases[0].Messages;
+    return cases;
+}
+
+// Agrupa as mensagens gravadas pelo handler da rota que as atende
+static void addRecorded(std::vector<BenchCase>& cases, const RouteTable& routes, mqtt::const_message_ptr msg) {
+    RouteMatch m;
+    if (!routes.match(msg->get_topic(), m) || m.Matched->Rule.Handler == RouteHandler::Drop) return;
+    const char* name = routeHandlerName(m.Matched->Rule.Handler);
+    auto it = std::find_if(cases.begin(), cases.end(), [&](const BenchCase& c) { return c.Name == name; });
+    if (it == cases.end()) {
+        cases.push_back(BenchCase{name, {}});
+        it = cases.end() - 1;
+    }
+    it->Messages.push_back(std::move(msg));
+}
+
+// Captura do broker (--capture): segmentos .cap, ou o prefixo deles
+static bool isCapture(const std::string& path, std::vector<std::string>& files) {
+    files = captureFiles(path);
+    if (files.empty()) return false;
+    bool suffix = path.size() >= 4 && path.compare(path.size() - 4, 4, ".cap") == 0;
+    return files[0] != path || suffix;
+}
+
+static std::vector<BenchCase> recordedCases(const std::string& path, const RouteTable& routes, size_t n) {
+    std::vector<BenchCase> cases;
+    std::vector<std::string> files;
+    if (isCapture(path, files)) {
+        CaptureReplayer replayer({files});
+        replayer.run([&](mqtt::const_message_ptr msg) { addRecorded(cases, routes, std::move(msg)); }, 0);
+    } else {
+        std::ifstream in(path);
+        if (!in) throw std::runtime_error("não foi possível abrir " + path);
+
+        std::string line, bytes;
+        size_t lineNo = 0;
+        while (std::getline(in, line)) {
+            ++lineNo;
+            if (line.empty() || line[0] == '#') continue;
+            size_t sp = line.find(' ');
+            if (sp == std::string::npos) throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": linha sem payload");
+            std::string topic = line.substr(0, sp);
+            std::string_view payload(line.data() + sp + 1, line.size() - sp - 1);
+
+            RouteMatch m;
+            if (!routes.match(topic, m)) continue;
+            RouteHandler handler = m.Matched->Rule.Handler;
+            if (handler == RouteHandler::CanBinary || handler == RouteHandler::SimCanBinary) {
+                if (!hexDecode(payload, bytes))
+                    throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": hexadecimal inválido");
+                payload = bytes;
+            }
+            addRecorded(cases, routes, mqtt::make_message(topic, std::string(payload)));
+        }
+    }
+
+    // Repete a gravação até n mensagens por classe
+    for (auto &c : cases) {
+        size_t recorded = c.Messages.size();
+        for (size_t i = recorded; i < n; ++i) c.Messages.push_back(c.Messages[i % recorded]);
+    }
+    return cases;
+}
+
+/* -----------------------------------------------------------------------
+   Medições
+   -----------------------------------------------------------------------*/
+static void fillPercentiles(std::vector<uint64_t>& samples, BenchResult& r) {
+    if (samples.empty()) return;
+    std::sort(samples.begin(), samples.end());
+    auto at = [&](double q) {
+        size_t i = static_cast<size_t>(q * static_cast<double>(samples.size() - 1));
+        return samples[i];
+    };
+    r.P50 = at(0.50);
+    r.P99 = at(0.99);
+    r.P999 = at(0.999);
+}
+
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point since) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - since).count());
+}
+
+// Latência de message_arrived no modo inline; a vazão conta até a última
+// publicação chegar no client falso.
+static BenchResult runInline(const BenchCase& c, const RouteTable& routes) {
+    BenchResult r;
+    r.Name = c.Name;
+    r.Messages = c.Messages.size();
+
+    BenchClient client;
+    PipelineOptions opts;
+    opts.Workers = 0;
+    opts.Metrics.Interval = std::chrono::seconds(0);
+    opts.DeadLetter.Prefix.clear();
+    opts.Publisher.Mqtt5 = c.Mqtt5;
+    BrokerLogicCallback cb(client, opts, routes);
+    if (c.Mqtt5) cb.setTopicAliasMaximum(UINT16_MAX);   // o limite fica no TopicAliases pedido
+    const uint64_t perMessage = c.Invalid ? 0 : 1;
+
+    // Aquecimento: caches de tópico, writer por thread, etc.
+    size_t warmup = std::min<size_t>(c.Messages.size(), 1000);
+    for (size_t i = 0; i < warmup; ++i) cb.message_arrived(c.Messages[i]);
+    client.waitFor(warmup * perMessage);
+    uint64_t base = client.published();
+
+    std::vector<uint64_t> samples(c.Messages.size());
+    uint64_t allocsBefore = g_allocations.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < c.Messages.size(); ++i) {
+        auto t0 = std::chrono::steady_clock::now();
+        cb.message_arrived(c.Messages[i]);
+        samples[i] = elapsedNs(t0);
+    }
+    client.waitFor(base + c.Messages.size() * perMessage);
+    double seconds = static_cast<double>(elapsedNs(start)) / 1e9;
+    uint64_t allocs = g_allocations.load(std::memory_order_relaxed) - allocsBefore;
+
+    r.MsgPerSec = seconds > 0 ? static_cast<double>(c.Messages.size()) / seconds : 0;
+    r.AllocsPerMsg = r.Messages ? static_cast<double>(allocs) / static_cast<double>(r.Messages) : 0;
+    fillPercentiles(samples, r);
+    return r;
+}
+
+// Vazão com o pool de workers (do primeiro submit à última publicação)
+static double runPool(const BenchCase& c, const RouteTable& routes, size_t workers) {
+    BenchClient client;
+    PipelineOptions opts;
+    opts.Workers = workers;
+    opts.Metrics.Interval = std::chrono::seconds(0);
+    opts.DeadLetter.Prefix.clear();
+    opts.Publisher.Mqtt5 = c.Mqtt5;
+    BrokerLogicCallback cb(client, opts, routes);
+    if (c.Mqtt5) cb.setTopicAliasMaximum(UINT16_MAX);   // o limite fica no TopicAliases pedido
+
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &msg : c.Messages) cb.message_arrived(msg);
+    if (c.Invalid) {
+        cb.shutdown();   // sem publicações para esperar: só o esvaziamento dos workers
+    } else if (!client.waitFor(c.Messages.size())) {
+        return 0;
+    }
+    double seconds = static_cast<double>(elapsedNs(start)) / 1e9;
+    return seconds > 0 ? static_cast<double>(c.Messages.size()) / seconds : 0;
+}
+
+// canToJson/canToJsonSim + serialização, sem roteamento nem publicação
+template <typename Msg, typename Convert>
+static BenchResult runConversion(const char* name, size_t n, Convert convert) {
+    BenchResult r;
+    r.Name = name;
+    r.Messages = n;
+
+    const DecoderTable &decoders = defaultDecoderTable();
+    std::vector<Msg> frames(64);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        Msg &m = frames[i];
+        m.AlgorithmID.assign("BlindSpotDetection");
+        m.CAN_Message.ArbitrationId = 0x100 + static_cast<int>(i % 4);
+        for (int b : {1, static_cast<int>(i), static_cast<int>(i % 16), 1}) appendDataByte(m.CAN_Message, b);
+    }
+
+    std::vector<uint64_t> samples(n);
+    size_t bytes = 0;
+    uint64_t allocsBefore = g_allocations.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) {
+        const Msg &m = frames[i % frames.size()];
+        auto t0 = std::chrono::steady_clock::now();
+        const CanDecoder &decoder = decoders.resolve(static_cast<uint32_t>(m.CAN_Message.ArbitrationId),
+                                                     m.AlgorithmID.view());
+        JsonWriter &w = threadJsonWriter();
+        writeJsonMessage(w, convert(m, decoder));
+        bytes += w.view().size();
+        samples[i] = elapsedNs(t0);
+    }
+    double seconds = static_cast<double>(elapsedNs(start)) / 1e9;
+    uint64_t allocs = g_allocations.load(std::memory_order_relaxed) - allocsBefore;
+
+    if (bytes == 0) std::cerr << "(nenhum byte gerado)" << std::endl;   // mantém o laço vivo
+    r.MsgPerSec = seconds > 0 ? static_cast<double>(n) / seconds : 0;
+    r.AllocsPerMsg = n ? static_cast<double>(allocs) / static_cast<double>(n) : 0;
+    fillPercentiles(samples, r);
+    return r;
+}
+
+// Só a decodificação (sem JSON): decodeReading() frame a frame ou
+// decodeBatch() em rajadas de BATCH_BURST com cada kernel disponível,
+// montagem das colunas incluída. Latência por frame (tempo da rajada /
+// tamanho).
+constexpr size_t BATCH_BURST = 256;
+
+static BenchResult runDecode(size_t n, const BatchKernel* kernel) {
+    BenchResult r;
+    r.Name = kernel ? std::string("batch/") + kernel->Name : "decodeReading";
+    r.Messages = n;
+
+    const DecoderTable &decoders = defaultDecoderTable();
+    std::vector<CanData> frames(BATCH_BURST);
+    std::vector<BatchFrame> batchFrames(BATCH_BURST);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        CanData &can = frames[i];
+        can.ArbitrationId = 0x100 + static_cast<int>(i % 4);
+        can.Data.clear();
+        for (int b : {1, static_cast<int>(i), static_cast<int>(i % 16), static_cast<int>(i % 2)}) appendDataByte(can, b);
+        batchFrames[i] = BatchFrame{ &decoders.resolve(static_cast<uint32_t>(can.ArbitrationId), ""), &can };
+    }
+
+    std::vector<SensorReading> readings(BATCH_BURST);
+    std::vector<uint64_t> samples;
+    samples.reserve(n / BATCH_BURST + 1);
+    double checksum = 0;
+    uint64_t allocsBefore = g_allocations.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t done = 0; done < n; done += BATCH_BURST) {
+        size_t burst = std::min(BATCH_BURST, n - done);
+        auto t0 = std::chrono::steady_clock::now();
+        if (kernel) {
+            decodeBatch(batchFrames.data(), burst, readings.data(), *kernel);
+            checksum += readings[burst - 1].Distance;
+        } else {
+            for (size_t i = 0; i < burst; ++i) {
+                SensorReading reading = decodeReading(*batchFrames[i].Decoder, frames[i]);
+                checksum += reading.Distance + reading.Status;
+            }
+        }
+        samples.push_back(elapsedNs(t0) / burst);
+    }
+    double seconds = static_cast<double>(elapsedNs(start)) / 1e9;
+    uint64_t allocs = g_allocations.load(std::memory_order_relaxed) - allocsBefore;
+
+    if (checksum == 0) std::cerr << "(nenhuma leitura decodificada)" << std::endl;   // mantém o laço vivo
+    r.MsgPerSec = seconds > 0 ? static_cast<double>(n) / seconds : 0;
+    r.AllocsPerMsg = n ? static_cast<double>(allocs) / static_cast<double>(n) : 0;
+    fillPercentiles(samples, r);
+    return r;
+}
+
+int main(int argc, char* argv[]) {
+    size_t messages = 200000;
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    std::string input;
+    bool jsonOutput = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--messages" && i + 1 < argc) {
+            messages = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workers = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--input" && i + 1 < argc) {
+            input = argv[++i];
+        } else if (arg == "--json") {
+            jsonOutput = true;
+        } else {
+            std::cerr << "Opção desconhecida: " << arg << "\n"
+                      << "Uso: " << argv[0] << " [--messages N] [--workers N] [--input arquivo] [--json]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    // Sem log no caminho medido
+    logger().setLevel(LogLevel::Error);
+
+    const RouteTable &routes = defaultRouteTable();
+    std::vector<BenchCase> cases;
+    try {
+        cases = input.empty() ? syntheticCases(messages) : recordedCases(input, routes, messages);
+    }
+    catch (const std::exception &ex) {
+        std::cerr << "Erro ao carregar as entradas: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<BenchResult> results;
+    for (const auto &c : cases) {
+        if (c.Messages.empty()) continue;
+        BenchResult r = runInline(c, routes);
+        if (workers > 0) r.PoolMsgPerSec = runPool(c, routes, workers);
+        results.push_back(r);
+    }
+    results.push_back(runConversion<CanMessage>("canToJson", messages,
+        [](const CanMessage& m, const CanDecoder& d) { return canToJson(m, d); }));
+    results.push_back(runConversion<CanMessageSimulator>("canToJsonSim", messages,
+        [](const CanMessageSimulator& m, const CanDecoder& d) { return canToJsonSim(m, d); }));
+    results.push_back(runDecode(messages, nullptr));
+    for (const auto &kernel : batchKernels()) results.push_back(runDecode(messages, &kernel));
+
+    if (jsonOutput) {
+        json out = json::array();
+        for (const auto &r : results) {
+            json entry;
+            entry["name"] = r.Name;
+            entry["messages"] = r.Messages;
+            entry["msg_per_sec"] = r.MsgPerSec;
+            entry["pool_msg_per_sec"] = r.PoolMsgPerSec;
+            entry["p50_ns"] = r.P50;
+            entry["p99_ns"] = r.P99;
+            entry["p999_ns"] = r.P999;
+            entry["allocs_per_msg"] = r.AllocsPerMsg;
+            out.push_back(entry);
+        }
+        std::cout << out.dump(2) << std::endl;
+        return 0;
+    }
+
+    std::printf("%-14s %10s %12s %12s %9s %9s %9s %11s\n",
+                "classe", "msgs", "msg/s", "pool msg/s", "p50 ns", "p99 ns", "p999 ns", "allocs/msg");
+    for (const auto &r : results) {
+        std::printf("%-14s %10zu %12.0f %12.0f %9llu %9llu %9llu %11.2f\n",
+                    r.Name.c_str(), r.Messages, r.MsgPerSec, r.PoolMsgPerSec,
+                    static_cast<unsigned long long>(r.P50), static_cast<unsigned long long>(r.P99),
+                    static_cast<unsigned long long>(r.P999), r.AllocsPerMsg);
+    }
+    return 0;
+}
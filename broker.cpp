@@ -6,7 +6,7 @@
  * Para compilar (assumindo que Paho C++ e nlohmann/json
  * estão instalados em /usr/local):
  *
- *   g++ -std=c++17 main.cpp -o mqtt_logic \
+ *   g++ -std=c++17 -pthread main.cpp -o mqtt_logic \
  *       -I/usr/local/include -L/usr/local/lib \
  *       -lpaho-mqttpp3 -lpaho-mqtt3as
  *
@@ -14,16 +14,216 @@
  *   sudo systemctl start mosquitto
  *
  * Depois execute:
- *   ./mqtt_logic
+ *   ./mqtt_logic [--config arquivo.json] [--workers N] [--queue-size N]
+ *                [--timestamp-precision s|ms|us] [--timestamp-source frame|local]
+ *                [--max-inflight N] [--adaptive-qos]
+ *                [--aggregate N] [--aggregate-interval MS]
+ *                [--log-level error|warn|info|debug|trace]
+ *                [--routes arquivo.json]
+ *                [--metrics-interval S] [--metrics-topic T] [--metrics-port N]
+ *                [--high-priority-slo MS]
+ *                [--shards K] [--share-group G]
+ *                [--mqtt-version 3|5] [--topic-aliases N] [--no-payload-format]
+ *                [--reconnect-min MS] [--reconnect-max MS]
+ *                [--spool ARQUIVO] [--spool-mb N] [--spool-drain-rate N]
+ *                [--spool-drain-batch N]
+ *                [--dead-letter-prefix P] [--dead-letter-sample N]
+ *                [--dedup] [--dedup-heartbeat MS] [--dedup-deadband D]
+ *                [--fusion MS] [--fusion-window MS] [--fusion-topic T] [--fusion-only]
+ *                [--cpu-io L] [--cpu-workers L] [--cpu-publisher L] [--cpu-background L]
+ *                [--rate-limit FILTRO=TAXA[:BURST[:POLÍTICA]]]...
+ *                [--global-rate TAXA[:BURST[:POLÍTICA]]] [--rate-backlog N]
+ *                [--capture PREFIXO] [--capture-segment-mb N]
+ *                [--replay ARQUIVO|PREFIXO]... [--replay-speed X|max]
+ *                [--shutdown-timeout S]
+ *
+ *   --config arquivo.json  conexão, shards, rotas, decoders e ajustes do
+ *                          pipeline (formato na seção "Arquivo de
+ *                          configuração"); as outras opções valem sobre
+ *                          ele. SIGHUP relê o arquivo (e o --routes) e
+ *                          troca rotas e decoders sem parar o fluxo
+ *   --workers N     threads de processamento (padrão: nº de núcleos;
+ *                   0 processa no próprio thread de callback do Paho)
+ *   --queue-size N  capacidade da fila de cada worker (padrão: 1024)
+ *   --timestamp-precision  casas do campo Timestamp (padrão: s)
+ *   --timestamp-source     "frame" usa o instante do frame binário quando
+ *                          houver; "local" sempre o relógio local
+ *                          (padrão: frame)
+ *   --max-inflight N       publicações sem confirmação do broker (padrão: 256)
+ *   --adaptive-qos         rotas e decoders sem "adaptive_qos" próprio caem
+ *                          para QoS 0 enquanto o publicador estiver sob
+ *                          contrapressão (só a fila normal; alertas nunca)
+ *   --aggregate N          junta até N leituras por tópico num array JSON
+ *                          (padrão: 0, uma mensagem por leitura)
+ *   --aggregate-interval MS  prazo máximo de um lote agregado (padrão: 100)
+ *   --log-level L          nível do log (padrão: info; "trace" mostra cada
+ *                          mensagem recebida com payload e bytes)
+ *   --routes arquivo.json  tabela de rotas no lugar da padrão, como
+ *                          [{"pattern": "sim/#", "handler": "passthrough",
+ *                            "target": "moto/#"}, ...]; handlers:
+ *                          sim_can_json, sim_can_bin, can_json, can_bin,
+ *                          passthrough, drop. "+"/"#" no target recebem o
+ *                          trecho capturado pelos curingas do pattern.
+ *                          Rotas e decoders aceitam "qos" (0-2),
+ *                          "retained", "adaptive_qos", "expiry_s"
+ *                          (MQTT 5) e "format" (json, cbor, msgpack,
+ *                          binary, ou uma lista: o primeiro no tópico
+ *                          e os outros em "<tópico>/<formato>"; só
+ *                          nas rotas de frames CAN); a rota vale sobre
+ *                          o decoder
+ *   --metrics-interval S   publica as métricas em JSON a cada S segundos
+ *                          (padrão: 10; 0 desliga)
+ *   --metrics-topic T      tópico das métricas (padrão: $SYS/cppbroker/metrics)
+ *   --metrics-port N       endpoint HTTP com as métricas no formato texto
+ *                          do Prometheus (padrão: 0, desligado)
+ *   --high-priority-slo MS latência esperada da fila de alta prioridade
+ *                          (alertas de pedestre/colisão, 0x101 e 0x102);
+ *                          as entregas acima dela contam como slo_misses
+ *                          (padrão: 50; 0 desliga)
+ *   --shards K             K conexões MQTT 5 ("CppBroker-0".."CppBroker-K-1"),
+ *                          cada uma com pipeline e publicador próprios,
+ *                          assinando via $share/G/<filtro> para o broker
+ *                          repartir a carga (padrão: 1, conexão única e
+ *                          assinatura normal). Sem --workers, os núcleos
+ *                          são divididos entre as conexões. O broker
+ *                          reparte cada tópico em rodízio, sem olhar o
+ *                          ArbitrationId: a ordem por ID só vale com K = 1.
+ *                          O dedup e a fusão são compartilhados pelos
+ *                          shards
+ *   --share-group G        grupo das assinaturas compartilhadas
+ *                          (padrão: cppbroker)
+ *   --mqtt-version 3|5     protocolo da conexão (padrão: 5). O 3.1.1 não
+ *                          tem aliases, content type nem expiry_s, e não
+ *                          permite --shards
+ *   --topic-aliases N      aliases de tópico pedidos por conexão; o broker
+ *                          limita no CONNACK (padrão: 32; 0 = tópicos
+ *                          sempre por extenso)
+ *   --no-payload-format    não declara "application/json" e o formato
+ *                          UTF-8 nas publicações JSON
+ *   --reconnect-min MS     depois de uma queda, espera antes da primeira
+ *                          tentativa de reconexão; dobra a cada falha
+ *                          (padrão: 500; sorteada entre a metade e o valor)
+ *   --reconnect-max MS     teto da espera entre tentativas (padrão: 30000)
+ *   --spool ARQUIVO        sem conexão, grava as publicações num anel em
+ *                          disco (arquivo mapeado em memória) e as reenvia
+ *                          depois da reconexão; o que sobrar ao encerrar
+ *                          sai na próxima execução (com --shards, um
+ *                          arquivo por conexão: ARQUIVO-0, ARQUIVO-1, ...)
+ *   --spool-mb N           tamanho do anel; cheio, saem as mais antigas
+ *                          (padrão: 64)
+ *   --spool-drain-rate N   ritmo do reenvio em mensagens/s, ao lado do
+ *                          tráfego ao vivo (padrão: 1000; 0 = sem limite)
+ *   --spool-drain-batch N  rajada máxima do reenvio (padrão: 64)
+ *   --dead-letter-prefix P entradas inválidas amostradas saem em
+ *                          P + tópico de origem, com o motivo e o payload
+ *                          (padrão: "dead-letter/"; "" = só o log)
+ *   --dead-letter-sample N log e dead-letter de 1 a cada N entradas
+ *                          inválidas; todas entram nas métricas
+ *                          (padrão: 100)
+ *   --dedup                só publica a leitura de um ArbitrationId se os
+ *                          bytes de dados mudaram desde a última publicada
+ *   --dedup-heartbeat MS   republica mesmo sem mudança depois de MS
+ *                          (padrão: 1000; 0 = nunca)
+ *   --dedup-deadband D     com --dedup, ignora variações de
+ *                          DistanceToVehicle menores que D (padrão: 0)
+ *   --fusion MS            a cada MS publica, por veículo, um snapshot com
+ *                          a última leitura de todos os sensores e as
+ *                          estatísticas da janela (distância mínima e
+ *                          velocidade de aproximação); o veículo é o
+ *                          primeiro curinga da rota (padrão: 0, desligado)
+ *   --fusion-window MS     janela das estatísticas (padrão: 1000)
+ *   --fusion-topic T       tópico do snapshot, + "/<veículo>" quando a rota
+ *                          tem curinga (padrão: simsensor/fused)
+ *   --fusion-only          publica só o snapshot, sem as leituras por sensor
+ *   --cpu-io L             prende o I/O do Paho (e o replay) às CPUs da
+ *                          lista L, no formato "0-3,6"
+ *   --cpu-workers L        um núcleo de L por worker, em rodízio (com
+ *                          --shards, cada shard continua de onde o
+ *                          anterior parou)
+ *   --cpu-publisher L      thread de publicação
+ *   --cpu-background L     log, captura, métricas e laço de eventos; os
+ *                          estágios sem lista própria ficam com as CPUs
+ *                          da partida. As filas de cada estágio são
+ *                          alocadas já nas CPUs dele (nó NUMA local)
+ *   --rate-limit F=T[:B[:P]]  limita os tópicos de saída que casam com o
+ *                          filtro F a T mensagens/s (rajada B); pode repetir,
+ *                          vale a primeira regra que casar. T = 0 deixa
+ *                          o filtro sem limite e fora do limite global
+ *                          (ex.: "simsensor/#=0" para os tópicos de segurança)
+ *   --global-rate T[:B[:P]]   limite para todo o tráfego de saída
+ *                          P (política sem ficha): drop-oldest (padrão),
+ *                          drop-newest ou coalesce (só a última por tópico)
+ *   --rate-backlog N       mensagens em espera por regra (padrão: 256)
+ *   --capture PREFIXO      grava todo o tráfego recebido em segmentos
+ *                          PREFIXO.000001.cap, ... (com --shards, um
+ *                          conjunto por conexão: PREFIXO-0, PREFIXO-1, ...)
+ *   --capture-segment-mb N tamanho de cada segmento (padrão: 64)
+ *   --replay ARQUIVO|PREFIXO  em vez de assinar, reproduz uma captura no
+ *                          pipeline e encerra; pode repetir (as capturas
+ *                          são intercaladas pelo instante gravado)
+ *   --replay-speed X|max   velocidade do replay: 1 = tempo original
+ *                          (padrão), X vezes mais rápido, ou "max"
+ *   --shutdown-timeout S   prazo do encerramento por SIGTERM/SIGINT:
+ *                          esvazia os workers, espera as confirmações
+ *                          QoS1 e desconecta (padrão: 10); o que não
+ *                          sair no prazo vai para o spool ou conta
+ *                          como stop_dropped
  *
  ***************************************************************/
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <array>
 #include <unordered_map>
+#include <map>
+#include <deque>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <limits>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <csignal>
+#include <random>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>   // kernels SSE4.1/AVX2 da decodificação em lote
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Bibliotecas MQTT
 #include "mqtt/async_client.h"
@@ -35,319 +235,7351 @@
 // Para simplificar o uso:
 using json = nlohmann::json;
 
+/* -----------------------------------------------------------------------
+   Armazenamento inline (sem heap) para os campos dos frames CAN.
+   Capacidade de dados: 8 bytes (CAN clássico) ou 64 com -DBROKER_CAN_FD.
+   -----------------------------------------------------------------------*/
+#ifdef BROKER_CAN_FD
+constexpr size_t CAN_MAX_DATA_LEN = 64;
+#else
+constexpr size_t CAN_MAX_DATA_LEN = 8;
+#endif
+
+// Bytes de dados com campo de tamanho; interface mínima de vector.
+template <size_t N>
+struct InlineBytes {
+    uint8_t Length;
+    uint8_t Bytes[N];
+
+    size_t size() const { return Length; }
+    bool empty() const { return Length == 0; }
+    static constexpr size_t capacity() { return N; }
+    uint8_t operator[](size_t i) const { return Bytes[i]; }
+    const uint8_t* begin() const { return Bytes; }
+    const uint8_t* end() const { return Bytes + Length; }
+    void clear() { Length = 0; }
+
+    // Retorna false se não couber mais nenhum byte.
+    bool push_back(uint8_t b) {
+        if (Length >= N) return false;
+        Bytes[Length++] = b;
+        return true;
+    }
+
+    // Copia até N bytes (o excedente é descartado).
+    void assign(const uint8_t* first, const uint8_t* last) {
+        size_t n = std::min(static_cast<size_t>(last - first), N);
+        std::memcpy(Bytes, first, n);
+        Length = static_cast<uint8_t>(n);
+    }
+};
+
+// String curta inline. Nomes maiores que N-1 são truncados, sem partir
+// um caractere UTF-8 no meio.
+template <size_t N>
+struct InlineString {
+    static constexpr size_t Capacity = N - 1;
+
+    uint8_t Length;
+    char Chars[N - 1];
+
+    bool empty() const { return Length == 0; }
+    std::string_view view() const { return std::string_view(Chars, Length); }
+    std::string str() const { return std::string(Chars, Length); }
+
+    void assign(std::string_view s) {
+        size_t n = s.size();
+        if (n > Capacity) {
+            n = Capacity;
+            // Recua até o início do caractere (bytes de continuação são 10xxxxxx)
+            while (n > 0 && (static_cast<uint8_t>(s[n]) & 0xC0) == 0x80) --n;
+        }
+        Length = static_cast<uint8_t>(n);
+        std::memcpy(Chars, s.data(), Length);
+    }
+};
+
 /* -----------------------------------------------------------------------
    Estruturas equivalentes ao código .NET:
    - CanData
    - CanMessage (normal)
    - CanMessageSimulator (sim)
+   Todas trivialmente copiáveis: podem ser enfileiradas, agrupadas e
+   gravadas em bloco sem passar pelo alocador.
    -----------------------------------------------------------------------*/
 struct CanData {
     int ArbitrationId;
-    std::vector<int> Data;
+    InlineBytes<CAN_MAX_DATA_LEN> Data;
 };
 
 // Representa "can/messages"
+// O AlgorithmID cabe em CAN_MAX_ALGORITHM_ID_LEN bytes (UTF-8); nomes
+// maiores são recusados no parse (ParseError::AlgorithmIdLength).
+constexpr size_t CAN_MAX_ALGORITHM_ID_LEN = 47;
+
 struct CanMessage {
-    std::string AlgorithmID;
+    InlineString<CAN_MAX_ALGORITHM_ID_LEN + 1> AlgorithmID;
     CanData CAN_Message;
+    int64_t SourceTimestampUs;   // instante de origem (µs Unix), 0 = ausente
 };
 
 // Representa "sim/canmessages"
 struct CanMessageSimulator {
-    std::string AlgorithmID;
+    InlineString<CAN_MAX_ALGORITHM_ID_LEN + 1> AlgorithmID;
     CanData CAN_Message;
+    int64_t SourceTimestampUs;   // instante de origem (µs Unix), 0 = ausente
 };
 
+static_assert(std::is_trivially_copyable<CanMessage>::value,
+              "CanMessage precisa ser trivialmente copiável");
+static_assert(std::is_trivially_copyable<CanMessageSimulator>::value,
+              "CanMessageSimulator precisa ser trivialmente copiável");
+
 /* -----------------------------------------------------------------------
-   jsonMessage final, equivalente a:
-     public class JsonMessage
+   Erros de entrada, sem exceções.
+   Um frame inválido vira um código (e, no JSON malformado, o byte onde o
+   parse parou): uma ECU mandando lixo em rajada custa o mesmo que uma
+   mandando frames válidos. O texto do erro só é montado para as
+   mensagens amostradas para o log e o dead-letter.
    -----------------------------------------------------------------------*/
-struct JsonMessage {
-    std::string AlgorithmID;
-    std::string Timestamp;
-    bool Status;
-    json Data; // "Data" pode variar (objeto anônimo)
+enum class ParseError : uint8_t {
+    None,
+    Syntax,              // JSON malformado
+    NotObject,           // o payload não é um objeto JSON
+    AlgorithmIdType,     // "AlgorithmID" não é string
+    AlgorithmIdLength,   // "AlgorithmID" com mais de CAN_MAX_ALGORITHM_ID_LEN bytes
+    CanMessageType,      // "CAN_Message" não é objeto
+    ArbitrationIdType,   // "ArbitrationId" não é número
+    DataItemType,        // item de "Data" não é número
+    DataByteRange,       // byte fora de 0..255
+    DataTooLong,         // mais de CAN_MAX_DATA_LEN bytes
+    FrameSize,           // frame binário sem os 24 bytes
+    FrameDlc,            // DLC acima de 8
+    FrameAlgorithm,      // índice de algoritmo desconhecido
+    Count
+};
+
+constexpr size_t PARSE_ERROR_COUNT = static_cast<size_t>(ParseError::Count);
+
+// Rótulo nas métricas e no dead-letter
+inline const char* parseErrorName(ParseError e) {
+    switch (e) {
+        case ParseError::None:              return "none";
+        case ParseError::Syntax:            return "syntax";
+        case ParseError::NotObject:         return "not_object";
+        case ParseError::AlgorithmIdType:   return "algorithm_id_type";
+        case ParseError::AlgorithmIdLength: return "algorithm_id_length";
+        case ParseError::CanMessageType:    return "can_message_type";
+        case ParseError::ArbitrationIdType: return "arbitration_id_type";
+        case ParseError::DataItemType:      return "data_item_type";
+        case ParseError::DataByteRange:     return "data_byte_range";
+        case ParseError::DataTooLong:       return "data_too_long";
+        case ParseError::FrameSize:         return "frame_size";
+        case ParseError::FrameDlc:          return "frame_dlc";
+        case ParseError::FrameAlgorithm:    return "frame_algorithm";
+        case ParseError::Count:             break;
+    }
+    return "unknown";
+}
+
+constexpr size_t PARSE_NO_OFFSET = SIZE_MAX;
+
+// Resultado de um parse/decodificação; Error == None é sucesso
+struct ParseStatus {
+    ParseError  Error = ParseError::None;
+    size_t      Offset = PARSE_NO_OFFSET;   // byte do erro de sintaxe (a partir de 0)
+    const char* Found = nullptr;            // tipo achado no lugar do campo
+    int64_t     Value = 0;                  // byte, DLC, índice ou tamanho inválido
+
+    bool ok() const { return Error == ParseError::None; }
 };
 
+// Acrescenta um byte vindo do JSON, validando a faixa e a capacidade.
+inline ParseError pushDataByte(CanData& can, int value) {
+    if (value < 0 || value > 255) return ParseError::DataByteRange;
+    if (!can.Data.push_back(static_cast<uint8_t>(value))) return ParseError::DataTooLong;
+    return ParseError::None;
+}
+
+// O mesmo para quem monta frames no código: lança em vez de devolver
+inline void appendDataByte(CanData& can, int value) {
+    switch (pushDataByte(can, value)) {
+        case ParseError::DataByteRange:
+            throw std::out_of_range("byte de dados fora da faixa 0..255: " + std::to_string(value));
+        case ParseError::DataTooLong:
+            throw std::length_error("frame com mais de " + std::to_string(CAN_MAX_DATA_LEN) + " bytes de dados");
+        default:
+            break;
+    }
+}
+
 /* -----------------------------------------------------------------------
-   Funções para converter CAN -> JSON, como no código .NET
+   Formato binário de frame CAN ("can/bin" e "sim/canbin").
+   24 bytes, little-endian, sem padding:
+
+     off  tam  campo
+       0    4  ArbitrationId
+       4    1  DLC (0..8)
+       5    1  índice do AlgorithmID em kAlgorithmNames
+       6    2  reservado (0)
+       8    8  timestamp de origem (µs desde a epoch Unix)
+      16    8  bytes de dados (só os DLC primeiros valem)
    -----------------------------------------------------------------------*/
-JsonMessage canToJson(const CanMessage& msg) {
-    // Extraindo dados
-    int arbitrationId = msg.CAN_Message.ArbitrationId;
-    const auto &data  = msg.CAN_Message.Data;
+constexpr size_t CAN_BIN_FRAME_SIZE = 24;
 
-    std::string algorithmId = msg.AlgorithmID.empty()
-                              ? "Unknown"
-                              : msg.AlgorithmID;
+// Índices de AlgorithmID acordados com os gateways. 0 = não informado.
+const char* const kAlgorithmNames[] = {
+    "",
+    "BlindSpotDetection",
+    "PedestrianDetection",
+    "FrontalCollisionWarning",
+    "RearCollisionWarning"
+};
+constexpr size_t kAlgorithmCount = sizeof(kAlgorithmNames) / sizeof(kAlgorithmNames[0]);
 
-    bool status = (data.size() > 0 && data[0] == 1);
-    int distance = 0;
-    if (data.size() > 2) {
-        distance = (data[2] << 8) | data[1];
+// Frame decodificado do formato binário (POD, sem alocação).
+struct CanFrame {
+    uint32_t ArbitrationId;
+    uint8_t  Dlc;
+    uint8_t  AlgorithmIndex;
+    uint64_t TimestampUs;
+    uint8_t  Data[8];
+};
+
+inline uint32_t readLe32(const uint8_t* p) {
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+inline uint64_t readLe64(const uint8_t* p) {
+    return uint64_t(readLe32(p)) | (uint64_t(readLe32(p + 4)) << 32);
+}
+
+// Decodifica um frame binário. O status acusa tamanho, DLC ou índice do
+// algoritmo inválidos.
+ParseStatus decodeCanFrame(std::string_view payload, CanFrame& frame) {
+    ParseStatus status;
+    if (payload.size() != CAN_BIN_FRAME_SIZE) {
+        status.Error = ParseError::FrameSize;
+        status.Value = static_cast<int64_t>(payload.size());
+        return status;
     }
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(payload.data());
+
+    frame.ArbitrationId  = readLe32(p);
+    frame.Dlc            = p[4];
+    frame.AlgorithmIndex = p[5];
+    frame.TimestampUs    = readLe64(p + 8);
+    std::memcpy(frame.Data, p + 16, sizeof(frame.Data));
 
-    // Caso especial: BlindSpotDetection => "Side"
-    std::string side = "Esquerda";
-    if (algorithmId == "BlindSpotDetection" && data.size() > 3 && data[3] == 1) {
-        side = "Direita";
+    if (frame.Dlc > sizeof(frame.Data)) {
+        status.Error = ParseError::FrameDlc;
+        status.Value = frame.Dlc;
+    } else if (frame.AlgorithmIndex >= kAlgorithmCount) {
+        status.Error = ParseError::FrameAlgorithm;
+        status.Value = frame.AlgorithmIndex;
     }
+    return status;
+}
 
-    // Monta o JsonMessage
-    JsonMessage result;
-    result.AlgorithmID = algorithmId;
-    // Timestamp ISO 8601 (simplificado)
-    // Você poderia usar <chrono> e formatar adequadamente.
-    auto now = std::chrono::system_clock::now();
-    std::time_t now_c = std::chrono::system_clock::to_time_t(now);
-    std::stringstream ss;
-    ss << std::put_time(std::gmtime(&now_c), "%FT%TZ");
-    result.Timestamp = ss.str();
-
-    result.Status      = status;
-
-    if (algorithmId == "BlindSpotDetection") {
-        result.Data = {
-            {"Side", side},
-            {"DistanceToVehicle", distance / 100.0}
-        };
-    } else {
-        result.Data = {
-            {"DistanceToVehicle", distance / 100.0}
-        };
+// Monta CanMessage / CanMessageSimulator a partir do frame binário,
+// para seguir pela mesma conversão dos tópicos JSON.
+template <typename Msg>
+Msg frameToMessage(const CanFrame& frame) {
+    Msg msg{};
+    msg.AlgorithmID.assign(kAlgorithmNames[frame.AlgorithmIndex]);
+    msg.CAN_Message.ArbitrationId = static_cast<int>(frame.ArbitrationId);
+    msg.CAN_Message.Data.assign(frame.Data, frame.Data + frame.Dlc);
+    msg.SourceTimestampUs = static_cast<int64_t>(frame.TimestampUs);
+    return msg;
+}
+
+/* -----------------------------------------------------------------------
+   Leitor de JSON no estilo SAX, sem alocação.
+   O json::sax_parse monta um lexer novo a cada chamada, e os buffers
+   dele (o token e o texto do token) crescem de novo a cada payload:
+   umas 8 alocações por frame. JsonScanner percorre o payload direto. As
+   chaves e as strings sem escape chegam ao handler como string_view do
+   próprio payload; as com escape são decodificadas num buffer do
+   thread, que mantém a capacidade (a view vale até a próxima string).
+   Aceita o mesmo que a nlohmann no modo estrito: RFC 8259, UTF-8
+   válido, surrogates só em par e nada além de espaço (ou de um '\0',
+   que encerra a entrada) depois do valor.
+   Os números seguem a mesma regra de tipo: inteiro com sinal, sem sinal
+   ou, com fração/expoente ou fora de 64 bits, double. Não usa recursão;
+   aninhamento além de JSON_MAX_DEPTH é erro de sintaxe.
+
+   O handler implementa null(), boolean(b), number_integer(i),
+   number_unsigned(u), number_float(d), string(s), key(s),
+   start_object(), end_object(), start_array(), end_array() (false
+   interrompe o parse) e parse_error(byte).
+   -----------------------------------------------------------------------*/
+// Mesmas regras do decodificador UTF-8 da nlohmann (sem overlong/surrogates)
+inline bool isValidUtf8(std::string_view s) {
+    size_t i = 0;
+    while (i < s.size()) {
+        unsigned char c = s[i];
+        if (c < 0x80) { ++i; continue; }
+        size_t len;
+        unsigned char lo = 0x80, hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) len = 2;
+        else if (c == 0xE0) { len = 3; lo = 0xA0; }
+        else if (c == 0xED) { len = 3; hi = 0x9F; }
+        else if (c >= 0xE1 && c <= 0xEF) len = 3;
+        else if (c == 0xF0) { len = 4; lo = 0x90; }
+        else if (c == 0xF4) { len = 4; hi = 0x8F; }
+        else if (c >= 0xF1 && c <= 0xF3) len = 4;
+        else return false;
+        if (i + len > s.size()) return false;
+        unsigned char c1 = s[i + 1];
+        if (c1 < lo || c1 > hi) return false;
+        for (size_t j = 2; j < len; ++j) {
+            unsigned char cj = s[i + j];
+            if (cj < 0x80 || cj > 0xBF) return false;
+        }
+        i += len;
     }
-    return result;
+    return true;
 }
 
-JsonMessage canToJsonSim(const CanMessageSimulator& simMsg) {
-    // É praticamente o mesmo parse, só muda o tipo do objeto (nome da classe).
-    int arbitrationId = simMsg.CAN_Message.ArbitrationId;
-    const auto &data  = simMsg.CAN_Message.Data;
+constexpr size_t JSON_MAX_DEPTH = 64;   // um bit por nível em JsonScanner::arrays_
+
+class JsonScanner {
+public:
+    explicit JsonScanner(std::string_view text)
+        : begin_(text.data()), p_(text.data()), end_(text.data() + text.size()) {}
 
-    std::string algorithmId = simMsg.AlgorithmID.empty()
-                              ? "Unknown"
-                              : simMsg.AlgorithmID;
+    // true se o texto inteiro é um valor JSON e o handler aceitou tudo
+    template <typename Handler>
+    bool parse(Handler& h) {
+        size_t depth = 0;
+        for (;;) {
+            skipSpace();
+            if (p_ == end_) return fail(h);
+            bool done = true;   // o valor acabou (escalar ou contêiner vazio)
+            switch (*p_) {
+            case '{':
+            case '[': {
+                bool array = *p_ == '[';
+                if (depth == JSON_MAX_DEPTH) return fail(h);
+                ++p_;
+                if (!(array ? h.start_array() : h.start_object())) return false;
+                skipSpace();
+                if (p_ < end_ && *p_ == (array ? ']' : '}')) {
+                    ++p_;
+                    if (!(array ? h.end_array() : h.end_object())) return false;
+                    break;
+                }
+                uint64_t bit = uint64_t(1) << depth++;
+                arrays_ = array ? (arrays_ | bit) : (arrays_ & ~bit);
+                if (!array && !key(h)) return false;
+                done = false;
+                break;
+            }
+            case '"': {
+                std::string_view text;
+                if (!readString(text)) return fail(h);
+                if (!h.string(text)) return false;
+                break;
+            }
+            case 't':
+                if (!literal("true")) return fail(h);
+                if (!h.boolean(true)) return false;
+                break;
+            case 'f':
+                if (!literal("false")) return fail(h);
+                if (!h.boolean(false)) return false;
+                break;
+            case 'n':
+                if (!literal("null")) return fail(h);
+                if (!h.null()) return false;
+                break;
+            default:
+                if (!number(h)) return false;
+            }
+            if (!done) continue;
 
-    bool status = (data.size() > 0 && data[0] == 1);
-    int distance = 0;
-    if (data.size() > 2) {
-        distance = (data[2] << 8) | data[1];
+            // Depois de um valor: fecha contêineres até achar a vírgula do próximo
+            for (;;) {
+                skipSpace();
+                if (depth == 0) {
+                    // Um '\0' encerra a entrada, como na nlohmann (clientes C mandam o terminador)
+                    if (p_ != end_ && *p_ != '\0') return fail(h);
+                    return true;
+                }
+                bool array = (arrays_ >> (depth - 1)) & 1;
+                if (p_ == end_) return fail(h);
+                if (*p_ == ',') {
+                    ++p_;
+                    if (!array && !key(h)) return false;
+                    break;
+                }
+                if (*p_ != (array ? ']' : '}')) return fail(h);
+                ++p_;
+                --depth;
+                if (!(array ? h.end_array() : h.end_object())) return false;
+            }
+        }
     }
 
-    std::string side = "Esquerda";
-    if (algorithmId == "BlindSpotDetection" && data.size() > 3 && data[3] == 1) {
-        side = "Direita";
+private:
+    template <typename Handler>
+    bool fail(Handler& h) {
+        h.parse_error(static_cast<size_t>(p_ - begin_));
+        return false;
     }
 
-    JsonMessage result;
-    result.AlgorithmID = algorithmId;
-    result.Timestamp   = "2025-01-31T12:00:00Z"; // Exemplo
-    result.Status      = status;
-
-    if (algorithmId == "BlindSpotDetection") {
-        result.Data = {
-            {"Side", side},
-            {"DistanceToVehicle", distance / 100.0}
-        };
-    } else {
-        result.Data = {
-            {"DistanceToVehicle", distance / 100.0},
-            {"Prioridade", prioridade}
+    void skipSpace() {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) ++p_;
+    }
+
+    bool literal(std::string_view word) {
+        if (static_cast<size_t>(end_ - p_) < word.size() || std::string_view(p_, word.size()) != word) return false;
+        p_ += word.size();
+        return true;
+    }
+
+    // "chave" e o ':' que a segue
+    template <typename Handler>
+    bool key(Handler& h) {
+        skipSpace();
+        std::string_view name;
+        if (p_ == end_ || *p_ != '"' || !readString(name)) return fail(h);
+        if (!h.key(name)) return false;
+        skipSpace();
+        if (p_ == end_ || *p_ != ':') return fail(h);
+        ++p_;
+        return true;
+    }
+
+    template <typename Handler>
+    bool number(Handler& h) {
+        const char* start = p_;
+        auto digits = [this] {
+            const char* from = p_;
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9') ++p_;
+            return p_ != from;
         };
+        if (p_ < end_ && *p_ == '-') ++p_;
+        if (p_ < end_ && *p_ == '0') ++p_;
+        else if (!digits()) return fail(h);
+        bool integer = true;
+        if (p_ < end_ && *p_ == '.') {
+            ++p_;
+            if (!digits()) return fail(h);
+            integer = false;
+        }
+        if (p_ < end_ && (*p_ == 'e' || *p_ == 'E')) {
+            ++p_;
+            if (p_ < end_ && (*p_ == '+' || *p_ == '-')) ++p_;
+            if (!digits()) return fail(h);
+            integer = false;
+        }
+        if (integer) {
+            if (*start == '-') {
+                int64_t value;
+                if (std::from_chars(start, p_, value).ec == std::errc()) return h.number_integer(value);
+            } else {
+                uint64_t value;
+                if (std::from_chars(start, p_, value).ec == std::errc()) return h.number_unsigned(value);
+            }
+        }
+        // Fora de 64 bits vira double, como na nlohmann; fora do double é erro, também como nela
+        double value = 0;
+        if (std::from_chars(start, p_, value).ec != std::errc()) return fail(h);
+        return h.number_float(value);
     }
 
-    return result;
-}
+    // p_ na aspa de abertura; sai depois da de fechamento
+    bool readString(std::string_view& out) {
+        const char* start = ++p_;
+        while (p_ < end_) {
+            unsigned char c = static_cast<unsigned char>(*p_);
+            if (c == '"') {
+                out = std::string_view(start, static_cast<size_t>(p_ - start));
+                if (!isValidUtf8(out)) return false;
+                ++p_;
+                return true;
+            }
+            if (c == '\\') return readEscaped(start, out);
+            if (c < 0x20) return false;
+            ++p_;
+        }
+        return false;
+    }
+
+    // Caminho lento: copia para o buffer do thread decodificando os escapes
+    bool readEscaped(const char* start, std::string_view& out) {
+        thread_local std::string buffer;
+        buffer.assign(start, p_);
+        while (p_ < end_) {
+            unsigned char c = static_cast<unsigned char>(*p_);
+            if (c == '"') {
+                if (!isValidUtf8(buffer)) return false;
+                out = buffer;
+                ++p_;
+                return true;
+            }
+            if (c < 0x20) return false;
+            ++p_;
+            if (c != '\\') {
+                buffer.push_back(static_cast<char>(c));
+                continue;
+            }
+            if (p_ == end_) return false;
+            char e = *p_++;
+            switch (e) {
+            case '"':  buffer.push_back('"');  break;
+            case '\\': buffer.push_back('\\'); break;
+            case '/':  buffer.push_back('/');  break;
+            case 'b':  buffer.push_back('\b'); break;
+            case 'f':  buffer.push_back('\f'); break;
+            case 'n':  buffer.push_back('\n'); break;
+            case 'r':  buffer.push_back('\r'); break;
+            case 't':  buffer.push_back('\t'); break;
+            case 'u': {
+                uint32_t cp;
+                if (!hex4(cp)) return false;
+                if (cp >= 0xDC00 && cp <= 0xDFFF) return false;   // surrogate baixo sozinho
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    uint32_t low;
+                    if (end_ - p_ < 2 || p_[0] != '\\' || p_[1] != 'u') return false;
+                    p_ += 2;
+                    if (!hex4(low) || low < 0xDC00 || low > 0xDFFF) return false;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUtf8(buffer, cp);
+                break;
+            }
+            default:
+                --p_;   // o erro aponta para o caractere do escape
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool hex4(uint32_t& value) {
+        if (end_ - p_ < 4) return false;
+        value = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = *p_;
+            uint32_t digit;
+            if (c >= '0' && c <= '9') digit = static_cast<uint32_t>(c - '0');
+            else if (c >= 'a' && c <= 'f') digit = static_cast<uint32_t>(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') digit = static_cast<uint32_t>(c - 'A' + 10);
+            else return false;
+            value = (value << 4) | digit;
+            ++p_;
+        }
+        return true;
+    }
+
+    static void appendUtf8(std::string& out, uint32_t cp) {
+        if (cp < 0x80) {
+            out.push_back(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+
+    const char* begin_;
+    const char* p_;
+    const char* end_;
+    uint64_t arrays_ = 0;   // bit d: o contêiner no nível d é um array
+};
 
 /* -----------------------------------------------------------------------
-   Callback para lidar com mensagens recebidas.
+   Parse dos frames em JSON ("can/messages" e "sim/canmessages").
+   Usa o JsonScanner acima: só o nome do algoritmo, o
+   ArbitrationId e os bytes de dados vão para o frame; o resto do payload
+   (campos de diagnóstico etc.) é validado e descartado, sem montar DOM.
+   Erros de tipo seguem o que o json::value()/get<int>() acusava antes.
+   O AlgorithmID vai até CAN_MAX_ALGORITHM_ID_LEN (47) bytes: um nome
+   maior é recusado (algorithm_id_length) e segue para o dead-letter, em
+   vez de sair cortado.
    -----------------------------------------------------------------------*/
-class BrokerLogicCallback : public virtual mqtt::callback
-{
+struct CanJsonKeys {
+    const char* AlgorithmId;
+    const char* CanMessage;
+    const char* ArbitrationId;
+    const char* Data;
+};
+
+// Frame real (.NET) e simulador
+constexpr CanJsonKeys kCanJsonKeys{ "AlgorithmID", "CAN_Message", "ArbitrationId", "Data" };
+constexpr CanJsonKeys kSimJsonKeys{ "algorithm_id", "can_message", "arbitration_id", "data" };
+
+// Família de origem do frame (estado de dedup separado por família)
+enum class FrameSource : size_t { Can = 0, Sim = 1 };
+
+// O que muda entre o frame real e o do simulador, resolvido em tempo de
+// compilação: parse, conversão e publicação são o mesmo código para as
+// duas origens. O timestamp segue a mesma política nas duas (o instante
+// do frame quando houver, senão o relógio local).
+template <typename Msg>
+struct CanSourceTraits;   // só existe para as duas origens
+
+template <>
+struct CanSourceTraits<CanMessage> {
+    static constexpr FrameSource Source = FrameSource::Can;
+    static constexpr const CanJsonKeys& Keys = kCanJsonKeys;
+    static constexpr bool SendsPrioridade = false;
+};
+
+template <>
+struct CanSourceTraits<CanMessageSimulator> {
+    static constexpr FrameSource Source = FrameSource::Sim;
+    static constexpr const CanJsonKeys& Keys = kSimJsonKeys;
+    static constexpr bool SendsPrioridade = true;   // sem "Side", o simulador manda a prioridade
+};
+
+template <typename Msg>
+class CanJsonSax {
 public:
-    // Recebe a referência do client, para podermos republicar mensagens.
-    BrokerLogicCallback(mqtt::async_client& cli)
-        : client_(cli)
-    {
-        // Inicializa dicionário de arbitration IDs para "sim/canmessages"
-        simArbitrationMap_ = {
-            { 0x100, "simsensor/blindspot" },
-            { 0x101, "simsensor/pedestrian" },
-            { 0x102, "simsensor/frontalcollision" },
-            { 0x103, "simsensor/rearcollision" }
-        };
+    CanJsonSax(const CanJsonKeys& keys, Msg& out) : keys_(keys), out_(out) {}
+
+    bool null() { return scalar("null"); }
+    bool boolean(bool val) { return number(val ? 1 : 0, "booleano"); }
+    bool number_integer(int64_t val) { return number(static_cast<int>(val), "número"); }
+    bool number_unsigned(uint64_t val) { return number(static_cast<int>(val), "número"); }
+    // Como o get<int>() de antes, só sem o estouro indefinido fora de int
+    bool number_float(double val) {
+        double clamped = std::max<double>(std::numeric_limits<int>::min(),
+                                          std::min<double>(std::numeric_limits<int>::max(), val));
+        return number(static_cast<int>(clamped), "número");
     }
 
-    // Método chamado quando chega uma mensagem
-    void message_arrived(mqtt::const_message_ptr msg) override {
-        std::string topic   = msg->get_topic();
-        std::string payload = msg->to_string();
+    bool string(std::string_view val) {
+        if (skip_ > 0) return true;
+        if (depth_ == 1 && pending_ == Field::AlgorithmId) {
+            // Cortar mudaria o nome (e a regra que casa com ele): recusa
+            if (val.size() > CAN_MAX_ALGORITHM_ID_LEN) {
+                status_.Value = static_cast<int64_t>(val.size());
+                return fail(ParseError::AlgorithmIdLength);
+            }
+            out_.AlgorithmID.assign(val);
+            pending_ = Field::None;
+            return true;
+        }
+        return scalar("string");
+    }
 
-        std::cout << "\n[Recebido] Tópico: " << topic << "\n"
-                  << "Payload: " << payload << std::endl;
+    bool start_object() {
+        if (skip_ > 0 || (depth_ > 0 && !enter(Field::CanMessage))) {
+            ++skip_;
+            return ok();
+        }
+        ++depth_;
+        return true;
+    }
 
-        try {
-            // Se o tópico começa com "sim/"
-            if (topic.rfind("sim/", 0) == 0) {
-                // Se for "sim/canmessages", parse especial
-                if (topic == "sim/canmessages") {
-                    // Tentar parse de JSON como CanMessageSimulator
-                    auto j = json::parse(payload);
-                    CanMessageSimulator simMsg;
-                    simMsg.AlgorithmID = j.value("algorithm_id", "");
-                    // Pegar can_message -> arbitration_id e data
-                    if (j.contains("can_message")) {
-                        auto cm = j["can_message"];
-                        simMsg.CAN_Message.ArbitrationId = cm.value("arbitration_id", 0);
-                        if (cm.contains("data") && cm["data"].is_array()) {
-                            for (auto &d : cm["data"]) {
-                                simMsg.CAN_Message.Data.push_back(d.get<int>());
-                            }
-                        }
-                    }
+    bool end_object() {
+        if (skip_ > 0) {
+            --skip_;
+            return true;
+        }
+        --depth_;
+        return true;
+    }
 
-                    // Log similar ao .NET
-                    std::cout << "Arbitration ID: " << std::hex
-                              << simMsg.CAN_Message.ArbitrationId << std::dec << "\n";
-                    std::cout << "Data Bytes: ";
-                    for (auto &b : simMsg.CAN_Message.Data) std::cout << b << " ";
-                    std::cout << std::endl;
-
-                    // Converter para JSON final
-                    auto jsonMsg = canToJsonSim(simMsg);
-                    json outPayload = {
-                        {"AlgorithmID", jsonMsg.AlgorithmID},
-                        {"Timestamp",   jsonMsg.Timestamp},
-                        {"Status",      jsonMsg.Status},
-                        {"Data",        jsonMsg.Data}
-                    };
-
-                    // Verificar se há um tópico mapeado no dictionary
-                    int arb = simMsg.CAN_Message.ArbitrationId;
-                    if (simArbitrationMap_.find(arb) != simArbitrationMap_.end()) {
-                        std::string targetTopic = simArbitrationMap_[arb];
-
-                        // Publica no tópico mapeado
-                        publishMessage(targetTopic, outPayload.dump());
-                        std::cout << "Mensagem redirecionada para " << targetTopic << std::endl;
-                    } else {
-                        std::cout << "ArbitrationId não mapeado para tópico específico." << std::endl;
-                    }
-                }
-                else {
-                    // Para outros sub-tópicos "sim/...", redirecionar para "moto/..."
-                    std::string newTopic = "moto/" + topic.substr(4);
-                    publishMessage(newTopic, payload);
-                    std::cout << "(Simulação) Tópico: " << topic
-                              << " -> Redirecionado para: " << newTopic
-                              << " com valor: " << payload << std::endl;
-                }
-            }
-            // Se o tópico for "can/messages"
-            else if (topic == "can/messages") {
-                auto j = json::parse(payload);
-                CanMessage canMsg;
-                canMsg.AlgorithmID = j.value("AlgorithmID", "");
-                if (j.contains("CAN_Message")) {
-                    auto cm = j["CAN_Message"];
-                    canMsg.CAN_Message.ArbitrationId = cm.value("ArbitrationId", 0);
-                    if (cm.contains("Data") && cm["Data"].is_array()) {
-                        for (auto &d : cm["Data"]) {
-                            canMsg.CAN_Message.Data.push_back(d.get<int>());
-                        }
-                    }
-                }
+    bool start_array() {
+        if (depth_ == 0) return fail(ParseError::NotObject);
+        if (skip_ > 0 || !enter(Field::Data)) {
+            ++skip_;
+            return ok();
+        }
+        inData_ = true;
+        return true;
+    }
 
-                // Log
-                std::cout << "Arbitration ID: " << std::hex
-                          << canMsg.CAN_Message.ArbitrationId << std::dec << "\n";
-                std::cout << "Data Bytes: ";
-                for (auto &b : canMsg.CAN_Message.Data) std::cout << b << " ";
-                std::cout << std::endl;
-
-                // Converter para JSON final e publicar em "sensor/sensordetector"
-                auto jsonMsg = canToJson(canMsg);
-                json outPayload = {
-                    {"AlgorithmID", jsonMsg.AlgorithmID},
-                    {"Timestamp",   jsonMsg.Timestamp},
-                    {"Status",      jsonMsg.Status},
-                    {"Data",        jsonMsg.Data}
-                };
-
-                std::string targetTopic = "sensor/sensordetector";
-                publishMessage(targetTopic, outPayload.dump());
-                std::cout << "Mensagem redirecionada para o tópico " << targetTopic << std::endl;
-            }
-            // Se chegou aqui, não era "sim/" nem "can/messages"
-            else {
-                std::cout << "Tópico não previsto na lógica: " << topic << std::endl;
+    bool end_array() {
+        if (skip_ > 0) {
+            --skip_;
+            return true;
+        }
+        inData_ = false;
+        return true;
+    }
+
+    bool key(std::string_view val) {
+        if (skip_ > 0) return true;
+        pending_ = Field::None;
+        // Chaves repetidas: vale a última, como no DOM
+        if (depth_ == 1) {
+            if (val == keys_.AlgorithmId) {
+                pending_ = Field::AlgorithmId;
+            } else if (val == keys_.CanMessage) {
+                out_.CAN_Message.ArbitrationId = 0;
+                out_.CAN_Message.Data.clear();
+                pending_ = Field::CanMessage;
+            }
+        } else if (depth_ == 2) {
+            if (val == keys_.ArbitrationId) {
+                pending_ = Field::ArbitrationId;
+            } else if (val == keys_.Data) {
+                out_.CAN_Message.Data.clear();
+                pending_ = Field::Data;
             }
         }
-        catch (std::exception &ex) {
-            std::cerr << "Erro ao processar mensagem: " << ex.what() << std::endl;
+        return true;
+    }
+
+    // Byte onde a sintaxe quebrou
+    void parse_error(std::size_t position) {
+        status_.Offset = position;
+        fail(ParseError::Syntax);
+    }
+
+    const ParseStatus& status() const { return status_; }
+
+private:
+    enum class Field { None, AlgorithmId, CanMessage, ArbitrationId, Data };
+
+    // Guarda o primeiro erro; o false devolvido ao JsonScanner interrompe o parse
+    bool fail(ParseError error, const char* found = nullptr) {
+        if (status_.ok()) {
+            status_.Error = error;
+            status_.Found = found;
+        }
+        return false;
+    }
+
+    bool ok() const { return status_.ok(); }
+
+    // Um objeto/array só é percorrido se for o valor esperado na posição.
+    // Se o valor ocupa o lugar de um campo de outro tipo, registra o erro e
+    // devolve false (quem chama confere ok()).
+    bool enter(Field container) {
+        Field field = pending_;
+        pending_ = Field::None;
+        const char* found = container == Field::Data ? "array" : "objeto";
+        if (inData_) return fail(ParseError::DataItemType, found);
+        if (depth_ == 1 && field == Field::AlgorithmId) return fail(ParseError::AlgorithmIdType, found);
+        if (depth_ == 1 && field == Field::CanMessage) {
+            if (container != Field::CanMessage) return fail(ParseError::CanMessageType, found);
+            return true;
+        }
+        if (depth_ == 2 && field == Field::ArbitrationId) return fail(ParseError::ArbitrationIdType, found);
+        // "Data" que não é array é ignorado, como no is_array() de antes
+        return depth_ == 2 && field == Field::Data && container == Field::Data;
+    }
+
+    // Valor numérico (ou booleano, que o get<int>() também aceitava)
+    bool number(int value, const char* type) {
+        if (skip_ > 0) return true;
+        if (inData_) {
+            ParseError error = pushDataByte(out_.CAN_Message, value);
+            if (error == ParseError::None) return true;
+            status_.Value = value;
+            return fail(error);
+        }
+        if (depth_ == 2 && pending_ == Field::ArbitrationId) {
+            out_.CAN_Message.ArbitrationId = value;
+            pending_ = Field::None;
+            return true;
+        }
+        return scalar(type);
+    }
+
+    // Escalar fora dos campos lidos: descartado, a menos que ocupe o lugar
+    // de um campo de outro tipo
+    bool scalar(const char* type) {
+        if (skip_ > 0) return true;
+        if (depth_ == 0) return fail(ParseError::NotObject, type);
+        if (inData_) return fail(ParseError::DataItemType, type);
+        Field field = pending_;
+        pending_ = Field::None;
+        if (depth_ == 1 && field == Field::AlgorithmId) return fail(ParseError::AlgorithmIdType, type);
+        if (depth_ == 1 && field == Field::CanMessage) return fail(ParseError::CanMessageType, type);
+        if (depth_ == 2 && field == Field::ArbitrationId) return fail(ParseError::ArbitrationIdType, type);
+        return true;
+    }
+
+    const CanJsonKeys& keys_;
+    Msg& out_;
+    ParseStatus status_;
+    int depth_ = 0;              // 1 = objeto raiz, 2 = objeto do frame
+    unsigned skip_ = 0;          // profundidade dentro de um valor descartado
+    bool inData_ = false;
+    Field pending_ = Field::None;
+};
+
+// Preenche o frame a partir do payload JSON, sem lançar: o status diz o
+// que havia de errado (e o frame fica pela metade).
+template <typename Msg>
+ParseStatus parseCanJson(std::string_view payload, Msg& msg, const CanJsonKeys& keys = CanSourceTraits<Msg>::Keys) {
+    msg = Msg{};
+    CanJsonSax<Msg> sax(keys, msg);
+    JsonScanner(payload).parse(sax);
+    return sax.status();
+}
+
+// Texto do erro para o log/dead-letter (só nas mensagens amostradas).
+// keys = nullptr para os frames binários.
+inline std::string describeParseError(const ParseStatus& status, const CanJsonKeys* keys) {
+    auto field = [&](const char* CanJsonKeys::* name, const char* what) {
+        std::string text = std::string("\"") + (keys ? keys->*name : "?") + "\" " + what;
+        if (status.Found) text += std::string(" (") + status.Found + ")";
+        return text;
+    };
+    switch (status.Error) {
+        case ParseError::None:
+            return "sem erro";
+        case ParseError::Syntax:
+            return status.Offset == PARSE_NO_OFFSET
+                ? std::string("JSON malformado")
+                : "JSON malformado no byte " + std::to_string(status.Offset);
+        case ParseError::NotObject:
+            return "o payload não é um objeto JSON";
+        case ParseError::AlgorithmIdType:
+            return field(&CanJsonKeys::AlgorithmId, "não é uma string");
+        case ParseError::AlgorithmIdLength:
+            return field(&CanJsonKeys::AlgorithmId, "com ") + std::to_string(status.Value) +
+                   " bytes (máximo " + std::to_string(CAN_MAX_ALGORITHM_ID_LEN) + ")";
+        case ParseError::CanMessageType:
+            return field(&CanJsonKeys::CanMessage, "não é um objeto");
+        case ParseError::ArbitrationIdType:
+            return field(&CanJsonKeys::ArbitrationId, "não é um número");
+        case ParseError::DataItemType:
+            return "item de " + field(&CanJsonKeys::Data, "não é um número");
+        case ParseError::DataByteRange:
+            return "byte de dados fora da faixa 0..255: " + std::to_string(status.Value);
+        case ParseError::DataTooLong:
+            return "frame com mais de " + std::to_string(CAN_MAX_DATA_LEN) + " bytes de dados";
+        case ParseError::FrameSize:
+            return "frame binário com " + std::to_string(status.Value) + " bytes (esperado " +
+                   std::to_string(CAN_BIN_FRAME_SIZE) + ")";
+        case ParseError::FrameDlc:
+            return "DLC " + std::to_string(status.Value) + " acima de 8";
+        case ParseError::FrameAlgorithm:
+            return "índice de algoritmo desconhecido: " + std::to_string(status.Value);
+        case ParseError::Count:
+            break;
+    }
+    return "erro desconhecido";
+}
+
+/* -----------------------------------------------------------------------
+   jsonMessage final, equivalente a:
+     public class JsonMessage
+   Sem DOM: os campos de "Data" são fixos e vão direto para o JsonWriter.
+   -----------------------------------------------------------------------*/
+struct JsonMessageData {
+    double      DistanceToVehicle;
+    const char* Side;          // nullptr = campo ausente
+    bool        SideSet;       // Side é o segundo rótulo (byte do lado == 1)
+    bool        HasPrioridade;
+    int         Prioridade;
+};
+
+struct JsonMessage {
+    std::string_view AlgorithmID;  // aponta para a mensagem de origem ou literal
+    InlineString<32> Timestamp;
+    int64_t TimestampUs;           // o mesmo instante, para as saídas binárias
+    bool Status;
+    JsonMessageData Data;
+};
+
+/* -----------------------------------------------------------------------
+   Timestamps ISO 8601 (UTC) para o JSON de saída.
+   O relógio de parede é derivado do steady_clock (ressincronizado com o
+   system_clock a cada minuto) e cada thread guarda a parte
+   "AAAA-MM-DDTHH:MM:SS" do último segundo formatado: só refaz o texto
+   quando o segundo muda. Milissegundos/microssegundos são só um append.
+   -----------------------------------------------------------------------*/
+enum class TimestampPrecision { Seconds, Millis, Micros };
+
+class TimestampService {
+public:
+    static constexpr size_t MAX_LEN = 27;   // "AAAA-MM-DDTHH:MM:SS.uuuuuuZ"
+
+    TimestampService() { resync(steadyMicros()); }
+
+    void setPrecision(TimestampPrecision p) { precision_ = p; }
+    TimestampPrecision precision() const { return precision_; }
+
+    // Usar o instante de origem do frame (quando houver) em vez do local
+    void setUseSourceTimestamp(bool on) { useSource_ = on; }
+    bool useSourceTimestamp() const { return useSource_; }
+
+    // Instante atual em µs desde a epoch Unix
+    int64_t nowMicros() {
+        int64_t steady = steadyMicros();
+        if (steady >= nextResync_.load(std::memory_order_relaxed)) resync(steady);
+        return steady + offsetUs_.load(std::memory_order_relaxed);
+    }
+
+    // Formata o instante em out (>= MAX_LEN bytes) e retorna o tamanho
+    size_t format(int64_t unixMicros, char* out) const {
+        int64_t sec = unixMicros >= 0 ? unixMicros / 1000000 : (unixMicros - 999999) / 1000000;
+        int64_t frac = unixMicros - sec * 1000000;
+
+        thread_local int64_t cachedSec = INT64_MIN;
+        thread_local char cached[19];
+        if (sec != cachedSec) {
+            formatSeconds(sec, cached);
+            cachedSec = sec;
+        }
+
+        std::memcpy(out, cached, sizeof(cached));
+        size_t n = sizeof(cached);
+        if (precision_ == TimestampPrecision::Millis) {
+            out[n++] = '.';
+            n += writeDigits(out + n, frac / 1000, 3);
+        } else if (precision_ == TimestampPrecision::Micros) {
+            out[n++] = '.';
+            n += writeDigits(out + n, frac, 6);
         }
+        out[n++] = 'Z';
+        return n;
+    }
+
+    // Instante de origem se houver (e estiver habilitado), senão o atual
+    int64_t instant(int64_t sourceMicros) {
+        return (useSource_ && sourceMicros > 0) ? sourceMicros : nowMicros();
+    }
+
+    size_t format(int64_t sourceMicros, InlineString<32>& out) {
+        return formatInstant(instant(sourceMicros), out);
+    }
+
+    size_t formatInstant(int64_t unixMicros, InlineString<32>& out) const {
+        char tmp[MAX_LEN];
+        size_t n = format(unixMicros, tmp);
+        out.assign(std::string_view(tmp, n));
+        return n;
     }
 
 private:
-    mqtt::async_client& client_;
+    std::atomic<int64_t> offsetUs_{0};      // relógio de parede - steady
+    std::atomic<int64_t> nextResync_{0};
+    TimestampPrecision precision_ = TimestampPrecision::Seconds;
+    bool useSource_ = true;
+
+    static int64_t steadyMicros() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void resync(int64_t steady) {
+        int64_t wall = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        offsetUs_.store(wall - steady, std::memory_order_relaxed);
+        nextResync_.store(steady + 60 * 1000000LL, std::memory_order_relaxed);
+    }
+
+    static size_t writeDigits(char* out, int64_t v, int width) {
+        for (int i = width - 1; i >= 0; --i) {
+            out[i] = static_cast<char>('0' + v % 10);
+            v /= 10;
+        }
+        return static_cast<size_t>(width);
+    }
 
-    // Dicionário para mapear arbitrationId -> tópico, no caso "sim/canmessages"
-    std::unordered_map<int, std::string> simArbitrationMap_;
+    // "AAAA-MM-DDTHH:MM:SS" (algoritmo days_from_civil inverso, H. Hinnant)
+    static void formatSeconds(int64_t sec, char* out) {
+        int64_t days = sec >= 0 ? sec / 86400 : (sec - 86399) / 86400;
+        int64_t rem = sec - days * 86400;
 
-    // Função auxiliar para publicar mensagens
-    void publishMessage(const std::string &topic, const std::string &payload) {
-        auto msg = mqtt::make_message(topic, payload);
-        msg->set_qos(1);
-        msg->set_retained(true); // se quiser replicar .WithRetainFlag()
-        client_.publish(msg);
+        int64_t z = days + 719468;
+        int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+        int64_t doe = z - era * 146097;
+        int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        int64_t mp = (5 * doy + 2) / 153;
+        int64_t day = doy - (153 * mp + 2) / 5 + 1;
+        int64_t month = mp < 10 ? mp + 3 : mp - 9;
+        int64_t year = yoe + era * 400 + (month <= 2);
+
+        writeDigits(out, year, 4);
+        out[4] = '-';
+        writeDigits(out + 5, month, 2);
+        out[7] = '-';
+        writeDigits(out + 8, day, 2);
+        out[10] = 'T';
+        writeDigits(out + 11, rem / 3600, 2);
+        out[13] = ':';
+        writeDigits(out + 14, (rem / 60) % 60, 2);
+        out[16] = ':';
+        writeDigits(out + 17, rem % 60, 2);
     }
 };
 
+inline TimestampService& timestampService() {
+    static TimestampService service;
+    return service;
+}
+
 /* -----------------------------------------------------------------------
-   main(): Conecta ao broker Mosquitto, assina nos tópicos, e processa
-   mensagens via callback.
+   Decoders por ArbitrationId.
+   Cada decoder descreve o layout do payload (bytes de status e
+   distância, escala, campo enumerado Side) e o tópico de saída.
+   Os decoders conhecidos são especializações constexpr de KnownDecoder;
+   a DecoderTable indexa todos por ArbitrationId com acesso direto.
+   Uma tabela também pode vir do arquivo de configuração (parseDecoders);
+   nesse caso ela guarda as strings dos tópicos e rótulos.
    -----------------------------------------------------------------------*/
-int main() {
-    // Endereço do broker local (Mosquitto rodando em 1883)
-    const std::string address   = "tcp://172.20.0.14:1884";
-    const std::string clientId  = "CppBroker";
+constexpr int8_t NO_FIELD = -1;
 
-    std::cout << "Iniciando a lógica MQTT em C++..." << std::endl;
+// Classe de prioridade do decoder: High passa à frente do tráfego normal
+// nas filas do pool e do publicador (alertas de colisão e pedestre).
+enum class PriorityLane : uint8_t { Normal = 0, High = 1 };
+constexpr size_t PRIORITY_LANES = 2;
 
-    // Cria cliente MQTT
-    mqtt::async_client client(address, clientId);
-    // Instancia callback com nossa lógica
-    BrokerLogicCallback myCallback(client);
-    client.set_callback(myCallback);
+inline const char* priorityLaneName(PriorityLane lane) {
+    return lane == PriorityLane::High ? "high" : "normal";
+}
 
-    // Opções de conexão
-    mqtt::connect_options connOpts;
-    connOpts.set_clean_session(true);
+inline bool parsePriorityLane(std::string_view name, PriorityLane& out) {
+    if (name == "normal") out = PriorityLane::Normal;
+    else if (name == "high") out = PriorityLane::High;
+    else return false;
+    return true;
+}
 
-    try {
-        std::cout << "Conectando ao broker " << address << "..." << std::endl;
-        client.connect(connOpts)->wait();
-        std::cout << "Conectado ao broker.\n";
+/* -----------------------------------------------------------------------
+   Política de entrega de um tópico de saída: QoS, retained e, no MQTT 5,
+   a expiração da mensagem. Rotas e decoders definem só o que muda; o
+   resto é herdado (rota > decoder > padrão: QoS 1, retained, sem
+   expiração). Com "adaptive_qos", a fila normal cai para QoS 0 enquanto
+   o publicador estiver sob contrapressão; a fila de alta prioridade
+   (alertas de segurança) nunca é rebaixada.
+   "format" escolhe a codificação da leitura: o primeiro formato sai no
+   tópico de saída e cada um dos outros num tópico paralelo,
+   "<tópico>/<formato>" (ex.: JSON para o painel e CBOR para os
+   consumidores internos). Numa rota passthrough ou drop, "format" é
+   erro: não há leitura para codificar.
+   -----------------------------------------------------------------------*/
+constexpr int8_t POLICY_INHERIT = -1;
+constexpr const char* CONTENT_TYPE_JSON = "application/json";
 
-        // Assina nos tópicos principais
-        client.subscribe("sim/#", 1)->wait();
-        client.subscribe("can/messages", 1)->wait();
+enum class OutputFormat : uint8_t { Json, Cbor, MsgPack, Binary };
+constexpr size_t MAX_OUTPUT_FORMATS = 4;
+
+struct OutputFormatInfo {
+    const char* Name;          // em "format" e no sufixo do tópico paralelo
+    const char* ContentType;
+    bool        Utf8;          // indicador de formato do payload no MQTT 5
+};
 
-        std::cout << "Assinatura concluída. Aguardando mensagens...\n";
-        std::cout << "Pressione CTRL+C para encerrar.\n";
+inline const OutputFormatInfo& outputFormatInfo(OutputFormat format) {
+    static const OutputFormatInfo infos[] = {
+        { "json",    CONTENT_TYPE_JSON,          true  },
+        { "cbor",    "application/cbor",         false },
+        { "msgpack", "application/msgpack",      false },
+        { "binary",  "application/octet-stream", false },
+    };
+    return infos[static_cast<size_t>(format)];
+}
 
-        // Mantém o programa vivo
-        while(true) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+inline bool parseOutputFormat(std::string_view name, OutputFormat& out) {
+    for (OutputFormat f : {OutputFormat::Json, OutputFormat::Cbor, OutputFormat::MsgPack, OutputFormat::Binary}) {
+        if (name == outputFormatInfo(f).Name) {
+            out = f;
+            return true;
         }
+    }
+    return false;
+}
+
+struct OutputFormats {
+    uint8_t      Count = 0;   // 0 = herda
+    OutputFormat List[MAX_OUTPUT_FORMATS] = {};
+};
+
+struct DeliveryPolicy {
+    int8_t  Qos           = POLICY_INHERIT;   // 0, 1 ou 2
+    int8_t  Retained      = POLICY_INHERIT;   // 0/1
+    int8_t  Adaptive      = POLICY_INHERIT;   // 0/1
+    int32_t ExpirySeconds = POLICY_INHERIT;   // 0 = sem expiração
+    OutputFormats Formats;                    // Count 0 = herda
 
-        // (Opcional) se sair do loop, desconecta
-        // client.disconnect()->wait();
+    // Os campos definidos aqui; os demais, de base
+    DeliveryPolicy over(const DeliveryPolicy& base) const {
+        DeliveryPolicy p = *this;
+        if (p.Qos == POLICY_INHERIT) p.Qos = base.Qos;
+        if (p.Retained == POLICY_INHERIT) p.Retained = base.Retained;
+        if (p.Adaptive == POLICY_INHERIT) p.Adaptive = base.Adaptive;
+        if (p.ExpirySeconds == POLICY_INHERIT) p.ExpirySeconds = base.ExpirySeconds;
+        if (p.Formats.Count == 0) p.Formats = base.Formats;
+        return p;
     }
-    catch(const mqtt::exception &ex) {
-        std::cerr << "Erro na conexão MQTT: " << ex.what() << std::endl;
+
+    bool usesExpiry() const { return ExpirySeconds > 0; }
+};
+
+// Política resolvida, pronta para a publicação
+struct Delivery {
+    int      Qos = 1;
+    bool     Retained = true;   // se quiser replicar .WithRetainFlag()
+    bool     Adaptive = false;
+    uint32_t ExpirySeconds = 0;
+    const char* ContentType = CONTENT_TYPE_JSON;   // MQTT 5; nullptr = não declara (passthrough)
+    bool     Utf8 = true;                          // payload em texto (indicador de formato)
+    OutputFormats Formats{1, {OutputFormat::Json}};   // das leituras convertidas
+};
+
+inline Delivery resolveDelivery(const DeliveryPolicy& policy, bool adaptiveDefault) {
+    Delivery d;
+    if (policy.Qos != POLICY_INHERIT) d.Qos = policy.Qos;
+    if (policy.Retained != POLICY_INHERIT) d.Retained = policy.Retained != 0;
+    d.Adaptive = policy.Adaptive == POLICY_INHERIT ? adaptiveDefault : policy.Adaptive != 0;
+    if (policy.ExpirySeconds != POLICY_INHERIT) d.ExpirySeconds = static_cast<uint32_t>(policy.ExpirySeconds);
+    if (policy.Formats.Count > 0) d.Formats = policy.Formats;
+    return d;
+}
+
+// "qos", "retained", "adaptive_qos", "expiry_s" e "format" (um nome ou
+// uma lista, ex.: ["json", "cbor"]) de uma rota ou decoder
+inline DeliveryPolicy parseDeliveryPolicy(const json& entry, const std::string& where) {
+    DeliveryPolicy p;
+    if (entry.contains("qos")) {
+        int qos = entry.at("qos").get<int>();
+        if (qos < 0 || qos > 2) throw std::invalid_argument(where + ": qos deve ser 0, 1 ou 2");
+        p.Qos = static_cast<int8_t>(qos);
+    }
+    if (entry.contains("retained")) p.Retained = entry.at("retained").get<bool>() ? 1 : 0;
+    if (entry.contains("adaptive_qos")) p.Adaptive = entry.at("adaptive_qos").get<bool>() ? 1 : 0;
+    if (entry.contains("expiry_s")) {
+        long expiry = entry.at("expiry_s").get<long>();
+        if (expiry < 0 || expiry > INT32_MAX) throw std::invalid_argument(where + ": expiry_s fora da faixa");
+        p.ExpirySeconds = static_cast<int32_t>(expiry);
+    }
+    if (entry.contains("format")) {
+        const json &f = entry.at("format");
+        std::vector<std::string> names;
+        if (f.is_array()) {
+            for (const auto &name : f) names.push_back(name.get<std::string>());
+        } else {
+            names.push_back(f.get<std::string>());
+        }
+        if (names.empty() || names.size() > MAX_OUTPUT_FORMATS) {
+            throw std::invalid_argument(where + ": format deve ter de 1 a " + std::to_string(MAX_OUTPUT_FORMATS) + " formatos");
+        }
+        for (const auto &name : names) {
+            OutputFormat format;
+            if (!parseOutputFormat(name, format)) {
+                throw std::invalid_argument(where + ": formato desconhecido \"" + name + "\" (json, cbor, msgpack, binary)");
+            }
+            if (std::find(p.Formats.List, p.Formats.List + p.Formats.Count, format) != p.Formats.List + p.Formats.Count) {
+                throw std::invalid_argument(where + ": formato repetido \"" + name + "\"");
+            }
+            p.Formats.List[p.Formats.Count++] = format;
+        }
+    }
+    return p;
+}
+
+struct CanDecoder {
+    uint32_t    ArbitrationId;
+    const char* Topic;          // tópico de saída no simulador (nullptr = não publica)
+    uint8_t     StatusByte;     // status ativo quando o byte vale 1
+    uint8_t     DistanceLoByte; // distância: inteiro de 16 bits little-endian
+    uint8_t     DistanceHiByte;
+    double      DistanceDivisor;
+    int8_t      SideByte;       // NO_FIELD = sem campo "Side"
+    const char* SideLabels[2];  // rótulo para byte != 1 / byte == 1
+    int         Prioridade;     // enviada no simulador quando não há "Side"
+    PriorityLane Lane;          // fila de processamento/publicação
+    DeliveryPolicy Delivery{};  // QoS/retained/expiração do tópico de saída
+};
+
+template <uint32_t ArbitrationId>
+struct KnownDecoder;   // só existe para os IDs conhecidos
+
+template <>
+struct KnownDecoder<0x100> {
+    static constexpr CanDecoder value = {
+        0x100, "simsensor/blindspot", 0, 1, 2, 100.0, 3, {"Esquerda", "Direita"}, 0,
+        PriorityLane::Normal
+    };
+};
+
+template <>
+struct KnownDecoder<0x101> {
+    static constexpr CanDecoder value = {
+        0x101, "simsensor/pedestrian", 0, 1, 2, 100.0, NO_FIELD, {nullptr, nullptr}, 1,
+        PriorityLane::High
+    };
+};
+
+template <>
+struct KnownDecoder<0x102> {
+    static constexpr CanDecoder value = {
+        0x102, "simsensor/frontalcollision", 0, 1, 2, 100.0, NO_FIELD, {nullptr, nullptr}, 1,
+        PriorityLane::High
+    };
+};
+
+template <>
+struct KnownDecoder<0x103> {
+    static constexpr CanDecoder value = {
+        0x103, "simsensor/rearcollision", 0, 1, 2, 100.0, NO_FIELD, {nullptr, nullptr}, 2,
+        PriorityLane::Normal
+    };
+};
+
+constexpr CanDecoder kKnownDecoders[] = {
+    KnownDecoder<0x100>::value,
+    KnownDecoder<0x101>::value,
+    KnownDecoder<0x102>::value,
+    KnownDecoder<0x103>::value
+};
+
+// Layout genérico para IDs sem decoder próprio (regras antigas por AlgorithmID)
+constexpr CanDecoder kGenericDecoder = {
+    0, nullptr, 0, 1, 2, 100.0, NO_FIELD, {nullptr, nullptr}, 2, PriorityLane::Normal
+};
+constexpr CanDecoder kGenericBlindSpotDecoder = {
+    0, nullptr, 0, 1, 2, 100.0, 3, {"Esquerda", "Direita"}, 0, PriorityLane::Normal
+};
+
+class DecoderTable {
+public:
+    static constexpr uint32_t DENSE_IDS = 0x800;   // IDs padrão de 11 bits
+    static constexpr uint16_t NO_SLOT   = 0xFFFF;
+
+    DecoderTable() { dense_.fill(NO_SLOT); }
+
+    template <size_t N>
+    explicit DecoderTable(const CanDecoder (&decoders)[N]) : DecoderTable() {
+        for (const auto &d : decoders) add(d);
+    }
+
+    // Os decoders apontam para strings_: copiar deixaria a cópia apontando
+    // para as strings da original. Mover preserva os endereços (deque).
+    DecoderTable(const DecoderTable&) = delete;
+    DecoderTable& operator=(const DecoderTable&) = delete;
+    DecoderTable(DecoderTable&&) = default;
+    DecoderTable& operator=(DecoderTable&&) = default;
+
+    // Tabela a partir de um array JSON, como
+    //   [{"arbitration_id": "0x101", "topic": "simsensor/pedestrian",
+    //     "status_byte": 0, "distance_bytes": [1, 2], "distance_divisor": 100,
+    //     "side_byte": 3, "side_labels": ["Esquerda", "Direita"],
+    //     "prioridade": 1, "lane": "high"}, ...]
+    // Os campos omitidos ficam com o layout genérico; "topic" nulo ou
+    // ausente não publica no simulador. Lança std::invalid_argument.
+    static DecoderTable parseDecoders(const json& j) {
+        if (!j.is_array()) throw std::invalid_argument("decoders: esperado um array JSON");
+        DecoderTable table;
+        for (const auto &entry : j) {
+            if (!entry.is_object()) throw std::invalid_argument("decoders: esperado um objeto por decoder");
+            CanDecoder d = kGenericDecoder;
+            const json &arb = entry.at("arbitration_id");
+            if (arb.is_string()) {
+                std::string text = arb.get<std::string>();
+                char* end = nullptr;
+                unsigned long v = std::strtoul(text.c_str(), &end, 0);
+                if (text.empty() || *end != '\0') throw std::invalid_argument("decoders: arbitration_id inválido \"" + text + "\"");
+                d.ArbitrationId = static_cast<uint32_t>(v);
+            } else {
+                d.ArbitrationId = arb.get<uint32_t>();
+            }
+            std::string where = "decoders: 0x" + hexId(d.ArbitrationId);
+            if (entry.contains("topic") && !entry.at("topic").is_null()) {
+                d.Topic = table.keep(entry.at("topic").get<std::string>());
+            }
+            d.StatusByte = byteIndex(entry, "status_byte", d.StatusByte, where);
+            if (entry.contains("distance_bytes")) {
+                const json &bytes = entry.at("distance_bytes");
+                if (!bytes.is_array() || bytes.size() != 2) throw std::invalid_argument(where + ": distance_bytes deve ser [lo, hi]");
+                d.DistanceLoByte = checkedByte(bytes.at(0).get<int>(), where);
+                d.DistanceHiByte = checkedByte(bytes.at(1).get<int>(), where);
+            }
+            d.DistanceDivisor = entry.value("distance_divisor", d.DistanceDivisor);
+            if (!(d.DistanceDivisor > 0)) throw std::invalid_argument(where + ": distance_divisor deve ser positivo");
+            if (entry.contains("side_byte") && !entry.at("side_byte").is_null()) {
+                d.SideByte = static_cast<int8_t>(checkedByte(entry.at("side_byte").get<int>(), where));
+                d.SideLabels[0] = "Esquerda";
+                d.SideLabels[1] = "Direita";
+                if (entry.contains("side_labels")) {
+                    const json &labels = entry.at("side_labels");
+                    if (!labels.is_array() || labels.size() != 2) throw std::invalid_argument(where + ": side_labels deve ter 2 rótulos");
+                    d.SideLabels[0] = table.keep(labels.at(0).get<std::string>());
+                    d.SideLabels[1] = table.keep(labels.at(1).get<std::string>());
+                }
+            }
+            d.Prioridade = entry.value("prioridade", d.Prioridade);
+            if (entry.contains("lane")) {
+                std::string lane = entry.at("lane").get<std::string>();
+                if (!parsePriorityLane(lane, d.Lane)) throw std::invalid_argument(where + ": lane desconhecida \"" + lane + "\"");
+            }
+            d.Delivery = parseDeliveryPolicy(entry, where);
+            if (table.slotOf(d.ArbitrationId) != NO_SLOT) throw std::invalid_argument(where + ": decoder repetido");
+            table.add(d);
+        }
+        return table;
+    }
+
+    // Registra (ou substitui) o decoder do ArbitrationId.
+    void add(const CanDecoder& decoder) {
+        uint16_t existing = slotOf(decoder.ArbitrationId);
+        if (existing != NO_SLOT) {
+            decoders_[existing] = decoder;
+            return;
+        }
+        uint16_t slot = static_cast<uint16_t>(decoders_.size());
+        decoders_.push_back(decoder);
+        if (decoder.ArbitrationId < DENSE_IDS) dense_[decoder.ArbitrationId] = slot;
+        else extended_[decoder.ArbitrationId] = slot;
+    }
+
+    // Slot denso (0..size()-1) do ArbitrationId, ou NO_SLOT.
+    uint16_t slotOf(uint32_t arbitrationId) const {
+        if (arbitrationId < DENSE_IDS) return dense_[arbitrationId];
+        auto it = extended_.find(arbitrationId);
+        return it == extended_.end() ? NO_SLOT : it->second;
+    }
+
+    const CanDecoder* find(uint32_t arbitrationId) const {
+        uint16_t slot = slotOf(arbitrationId);
+        return slot == NO_SLOT ? nullptr : &decoders_[slot];
+    }
+
+    // Decoder do ID ou, se não houver, o layout genérico.
+    const CanDecoder& resolve(uint32_t arbitrationId, std::string_view algorithmId) const {
+        if (const CanDecoder* d = find(arbitrationId)) return *d;
+        return algorithmId == "BlindSpotDetection" ? kGenericBlindSpotDecoder : kGenericDecoder;
+    }
+
+    size_t size() const { return decoders_.size(); }
+    const CanDecoder& at(uint16_t slot) const { return decoders_[slot]; }
+
+private:
+    static std::string hexId(uint32_t id) {
+        char buf[16];
+        std::snprintf(buf, sizeof(buf), "%X", id);
+        return buf;
+    }
+
+    static uint8_t checkedByte(int index, const std::string& where) {
+        if (index < 0 || index >= static_cast<int>(CAN_MAX_DATA_LEN)) {
+            throw std::invalid_argument(where + ": índice de byte fora do frame (" + std::to_string(index) + ")");
+        }
+        return static_cast<uint8_t>(index);
+    }
+
+    static uint8_t byteIndex(const json& entry, const char* key, uint8_t def, const std::string& where) {
+        return entry.contains(key) ? checkedByte(entry.at(key).get<int>(), where) : def;
+    }
+
+    const char* keep(std::string text) {
+        strings_.push_back(std::move(text));
+        return strings_.back().c_str();
+    }
+
+    std::array<uint16_t, DENSE_IDS> dense_;
+    std::unordered_map<uint32_t, uint16_t> extended_;   // IDs estendidos (29 bits)
+    std::vector<CanDecoder> decoders_;
+    std::deque<std::string> strings_;                   // das tabelas do arquivo
+};
+
+inline const DecoderTable& defaultDecoderTable() {
+    static const DecoderTable table(kKnownDecoders);
+    return table;
+}
+
+// Leitura decodificada de um frame, independente do formato de saída.
+struct SensorReading {
+    bool        Status;
+    double      Distance;
+    const char* Side;      // nullptr quando o decoder não tem o campo
+    bool        SideSet;   // byte do lado == 1: Side é SideLabels[1]
+};
+
+inline SensorReading decodeReading(const CanDecoder& decoder, const CanData& can) {
+    const auto &data = can.Data;
+    SensorReading r;
+    r.Status = data.size() > decoder.StatusByte && data[decoder.StatusByte] == 1;
+
+    int distance = 0;
+    if (data.size() > std::max(decoder.DistanceLoByte, decoder.DistanceHiByte)) {
+        distance = (data[decoder.DistanceHiByte] << 8) | data[decoder.DistanceLoByte];
+    }
+    r.Distance = distance / decoder.DistanceDivisor;
+
+    r.Side = nullptr;
+    r.SideSet = false;
+    if (decoder.SideByte != NO_FIELD) {
+        r.SideSet = data.size() > static_cast<size_t>(decoder.SideByte) && data[decoder.SideByte] == 1;
+        r.Side = decoder.SideLabels[r.SideSet ? 1 : 0];
+    }
+    return r;
+}
+
+/* -----------------------------------------------------------------------
+   Decodificação em lote (SoA).
+   SensorBatch guarda uma rajada de frames em colunas (os 8 primeiros
+   bytes de dados de cada frame num uint64, o tamanho e os índices do
+   layout do decoder) e decodifica tudo de uma vez com um kernel,
+   escolhido em tempo de execução:
+     - AVX2: 4 frames por iteração, extração com deslocamento por lane
+     - SSE4.1: 2 frames por iteração, extração com pshufb (o SSE não tem
+       deslocamento variável por lane)
+     - NEON: 2 frames por iteração (aarch64)
+     - escalar: o resto
+   O resultado é idêntico ao de decodeReading(). decodeBatch() é a
+   entrada para quem já tem uma rajada de frames na mão (o bench mede as
+   duas). O pipeline continua frame a frame: montar as colunas custa
+   quase o mesmo que decodeReading(), e com o layout de poucos bytes dos
+   sensores o lote inteiro sai mais lento que decodeReading() no bench,
+   mesmo com AVX2. Os workers também não juntam mensagens em rajadas,
+   para não segurar a fila de alta prioridade.
+   -----------------------------------------------------------------------*/
+constexpr size_t  BATCH_PACKED_BYTES = 8;     // bytes de dados que cabem no uint64
+constexpr uint8_t BATCH_NO_BYTE      = BATCH_PACKED_BYTES;   // índice sempre fora do frame
+static_assert(CAN_MAX_DATA_LEN >= BATCH_PACKED_BYTES, "SensorBatch lê 8 bytes fixos de cada frame");
+
+// Colunas de entrada e de saída de um lote; Count linhas em cada uma.
+struct BatchColumns {
+    const uint64_t* Bytes;      // dados little-endian, zerados após o tamanho
+    const uint8_t*  Length;     // min(tamanho, 8)
+    const uint8_t*  StatusIdx;
+    const uint8_t*  LoIdx;
+    const uint8_t*  HiIdx;
+    const uint8_t*  SideIdx;    // BATCH_NO_BYTE = sem campo "Side"
+    const double*   Divisor;
+    uint8_t*        Status;
+    double*         Distance;
+    uint8_t*        SideSet;
+    size_t          Count;
+};
+
+using BatchKernelFn = void (*)(const BatchColumns&);
+
+struct BatchKernel {
+    const char*   Name;
+    BatchKernelFn Run;
+};
+
+// Mesmas regras de decodeReading(): byte ausente conta como 0 no
+// status/lado e zera a distância.
+inline void decodeBatchScalarFrom(const BatchColumns& columns, size_t first) {
+    const BatchColumns c = columns;   // cópia local: os stores de uint8_t não forçam recarregar as colunas
+    for (size_t i = first; i < c.Count; ++i) {
+        uint64_t bytes = c.Bytes[i];
+        uint8_t length = c.Length[i];
+        auto byteAt = [bytes](uint8_t idx) { return static_cast<uint8_t>(bytes >> (8 * idx)); };
+
+        c.Status[i]  = c.StatusIdx[i] < length && byteAt(c.StatusIdx[i]) == 1;
+        c.SideSet[i] = c.SideIdx[i] < length && byteAt(c.SideIdx[i]) == 1;
+        int distance = 0;
+        if (c.LoIdx[i] < length && c.HiIdx[i] < length) {
+            distance = (byteAt(c.HiIdx[i]) << 8) | byteAt(c.LoIdx[i]);
+        }
+        c.Distance[i] = distance / c.Divisor[i];
+    }
+}
+
+inline void decodeBatchScalar(const BatchColumns& c) {
+    decodeBatchScalarFrom(c, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+inline __m256i loadBatchIndex4(const uint8_t* p) {
+    int32_t packed;
+    std::memcpy(&packed, p, sizeof(packed));
+    return _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed));
+}
+
+// Byte idx de cada lane (0 se fora do frame) e a máscara de presença
+__attribute__((target("avx2")))
+inline __m256i extractBatchByte4(__m256i bytes, __m256i length, __m256i idx, __m256i& present) {
+    present = _mm256_cmpgt_epi64(length, idx);
+    __m256i byte = _mm256_and_si256(_mm256_srlv_epi64(bytes, _mm256_slli_epi64(idx, 3)),
+                                    _mm256_set1_epi64x(0xFF));
+    return _mm256_and_si256(byte, present);
+}
+
+__attribute__((target("avx2")))
+inline void storeBatchFlags4(uint8_t* out, __m256i mask) {
+    int bits = _mm256_movemask_pd(_mm256_castsi256_pd(mask));
+    for (int k = 0; k < 4; ++k) out[k] = static_cast<uint8_t>((bits >> k) & 1);
+}
+
+__attribute__((target("avx2")))
+void decodeBatchAvx2(const BatchColumns& columns) {
+    const BatchColumns c = columns;
+    const __m256i one = _mm256_set1_epi64x(1);
+    // inteiro < 2^52 -> double: soma nos bits da mantissa de 2^52 e subtrai
+    const __m256i magicBits = _mm256_set1_epi64x(0x4330000000000000LL);
+    const __m256d magic = _mm256_set1_pd(4503599627370496.0);
+
+    size_t i = 0;
+    for (; i + 4 <= c.Count; i += 4) {
+        __m256i bytes  = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(c.Bytes + i));
+        __m256i length = loadBatchIndex4(c.Length + i);
+        __m256i present, loPresent, hiPresent;
+
+        __m256i status = extractBatchByte4(bytes, length, loadBatchIndex4(c.StatusIdx + i), present);
+        storeBatchFlags4(c.Status + i, _mm256_cmpeq_epi64(status, one));
+
+        __m256i side = extractBatchByte4(bytes, length, loadBatchIndex4(c.SideIdx + i), present);
+        storeBatchFlags4(c.SideSet + i, _mm256_cmpeq_epi64(side, one));
+
+        __m256i lo = extractBatchByte4(bytes, length, loadBatchIndex4(c.LoIdx + i), loPresent);
+        __m256i hi = extractBatchByte4(bytes, length, loadBatchIndex4(c.HiIdx + i), hiPresent);
+        __m256i raw = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi64(hi, 8), lo),
+                                       _mm256_and_si256(loPresent, hiPresent));
+        __m256d distance = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(raw, magicBits)), magic);
+        _mm256_storeu_pd(c.Distance + i, _mm256_div_pd(distance, _mm256_loadu_pd(c.Divisor + i)));
+    }
+    decodeBatchScalarFrom(c, i);
+}
+
+// Índices de 2 linhas, um por lane de 64 bits
+__attribute__((target("sse4.1")))
+inline __m128i loadBatchIndexSse(const uint8_t* p) {
+    uint16_t packed;
+    std::memcpy(&packed, p, sizeof(packed));
+    return _mm_cvtepu8_epi64(_mm_cvtsi32_si128(packed));
+}
+
+// Byte idx de cada lane (0 se fora do frame) e a máscara de presença.
+// Sem deslocamento variável por lane, o byte sai de um pshufb: a lane 1
+// lê a partir do byte 8 do registrador.
+__attribute__((target("sse4.1")))
+inline __m128i extractBatchByteSse(__m128i bytes, __m128i length, __m128i idx, __m128i& present) {
+    // idx e tamanho <= 8: basta comparar a metade baixa e copiá-la para a alta
+    present = _mm_shuffle_epi32(_mm_cmpgt_epi32(length, idx), _MM_SHUFFLE(2, 2, 0, 0));
+    __m128i control = _mm_add_epi64(idx, _mm_set_epi64x(8, 0));
+    __m128i byte = _mm_and_si128(_mm_shuffle_epi8(bytes, control), _mm_set1_epi64x(0xFF));
+    return _mm_and_si128(byte, present);
+}
+
+__attribute__((target("sse4.1")))
+inline void storeBatchFlagsSse(uint8_t* out, __m128i mask) {
+    int bits = _mm_movemask_pd(_mm_castsi128_pd(mask));
+    out[0] = static_cast<uint8_t>(bits & 1);
+    out[1] = static_cast<uint8_t>((bits >> 1) & 1);
+}
+
+__attribute__((target("sse4.1")))
+void decodeBatchSse(const BatchColumns& columns) {
+    const BatchColumns c = columns;
+    const __m128i one = _mm_set1_epi64x(1);
+    const __m128i magicBits = _mm_set1_epi64x(0x4330000000000000LL);
+    const __m128d magic = _mm_set1_pd(4503599627370496.0);
+
+    size_t i = 0;
+    for (; i + 2 <= c.Count; i += 2) {
+        __m128i bytes  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c.Bytes + i));
+        __m128i length = loadBatchIndexSse(c.Length + i);
+        __m128i present, loPresent, hiPresent;
+
+        __m128i status = extractBatchByteSse(bytes, length, loadBatchIndexSse(c.StatusIdx + i), present);
+        storeBatchFlagsSse(c.Status + i, _mm_cmpeq_epi64(status, one));
+
+        __m128i side = extractBatchByteSse(bytes, length, loadBatchIndexSse(c.SideIdx + i), present);
+        storeBatchFlagsSse(c.SideSet + i, _mm_cmpeq_epi64(side, one));
+
+        __m128i lo = extractBatchByteSse(bytes, length, loadBatchIndexSse(c.LoIdx + i), loPresent);
+        __m128i hi = extractBatchByteSse(bytes, length, loadBatchIndexSse(c.HiIdx + i), hiPresent);
+        __m128i raw = _mm_and_si128(_mm_or_si128(_mm_slli_epi64(hi, 8), lo), _mm_and_si128(loPresent, hiPresent));
+        __m128d distance = _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(raw, magicBits)), magic);
+        _mm_storeu_pd(c.Distance + i, _mm_div_pd(distance, _mm_loadu_pd(c.Divisor + i)));
+    }
+    decodeBatchScalarFrom(c, i);
+}
+#endif
+
+#if defined(__aarch64__)
+inline uint64x2_t loadBatchIndex2(const uint8_t* p) {
+    uint64x2_t v = vdupq_n_u64(p[0]);
+    return vsetq_lane_u64(p[1], v, 1);
+}
+
+// Byte idx de cada lane (0 se fora do frame) e a máscara de presença
+inline uint64x2_t extractBatchByte2(uint64x2_t bytes, uint64x2_t length, uint64x2_t idx, uint64x2_t& present) {
+    present = vcltq_u64(idx, length);
+    int64x2_t shift = vnegq_s64(vreinterpretq_s64_u64(vshlq_n_u64(idx, 3)));
+    uint64x2_t byte = vandq_u64(vshlq_u64(bytes, shift), vdupq_n_u64(0xFF));
+    return vandq_u64(byte, present);
+}
+
+inline void storeBatchFlags2(uint8_t* out, uint64x2_t mask) {
+    out[0] = static_cast<uint8_t>(vgetq_lane_u64(mask, 0) & 1);
+    out[1] = static_cast<uint8_t>(vgetq_lane_u64(mask, 1) & 1);
+}
+
+void decodeBatchNeon(const BatchColumns& columns) {
+    const BatchColumns c = columns;
+    const uint64x2_t one = vdupq_n_u64(1);
+    size_t i = 0;
+    for (; i + 2 <= c.Count; i += 2) {
+        uint64x2_t bytes  = vld1q_u64(c.Bytes + i);
+        uint64x2_t length = loadBatchIndex2(c.Length + i);
+        uint64x2_t present, loPresent, hiPresent;
+
+        uint64x2_t status = extractBatchByte2(bytes, length, loadBatchIndex2(c.StatusIdx + i), present);
+        storeBatchFlags2(c.Status + i, vceqq_u64(status, one));
+
+        uint64x2_t side = extractBatchByte2(bytes, length, loadBatchIndex2(c.SideIdx + i), present);
+        storeBatchFlags2(c.SideSet + i, vceqq_u64(side, one));
+
+        uint64x2_t lo = extractBatchByte2(bytes, length, loadBatchIndex2(c.LoIdx + i), loPresent);
+        uint64x2_t hi = extractBatchByte2(bytes, length, loadBatchIndex2(c.HiIdx + i), hiPresent);
+        uint64x2_t raw = vandq_u64(vorrq_u64(vshlq_n_u64(hi, 8), lo), vandq_u64(loPresent, hiPresent));
+        vst1q_f64(c.Distance + i, vdivq_f64(vcvtq_f64_u64(raw), vld1q_f64(c.Divisor + i)));
+    }
+    decodeBatchScalarFrom(c, i);
+}
+#endif
+
+// Kernels que rodam nesta CPU, do mais rápido ao escalar
+inline const std::vector<BatchKernel>& batchKernels() {
+    static const std::vector<BatchKernel> kernels = [] {
+        std::vector<BatchKernel> k;
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx2")) k.push_back({ "avx2", decodeBatchAvx2 });
+        if (__builtin_cpu_supports("sse4.1")) k.push_back({ "sse4.1", decodeBatchSse });
+#elif defined(__aarch64__)
+        k.push_back({ "neon", decodeBatchNeon });
+#endif
+        k.push_back({ "scalar", decodeBatchScalar });
+        return k;
+    }();
+    return kernels;
+}
+
+inline const BatchKernel& bestBatchKernel() {
+    return batchKernels().front();
+}
+
+// Lote de leituras em colunas. Reutilizável: clear() mantém a capacidade,
+// e add() só escreve nas colunas já alocadas (sem alocar no laço).
+class SensorBatch {
+public:
+    void reserve(size_t n) {
+        if (n <= capacity_) return;
+        bytes_.resize(n);  length_.resize(n);
+        statusIdx_.resize(n);  loIdx_.resize(n);  hiIdx_.resize(n);  sideIdx_.resize(n);
+        divisor_.resize(n);  decoders_.resize(n);
+        status_.resize(n);  distance_.resize(n);  sideSet_.resize(n);
+        capacity_ = n;
+    }
+
+    void clear() {
+        size_ = decoded_ = 0;
+        wide_.clear();
+    }
+
+    size_t size() const { return size_; }
+
+    // O decoder precisa viver até a última chamada de reading()
+    void add(const CanDecoder& decoder, const CanData& can) {
+        if (size_ == capacity_) reserve(std::max<size_t>(64, capacity_ * 2));
+        size_t row = size_++;
+
+        // Cópia fixa de 8 bytes (a capacidade é >= 8) e zera o que passa do tamanho
+        const auto &data = can.Data;
+        size_t packed = std::min(data.size(), BATCH_PACKED_BYTES);
+        uint64_t bytes;
+        std::memcpy(&bytes, data.begin(), BATCH_PACKED_BYTES);   // little-endian, como os kernels esperam
+        bytes &= packed == BATCH_PACKED_BYTES ? ~uint64_t(0) : (uint64_t(1) << (8 * packed)) - 1;
+
+        // Ponteiros lidos antes das escritas: store de uint8_t pode ser
+        // alias de qualquer coisa e obrigaria a recarregar cada vector
+        uint64_t* bytesCol = bytes_.data();
+        uint8_t* lengthCol = length_.data();
+        uint8_t* statusCol = statusIdx_.data();
+        uint8_t* loCol = loIdx_.data();
+        uint8_t* hiCol = hiIdx_.data();
+        uint8_t* sideCol = sideIdx_.data();
+        double* divisorCol = divisor_.data();
+        const CanDecoder** decoderCol = decoders_.data();
+
+        bytesCol[row]   = bytes;
+        lengthCol[row]  = static_cast<uint8_t>(packed);
+        statusCol[row]  = packedIndex(decoder.StatusByte);
+        loCol[row]      = packedIndex(decoder.DistanceLoByte);
+        hiCol[row]      = packedIndex(decoder.DistanceHiByte);
+        sideCol[row]    = decoder.SideByte == NO_FIELD ? BATCH_NO_BYTE
+                                                       : packedIndex(static_cast<uint8_t>(decoder.SideByte));
+        divisorCol[row] = decoder.DistanceDivisor;
+        decoderCol[row] = &decoder;
+
+        // CAN FD com campo além do 8º byte: fica de fora dos kernels
+        if (BATCH_PACKED_BYTES < CAN_MAX_DATA_LEN && data.size() > BATCH_PACKED_BYTES && usesWideBytes(decoder)) {
+            wide_.push_back({ row, decodeReading(decoder, can) });
+        }
+    }
+
+    // Decodifica as linhas adicionadas desde o último decode()
+    void decode(const BatchKernel& kernel = bestBatchKernel()) {
+        size_t d = decoded_;
+        if (size_ > d) {
+            kernel.Run(BatchColumns{
+                bytes_.data() + d, length_.data() + d,
+                statusIdx_.data() + d, loIdx_.data() + d, hiIdx_.data() + d, sideIdx_.data() + d,
+                divisor_.data() + d,
+                status_.data() + d, distance_.data() + d, sideSet_.data() + d,
+                size_ - d
+            });
+        }
+        for (const auto &w : wide_) {
+            if (w.Row < d) continue;
+            status_[w.Row]   = w.Reading.Status;
+            distance_[w.Row] = w.Reading.Distance;
+            sideSet_[w.Row]  = w.Reading.SideSet;
+        }
+        decoded_ = size_;
+    }
+
+    // Colunas de saída (válidas após decode())
+    const uint8_t* status() const { return status_.data(); }
+    const double* distance() const { return distance_.data(); }
+    const uint8_t* sideSet() const { return sideSet_.data(); }
+
+    SensorReading reading(size_t i) const {
+        const CanDecoder &decoder = *decoders_[i];
+        SensorReading r;
+        r.Status   = status_[i] != 0;
+        r.Distance = distance_[i];
+        r.Side     = decoder.SideByte == NO_FIELD ? nullptr : decoder.SideLabels[sideSet_[i] ? 1 : 0];
+        r.SideSet  = decoder.SideByte != NO_FIELD && sideSet_[i] != 0;
+        return r;
+    }
+
+private:
+    struct WideRow {
+        size_t        Row;
+        SensorReading Reading;
+    };
+
+    static uint8_t packedIndex(uint8_t idx) {
+        return idx < BATCH_PACKED_BYTES ? idx : BATCH_NO_BYTE;
+    }
+
+    static bool usesWideBytes(const CanDecoder& decoder) {
+        return decoder.StatusByte >= BATCH_PACKED_BYTES ||
+               decoder.DistanceLoByte >= BATCH_PACKED_BYTES ||
+               decoder.DistanceHiByte >= BATCH_PACKED_BYTES ||
+               (decoder.SideByte != NO_FIELD && static_cast<size_t>(decoder.SideByte) >= BATCH_PACKED_BYTES);
+    }
+
+    size_t size_ = 0, capacity_ = 0, decoded_ = 0;
+
+    // Entrada
+    std::vector<uint64_t> bytes_;
+    std::vector<uint8_t>  length_;
+    std::vector<uint8_t>  statusIdx_, loIdx_, hiIdx_, sideIdx_;
+    std::vector<double>   divisor_;
+    std::vector<const CanDecoder*> decoders_;
+    std::vector<WideRow>  wide_;   // só com CAN FD
+
+    // Saída
+    std::vector<uint8_t> status_;
+    std::vector<double>  distance_;
+    std::vector<uint8_t> sideSet_;
+};
+
+// Um frame do lote e o decoder do seu ArbitrationId (os dois precisam
+// viver até o fim de decodeBatch)
+struct BatchFrame {
+    const CanDecoder* Decoder;
+    const CanData*    Can;
+};
+
+// Decodifica count frames de uma vez: out[i] é o mesmo que
+// decodeReading(*frames[i].Decoder, *frames[i].Can). As colunas são do
+// thread e mantêm a capacidade entre as chamadas.
+inline void decodeBatch(const BatchFrame* frames, size_t count, SensorReading* out,
+                        const BatchKernel& kernel = bestBatchKernel()) {
+    thread_local SensorBatch batch;
+    batch.clear();
+    batch.reserve(count);
+    for (size_t i = 0; i < count; ++i) batch.add(*frames[i].Decoder, *frames[i].Can);
+    batch.decode(kernel);
+    for (size_t i = 0; i < count; ++i) out[i] = batch.reading(i);
+}
+
+/* -----------------------------------------------------------------------
+   Funções para converter CAN -> JSON, como no código .NET
+   -----------------------------------------------------------------------*/
+template <typename Msg>
+JsonMessage convertCanMessage(const Msg& msg, const CanDecoder& decoder, const SensorReading& reading) {
+    using Traits = CanSourceTraits<Msg>;
+
+    // Monta o JsonMessage
+    JsonMessage result;
+    result.AlgorithmID = msg.AlgorithmID.empty()
+                         ? std::string_view("Unknown")
+                         : msg.AlgorithmID.view();
+    // Timestamp ISO 8601 (UTC), do frame de origem quando houver
+    result.TimestampUs = timestampService().instant(msg.SourceTimestampUs);
+    timestampService().formatInstant(result.TimestampUs, result.Timestamp);
+
+    result.Status      = reading.Status;
+
+    result.Data.DistanceToVehicle = reading.Distance;
+    result.Data.Side              = reading.Side;
+    result.Data.SideSet           = reading.SideSet;
+    result.Data.HasPrioridade     = Traits::SendsPrioridade && reading.Side == nullptr;
+    result.Data.Prioridade        = Traits::SendsPrioridade ? decoder.Prioridade : 0;
+    return result;
+}
+
+template <typename Msg>
+JsonMessage convertCanMessage(const Msg& msg, const CanDecoder& decoder) {
+    return convertCanMessage(msg, decoder, decodeReading(decoder, msg.CAN_Message));
+}
+
+JsonMessage canToJson(const CanMessage& msg, const CanDecoder& decoder) {
+    return convertCanMessage(msg, decoder);
+}
+
+JsonMessage canToJsonSim(const CanMessageSimulator& simMsg, const CanDecoder& decoder) {
+    return convertCanMessage(simMsg, decoder);
+}
+
+/* -----------------------------------------------------------------------
+   Serialização direta do JSON de saída.
+   Gera exatamente o que nlohmann::json::dump() gerava para o mesmo
+   conteúdo: chaves em ordem alfabética (std::map), números de ponto
+   flutuante no formato do dtoa da nlohmann ("5.0", "12.34", "1e-05"),
+   mesmo escape de strings e erro para UTF-8 inválido.
+   -----------------------------------------------------------------------*/
+class JsonWriter {
+public:
+    JsonWriter() { buf_.reserve(256); }
+
+    void clear() { buf_.clear(); }
+    std::string_view view() const { return buf_; }
+
+    void raw(std::string_view s) { buf_.append(s.data(), s.size()); }
+    void raw(char c) { buf_.push_back(c); }
+
+    void key(std::string_view k) {
+        string(k);
+        buf_.push_back(':');
+    }
+
+    void boolean(bool b) { raw(b ? std::string_view("true") : std::string_view("false")); }
+
+    void integer(long long v) {
+        char tmp[24];
+        auto res = std::to_chars(tmp, tmp + sizeof(tmp), v);
+        buf_.append(tmp, res.ptr);
+    }
+
+    void number(double v) {
+        if (!std::isfinite(v)) {
+            raw("null");
+            return;
+        }
+        char tmp[40];
+        buf_.append(tmp, formatDouble(tmp, v));
+    }
+
+    // String com o escape da nlohmann (ensure_ascii = false)
+    void string(std::string_view s) {
+        if (!isValidUtf8(s)) {
+            throw std::invalid_argument("string com UTF-8 inválido no JSON de saída");
+        }
+        buf_.push_back('"');
+        for (unsigned char c : s) {
+            switch (c) {
+                case '"':  raw("\\\""); break;
+                case '\\': raw("\\\\"); break;
+                case '\b': raw("\\b");  break;
+                case '\f': raw("\\f");  break;
+                case '\n': raw("\\n");  break;
+                case '\r': raw("\\r");  break;
+                case '\t': raw("\\t");  break;
+                default:
+                    if (c < 0x20) {
+                        static const char hex[] = "0123456789abcdef";
+                        char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+                        buf_.append(esc, sizeof(esc));
+                    } else {
+                        buf_.push_back(static_cast<char>(c));
+                    }
+            }
+        }
+        buf_.push_back('"');
+    }
+
+private:
+    std::string buf_;
+
+    // Menor representação que volta ao mesmo double (std::to_chars),
+    // formatada como o format_buffer da nlohmann (kMinExp = -4, kMaxExp = 15).
+    static char* formatDouble(char* out, double v) {
+        if (v == 0) {
+            const char* z = std::signbit(v) ? "-0.0" : "0.0";
+            size_t n = std::strlen(z);
+            std::memcpy(out, z, n);
+            return out + n;
+        }
+        if (v < 0) {
+            *out++ = '-';
+            v = -v;
+        }
+
+        // "d.ddddde[+-]xx" -> dígitos e expoente decimal
+        char sci[32];
+        auto res = std::to_chars(sci, sci + sizeof(sci), v, std::chars_format::scientific);
+        char digits[20];
+        int k = 0;
+        const char* p = sci;
+        for (; p < res.ptr && *p != 'e'; ++p) {
+            if (*p != '.') digits[k++] = *p;
+        }
+        // to_chars não termina com '\0': o expoente é lido só até res.ptr
+        // (from_chars não aceita o '+')
+        int exp10 = 0;
+        if (++p < res.ptr && *p == '+') ++p;
+        std::from_chars(p, res.ptr, exp10);
+        int n = exp10 + 1;   // posição do ponto decimal em relação aos dígitos
+
+        if (k <= n && n <= 15) {
+            // dígitos + zeros + ".0"
+            std::memcpy(out, digits, k);
+            std::memset(out + k, '0', n - k);
+            out[n] = '.';
+            out[n + 1] = '0';
+            return out + n + 2;
+        }
+        if (0 < n && n <= 15) {
+            // dig.itos
+            std::memcpy(out, digits, n);
+            out[n] = '.';
+            std::memcpy(out + n + 1, digits + n, k - n);
+            return out + k + 1;
+        }
+        if (-4 < n && n <= 0) {
+            // 0.[000]dígitos
+            out[0] = '0';
+            out[1] = '.';
+            std::memset(out + 2, '0', -n);
+            std::memcpy(out + 2 - n, digits, k);
+            return out + 2 - n + k;
+        }
+
+        // d[.igitos]e[+-]xx
+        *out++ = digits[0];
+        if (k > 1) {
+            *out++ = '.';
+            std::memcpy(out, digits + 1, k - 1);
+            out += k - 1;
+        }
+        *out++ = 'e';
+        int e = n - 1;
+        *out++ = e < 0 ? '-' : '+';
+        if (e < 0) e = -e;
+        if (e < 10) {
+            *out++ = '0';
+            *out++ = static_cast<char>('0' + e);
+        } else if (e < 100) {
+            *out++ = static_cast<char>('0' + e / 10);
+            *out++ = static_cast<char>('0' + e % 10);
+        } else {
+            *out++ = static_cast<char>('0' + e / 100);
+            *out++ = static_cast<char>('0' + (e / 10) % 10);
+            *out++ = static_cast<char>('0' + e % 10);
+        }
+        return out;
+    }
+};
+
+// Buffer reutilizado por thread (callback do Paho ou worker)
+inline JsonWriter& threadJsonWriter() {
+    thread_local JsonWriter writer;
+    writer.clear();
+    return writer;
+}
+
+// {"AlgorithmID":...,"Data":{...},"Status":...,"Timestamp":...}
+inline void writeJsonMessage(JsonWriter& w, const JsonMessage& msg) {
+    w.raw('{');
+    w.key("AlgorithmID");
+    w.string(msg.AlgorithmID);
+    w.raw(',');
+    w.key("Data");
+    w.raw('{');
+    w.key("DistanceToVehicle");
+    w.number(msg.Data.DistanceToVehicle);
+    if (msg.Data.HasPrioridade) {
+        w.raw(',');
+        w.key("Prioridade");
+        w.integer(msg.Data.Prioridade);
+    }
+    if (msg.Data.Side) {
+        w.raw(',');
+        w.key("Side");
+        w.string(msg.Data.Side);
+    }
+    w.raw('}');
+    w.raw(',');
+    w.key("Status");
+    w.boolean(msg.Status);
+    w.raw(',');
+    w.key("Timestamp");
+    w.string(msg.Timestamp.view());
+    w.raw('}');
+}
+
+/* -----------------------------------------------------------------------
+   Saídas binárias da leitura ("format"), sem DOM como o JsonWriter.
+   CBOR e MessagePack saem byte a byte como json::to_cbor() e
+   json::to_msgpack() da nlohmann sairiam para o mesmo objeto do JSON
+   (chaves em ordem, inteiros no menor tamanho, double em float32 quando
+   não perde nada): os consumidores podem usar from_cbor/from_msgpack.
+   "binary" é um struct fixo de 24 bytes, little-endian, seguido do
+   AlgorithmID:
+      0 u8   versão (BINARY_READING_VERSION)
+      1 u8   bits: 0 Status, 1 tem Side, 2 Side é o rótulo do byte == 1,
+                   3 tem Prioridade
+      2 i16  Prioridade
+      4 u32  ArbitrationId
+      8 i64  Timestamp (µs Unix, UTC)
+     16 f64  DistanceToVehicle
+     24 ...  AlgorithmID (UTF-8, até o fim do payload)
+   -----------------------------------------------------------------------*/
+constexpr uint8_t BINARY_READING_VERSION = 1;
+constexpr size_t BINARY_READING_HEADER = 24;
+
+template <typename T>
+inline void appendBigEndian(std::string& out, T v) {
+    for (size_t i = sizeof(T); i-- > 0; ) out.push_back(static_cast<char>(static_cast<uint64_t>(v) >> (8 * i)));
+}
+
+template <typename T>
+inline void appendLittleEndian(std::string& out, T v) {
+    for (size_t i = 0; i < sizeof(T); ++i) out.push_back(static_cast<char>(static_cast<uint64_t>(v) >> (8 * i)));
+}
+
+inline uint32_t floatBits(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+inline uint64_t doubleBits(double d) {
+    uint64_t bits;
+    std::memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+// write_compact_float da nlohmann: float32 se o valor volta igual
+inline bool fitsFloat(double v) {
+    return v >= static_cast<double>(std::numeric_limits<float>::lowest()) &&
+           v <= static_cast<double>(std::numeric_limits<float>::max()) &&
+           static_cast<double>(static_cast<float>(v)) == v;
+}
+
+class CborWriter {
+public:
+    explicit CborWriter(std::string& out) : out_(out) {}
+
+    void map(size_t n) { head(0xA0, n); }
+    void string(std::string_view s) {
+        head(0x60, s.size());
+        out_.append(s.data(), s.size());
+    }
+    void boolean(bool b) { out_.push_back(static_cast<char>(b ? 0xF5 : 0xF4)); }
+
+    void integer(long long v) {
+        if (v >= 0) head(0x00, static_cast<uint64_t>(v));
+        else head(0x20, static_cast<uint64_t>(-1 - v));
+    }
+
+    void number(double v) {
+        if (std::isnan(v)) {
+            out_.append("\xF9\x7E\x00", 3);
+        } else if (std::isinf(v)) {
+            out_.append(v > 0 ? "\xF9\x7C\x00" : "\xF9\xFC\x00", 3);
+        } else if (fitsFloat(v)) {
+            out_.push_back(static_cast<char>(0xFA));
+            appendBigEndian(out_, floatBits(static_cast<float>(v)));
+        } else {
+            out_.push_back(static_cast<char>(0xFB));
+            appendBigEndian(out_, doubleBits(v));
+        }
+    }
+
+private:
+    // Tipo maior + argumento no menor tamanho
+    void head(uint8_t major, uint64_t n) {
+        if (n <= 0x17) {
+            out_.push_back(static_cast<char>(major + n));
+        } else if (n <= UINT8_MAX) {
+            out_.push_back(static_cast<char>(major + 0x18));
+            appendBigEndian(out_, static_cast<uint8_t>(n));
+        } else if (n <= UINT16_MAX) {
+            out_.push_back(static_cast<char>(major + 0x19));
+            appendBigEndian(out_, static_cast<uint16_t>(n));
+        } else if (n <= UINT32_MAX) {
+            out_.push_back(static_cast<char>(major + 0x1A));
+            appendBigEndian(out_, static_cast<uint32_t>(n));
+        } else {
+            out_.push_back(static_cast<char>(major + 0x1B));
+            appendBigEndian(out_, n);
+        }
+    }
+
+    std::string& out_;
+};
+
+class MsgPackWriter {
+public:
+    explicit MsgPackWriter(std::string& out) : out_(out) {}
+
+    void map(size_t n) {
+        if (n <= 15) {
+            out_.push_back(static_cast<char>(0x80 | n));
+        } else if (n <= UINT16_MAX) {
+            out_.push_back(static_cast<char>(0xDE));
+            appendBigEndian(out_, static_cast<uint16_t>(n));
+        } else {
+            out_.push_back(static_cast<char>(0xDF));
+            appendBigEndian(out_, static_cast<uint32_t>(n));
+        }
+    }
+
+    void string(std::string_view s) {
+        size_t n = s.size();
+        if (n <= 31) {
+            out_.push_back(static_cast<char>(0xA0 | n));
+        } else if (n <= UINT8_MAX) {
+            out_.push_back(static_cast<char>(0xD9));
+            appendBigEndian(out_, static_cast<uint8_t>(n));
+        } else if (n <= UINT16_MAX) {
+            out_.push_back(static_cast<char>(0xDA));
+            appendBigEndian(out_, static_cast<uint16_t>(n));
+        } else {
+            out_.push_back(static_cast<char>(0xDB));
+            appendBigEndian(out_, static_cast<uint32_t>(n));
+        }
+        out_.append(s.data(), n);
+    }
+
+    void boolean(bool b) { out_.push_back(static_cast<char>(b ? 0xC3 : 0xC2)); }
+
+    void integer(long long v) {
+        if (v >= 0) {
+            if (v < 128) {
+                out_.push_back(static_cast<char>(v));
+            } else if (v <= UINT8_MAX) {
+                out_.push_back(static_cast<char>(0xCC));
+                appendBigEndian(out_, static_cast<uint8_t>(v));
+            } else if (v <= UINT16_MAX) {
+                out_.push_back(static_cast<char>(0xCD));
+                appendBigEndian(out_, static_cast<uint16_t>(v));
+            } else if (v <= UINT32_MAX) {
+                out_.push_back(static_cast<char>(0xCE));
+                appendBigEndian(out_, static_cast<uint32_t>(v));
+            } else {
+                out_.push_back(static_cast<char>(0xCF));
+                appendBigEndian(out_, static_cast<uint64_t>(v));
+            }
+        } else if (v >= -32) {
+            out_.push_back(static_cast<char>(v));
+        } else if (v >= INT8_MIN) {
+            out_.push_back(static_cast<char>(0xD0));
+            appendBigEndian(out_, static_cast<uint8_t>(v));
+        } else if (v >= INT16_MIN) {
+            out_.push_back(static_cast<char>(0xD1));
+            appendBigEndian(out_, static_cast<uint16_t>(v));
+        } else if (v >= INT32_MIN) {
+            out_.push_back(static_cast<char>(0xD2));
+            appendBigEndian(out_, static_cast<uint32_t>(v));
+        } else {
+            out_.push_back(static_cast<char>(0xD3));
+            appendBigEndian(out_, static_cast<uint64_t>(v));
+        }
+    }
+
+    void number(double v) {
+        if (fitsFloat(v)) {
+            out_.push_back(static_cast<char>(0xCA));
+            appendBigEndian(out_, floatBits(static_cast<float>(v)));
+        } else {
+            out_.push_back(static_cast<char>(0xCB));
+            appendBigEndian(out_, doubleBits(v));
+        }
+    }
+
+private:
+    std::string& out_;
+};
+
+// O mesmo objeto de writeJsonMessage, em CBOR ou MessagePack
+template <typename Writer>
+void writeMapMessage(Writer& w, const JsonMessage& msg) {
+    w.map(4);
+    w.string("AlgorithmID");
+    w.string(msg.AlgorithmID);
+    w.string("Data");
+    w.map(1 + (msg.Data.HasPrioridade ? 1 : 0) + (msg.Data.Side ? 1 : 0));
+    w.string("DistanceToVehicle");
+    w.number(msg.Data.DistanceToVehicle);
+    if (msg.Data.HasPrioridade) {
+        w.string("Prioridade");
+        w.integer(msg.Data.Prioridade);
+    }
+    if (msg.Data.Side) {
+        w.string("Side");
+        w.string(msg.Data.Side);
+    }
+    w.string("Status");
+    w.boolean(msg.Status);
+    w.string("Timestamp");
+    w.string(msg.Timestamp.view());
+}
+
+inline void writeBinaryReading(std::string& out, const JsonMessage& msg, uint32_t arbitrationId) {
+    uint8_t flags = 0;
+    if (msg.Status) flags |= 0x01;
+    if (msg.Data.Side) {
+        flags |= 0x02;
+        if (msg.Data.SideSet) flags |= 0x04;
+    }
+    if (msg.Data.HasPrioridade) flags |= 0x08;
+    int16_t level = static_cast<int16_t>(std::max<int>(INT16_MIN, std::min<int>(INT16_MAX, msg.Data.Prioridade)));
+
+    out.push_back(static_cast<char>(BINARY_READING_VERSION));
+    out.push_back(static_cast<char>(flags));
+    appendLittleEndian(out, static_cast<uint16_t>(level));
+    appendLittleEndian(out, arbitrationId);
+    appendLittleEndian(out, static_cast<uint64_t>(msg.TimestampUs));
+    appendLittleEndian(out, doubleBits(msg.Data.DistanceToVehicle));
+    out.append(msg.AlgorithmID.data(), msg.AlgorithmID.size());
+}
+
+// Buffer das saídas binárias, reutilizado por thread como o do JSON
+inline std::string& threadBinaryBuffer() {
+    thread_local std::string buffer;
+    buffer.clear();
+    return buffer;
+}
+
+// Leitura num formato binário (o JSON vai pelo JsonWriter)
+inline std::string_view encodeBinaryReading(OutputFormat format, const JsonMessage& msg, uint32_t arbitrationId) {
+    std::string &out = threadBinaryBuffer();
+    if (format == OutputFormat::Cbor) {
+        CborWriter w(out);
+        writeMapMessage(w, msg);
+    } else if (format == OutputFormat::MsgPack) {
+        MsgPackWriter w(out);
+        writeMapMessage(w, msg);
+    } else {
+        writeBinaryReading(out, msg, arbitrationId);
+    }
+    return out;
+}
+
+/* -----------------------------------------------------------------------
+   Fila MPMC limitada e sem locks (algoritmo de Dmitry Vyukov).
+   Cada célula guarda um número de sequência que diz se ela está livre
+   para o produtor ou pronta para o consumidor; a capacidade é
+   arredondada para potência de 2.
+   -----------------------------------------------------------------------*/
+template <typename T>
+class BoundedMpmcQueue {
+public:
+    explicit BoundedMpmcQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        cells_.reset(new Cell[size]);
+        mask_ = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        enqueuePos_.store(0, std::memory_order_relaxed);
+        dequeuePos_.store(0, std::memory_order_relaxed);
+    }
+
+    BoundedMpmcQueue(const BoundedMpmcQueue&) = delete;
+    BoundedMpmcQueue& operator=(const BoundedMpmcQueue&) = delete;
+
+    // Retorna false se a fila estiver cheia (o valor não é consumido).
+    bool try_push(T&& value) {
+        Cell* cell;
+        size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Retorna false se a fila estiver vazia.
+    bool try_pop(T& out) {
+        Cell* cell;
+        size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        out = std::move(cell->data);
+        if (!std::is_trivially_copyable<T>::value) cell->data = T();   // solta recursos
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // Apenas aproximado: produtores/consumidores podem estar no meio de uma operação.
+    size_t size_approx() const {
+        size_t head = dequeuePos_.load(std::memory_order_relaxed);
+        size_t tail = enqueuePos_.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> enqueuePos_;
+    alignas(64) std::atomic<size_t> dequeuePos_;
+};
+
+/* -----------------------------------------------------------------------
+   Pools do caminho de publicação.
+   Cada publicação alocava o mqtt::message (make_shared), o shared_ptr
+   da cópia do payload e o buffer da cópia. Agora os três saem de listas
+   livres sem lock (BoundedMpmcQueue) e voltam para elas quando o Paho
+   solta a mensagem, em qualquer thread. Em regime não há malloc; num
+   pico além da capacidade o excedente vai e volta do heap normalmente.
+   -----------------------------------------------------------------------*/
+constexpr size_t POOL_CAPACITY    = 8192;   // blocos/buffers guardados por pool
+constexpr size_t POOL_MAX_PAYLOAD = 4096;   // buffers maiores voltam para o heap
+
+// Blocos de tamanho fixo; uma instância por (tamanho, alinhamento).
+template <size_t Size, size_t Align>
+class BlockPool {
+    static_assert(Align <= alignof(std::max_align_t), "alinhamento acima do operator new padrão");
+
+public:
+    static BlockPool& instance() {
+        // Nunca destruído: mensagens soltas pelo Paho depois do fim do
+        // main() ainda devolvem blocos
+        static BlockPool* pool = new BlockPool();
+        return *pool;
+    }
+
+    void* allocate() {
+        void* block;
+        if (free_.try_pop(block)) return block;
+        return ::operator new(Size);
+    }
+
+    void deallocate(void* block) {
+        if (!free_.try_push(std::move(block))) ::operator delete(block);
+    }
+
+private:
+    BlockPool() : free_(POOL_CAPACITY) {}
+
+    BoundedMpmcQueue<void*> free_;
+};
+
+// Alocador de objetos únicos (allocate_shared, blocos de controle) sobre
+// o BlockPool do tamanho do tipo; arrays vão direto para o heap.
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        if (n != 1) return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(BlockPool<sizeof(T), alignof(T)>::instance().allocate());
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n != 1) ::operator delete(p);
+        else BlockPool<sizeof(T), alignof(T)>::instance().deallocate(p);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
+
+// Buffers de payload reciclados com a capacidade que já tinham.
+class PayloadPool {
+public:
+    static PayloadPool& instance() {
+        static PayloadPool* pool = new PayloadPool();   // ver BlockPool::instance()
+        return *pool;
+    }
+
+    mqtt::binary_ref copy(std::string_view payload) {
+        std::string* buf = nullptr;
+        if (!free_.try_pop(buf)) buf = new std::string();
+        buf->assign(payload.data(), payload.size());
+        return mqtt::binary_ref(std::shared_ptr<const std::string>(buf, Recycle(), PoolAllocator<char>()));
+    }
+
+private:
+    struct Recycle {
+        void operator()(std::string* buf) const { instance().release(buf); }
+    };
+
+    PayloadPool() : free_(POOL_CAPACITY) {}
+
+    void release(std::string* buf) {
+        if (buf->capacity() > POOL_MAX_PAYLOAD || !free_.try_push(std::move(buf))) delete buf;
+    }
+
+    BoundedMpmcQueue<std::string*> free_;
+};
+
+inline mqtt::message_ptr makePooledMessage(const mqtt::string_ref& topic, const mqtt::binary_ref& payload) {
+    return std::allocate_shared<mqtt::message>(PoolAllocator<mqtt::message>(), topic, payload);
+}
+
+// Mensagem com uma cópia do payload num buffer do pool
+inline mqtt::message_ptr makePooledMessage(const mqtt::string_ref& topic, std::string_view payload) {
+    return makePooledMessage(topic, PayloadPool::instance().copy(payload));
+}
+
+/* -----------------------------------------------------------------------
+   Espera ociosa do consumidor de uma fila sem locks: o consumidor só
+   dorme depois de achar a fila vazia, e o produtor só toca no mutex
+   quando há alguém dormindo. O timeout da espera cobre uma eventual
+   notificação perdida entre o teste e o sono.
+   -----------------------------------------------------------------------*/
+class IdleWaiter {
+public:
+    // Produtor: chamar depois de enfileirar trabalho novo.
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cv_.notify_all();
+        }
+    }
+
+    // Acorda incondicionalmente (parada).
+    void wakeAll() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cv_.notify_all();
+    }
+
+    // Consumidor: dorme até notify() ou timeout, se idle() continuar verdadeiro.
+    template <typename Idle, typename Rep, typename Period>
+    void wait(Idle idle, const std::chrono::duration<Rep, Period>& timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        sleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (idle()) cv_.wait_for(lock, timeout);
+        sleeping_.store(false, std::memory_order_relaxed);
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic<bool> sleeping_{false};
+};
+
+/* -----------------------------------------------------------------------
+   Log assíncrono com níveis.
+   As linhas são formatadas num registro de tamanho fixo na pilha do
+   chamador e vão por uma fila sem locks para um thread que escreve em
+   stdout/stderr. O caminho quente nunca bloqueia: com a fila cheia a
+   linha é descartada e contada.
+   Use as macros LOG_*: a expressão só é avaliada se o nível estiver ativo.
+   -----------------------------------------------------------------------*/
+enum class LogLevel : uint8_t { Error, Warn, Info, Debug, Trace };
+
+struct LogRecord {
+    static constexpr size_t MAX_TEXT = 500;
+    LogLevel Level;
+    uint16_t Length;
+    char Text[MAX_TEXT];
+};
+
+class AsyncLogger {
+public:
+    AsyncLogger() : queue_(4096) {
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~AsyncLogger() {
+        running_.store(false);
+        waiter_.wakeAll();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    void setLevel(LogLevel level) { level_.store(level, std::memory_order_relaxed); }
+    LogLevel level() const { return level_.load(std::memory_order_relaxed); }
+    bool enabled(LogLevel level) const { return level <= level_.load(std::memory_order_relaxed); }
+
+    void submit(LogRecord& record) {
+        if (!queue_.try_push(std::move(record))) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        waiter_.notify();
+    }
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // Nome do nível para opções de linha de comando / configuração
+    static bool parseLevel(std::string_view name, LogLevel& out) {
+        static const char* const names[] = {"error", "warn", "info", "debug", "trace"};
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+            if (name == names[i]) {
+                out = static_cast<LogLevel>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    void run() {
+        LogRecord record;
+        uint64_t reportedDrops = 0;
+        for (;;) {
+            bool wrote = false;
+            while (queue_.try_pop(record)) {
+                FILE* out = record.Level <= LogLevel::Warn ? stderr : stdout;
+                std::fwrite(record.Text, 1, record.Length, out);
+                std::fputc('\n', out);
+                wrote = true;
+            }
+            uint64_t drops = dropped_.load(std::memory_order_relaxed);
+            if (drops != reportedDrops) {
+                std::fprintf(stderr, "[log] %llu linha(s) descartada(s) (fila cheia)\n",
+                             static_cast<unsigned long long>(drops - reportedDrops));
+                reportedDrops = drops;
+                wrote = true;
+            }
+            if (wrote) {
+                std::fflush(stdout);
+                std::fflush(stderr);
+            }
+            if (!running_.load()) {
+                if (queue_.size_approx() == 0) return;
+                continue;
+            }
+            waiter_.wait([this] {
+                return queue_.size_approx() == 0 && running_.load(std::memory_order_relaxed);
+            }, std::chrono::milliseconds(50));
+        }
+    }
+
+    BoundedMpmcQueue<LogRecord> queue_;
+    IdleWaiter waiter_;
+    std::thread thread_;
+    std::atomic<bool> running_{true};
+    std::atomic<LogLevel> level_{LogLevel::Info};
+    std::atomic<uint64_t> dropped_{0};
+};
+
+inline AsyncLogger& logger() {
+    static AsyncLogger instance;
+    return instance;
+}
+
+// Valor para imprimir em hexadecimal
+struct Hex {
+    uint64_t Value;
+};
+
+// Monta uma linha no registro e a envia ao logger no destrutor.
+// Texto além de LogRecord::MAX_TEXT é truncado.
+class LogLine {
+public:
+    explicit LogLine(LogLevel level) {
+        record_.Level = level;
+        record_.Length = 0;
+    }
+
+    ~LogLine() { logger().submit(record_); }
+
+    LogLine& operator<<(std::string_view s) {
+        size_t room = LogRecord::MAX_TEXT - record_.Length;
+        size_t n = std::min(room, s.size());
+        std::memcpy(record_.Text + record_.Length, s.data(), n);
+        record_.Length = static_cast<uint16_t>(record_.Length + n);
+        return *this;
+    }
+    LogLine& operator<<(const char* s) { return *this << std::string_view(s ? s : "(null)"); }
+    LogLine& operator<<(const std::string& s) { return *this << std::string_view(s); }
+    LogLine& operator<<(char c) { return *this << std::string_view(&c, 1); }
+    LogLine& operator<<(bool b) { return *this << (b ? "true" : "false"); }
+    LogLine& operator<<(int v) { return number(v); }
+    LogLine& operator<<(long v) { return number(v); }
+    LogLine& operator<<(long long v) { return number(v); }
+    LogLine& operator<<(unsigned v) { return number(v); }
+    LogLine& operator<<(unsigned long v) { return number(v); }
+    LogLine& operator<<(unsigned long long v) { return number(v); }
+    LogLine& operator<<(double v) { return number(v); }
+    LogLine& operator<<(Hex h) { return number(h.Value, 16); }
+
+private:
+    template <typename T>
+    LogLine& number(T v, int base = 10) {
+        char tmp[32];
+        std::to_chars_result res;
+        if constexpr (std::is_integral<T>::value) res = std::to_chars(tmp, tmp + sizeof(tmp), v, base);
+        else res = std::to_chars(tmp, tmp + sizeof(tmp), v);
+        return *this << std::string_view(tmp, static_cast<size_t>(res.ptr - tmp));
+    }
+
+    LogRecord record_;
+};
+
+#define BROKER_LOG(level, expr) \
+    do { if (logger().enabled(level)) { LogLine brokerLogLine_(level); brokerLogLine_ << expr; } } while (0)
+#define LOG_ERROR(expr) BROKER_LOG(LogLevel::Error, expr)
+#define LOG_WARN(expr)  BROKER_LOG(LogLevel::Warn, expr)
+#define LOG_INFO(expr)  BROKER_LOG(LogLevel::Info, expr)
+#define LOG_DEBUG(expr) BROKER_LOG(LogLevel::Debug, expr)
+#define LOG_TRACE(expr) BROKER_LOG(LogLevel::Trace, expr)
+
+/* -----------------------------------------------------------------------
+   Cache de tópicos de saída.
+   Guarda um mqtt::string_ref por tópico (ou por tópico de origem, nas
+   reescritas como "sim/x" -> "moto/x"), para as mensagens de saída compartilharem
+   o mesmo buffer em vez de alocar o nome do tópico a cada publicação.
+   A busca é por string_view, sem montar std::string.
+   -----------------------------------------------------------------------*/
+class TopicCache {
+public:
+    explicit TopicCache(size_t maxEntries = 4096) : maxEntries_(maxEntries) {}
+
+    TopicCache(const TopicCache&) = delete;
+    TopicCache& operator=(const TopicCache&) = delete;
+
+    // Tópico como string_ref compartilhado
+    mqtt::string_ref intern(std::string_view topic) {
+        return get(topic, [&] { return std::string(topic); });
+    }
+
+    // Tópico guardado sob a chave (ex.: o tópico de origem de uma
+    // reescrita); make() só é chamado quando a chave ainda não existe.
+    template <typename Make>
+    mqtt::string_ref get(std::string_view key, Make make) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            auto it = map_.find(key);
+            if (it != map_.end()) return it->second;
+        }
+        mqtt::string_ref value(make());
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        if (map_.size() >= maxEntries_) return value;   // cheio: não cacheia
+        auto it = map_.find(key);
+        if (it != map_.end()) return it->second;
+        keys_.emplace_back(key);
+        map_.emplace(keys_.back(), value);
+        return value;
+    }
+
+private:
+    // As chaves (string_view) apontam para strings guardadas em keys_,
+    // que têm endereço estável.
+    size_t maxEntries_;
+    std::shared_mutex mutex_;
+    std::deque<std::string> keys_;
+    std::unordered_map<std::string_view, mqtt::string_ref> map_;
+};
+
+/* -----------------------------------------------------------------------
+   Roteamento por tópico.
+   Cada regra associa um filtro MQTT (com "+" e "#") a um handler e a um
+   modelo de tópico de saída. As regras são compiladas numa trie por
+   nível de tópico: o custo da busca depende da profundidade do tópico,
+   não da quantidade de regras. Se várias regras casam, vence a mais
+   específica (nível literal > "+" > "#", da esquerda para a direita).
+   No modelo de saída, cada "+"/"#" é trocado, na ordem, pelo trecho que
+   o curinga correspondente do filtro capturou: "sim/#" -> "moto/#".
+   -----------------------------------------------------------------------*/
+enum class RouteHandler { SimCanJson, SimCanBinary, CanJson, CanBinary, Passthrough, Drop };
+
+struct RouteRule {
+    std::string    Pattern;
+    RouteHandler   Handler;
+    std::string    Target;     // modelo do tópico de saída ("" = tópico do decoder)
+    DeliveryPolicy Delivery{};   // vale sobre a do decoder
+};
+
+constexpr size_t MAX_ROUTE_WILDCARDS = 8;
+
+struct Route {
+    RouteRule        Rule;
+    size_t           Index = 0;        // posição na tabela (métricas por rota)
+    size_t           Wildcards = 0;
+    mqtt::string_ref FixedTarget;      // modelo sem curingas
+    mutable TopicCache Targets{1024};    // saídas já montadas, por tópico de origem
+};
+
+// Resultado da busca: a regra e os trechos capturados pelos curingas
+// (string_views no tópico de origem).
+struct RouteMatch {
+    const Route*     Matched = nullptr;
+    size_t           Captures = 0;
+    std::string_view Captured[MAX_ROUTE_WILDCARDS];
+};
+
+inline const char* routeHandlerName(RouteHandler h) {
+    switch (h) {
+        case RouteHandler::SimCanJson:   return "sim_can_json";
+        case RouteHandler::SimCanBinary: return "sim_can_bin";
+        case RouteHandler::CanJson:      return "can_json";
+        case RouteHandler::CanBinary:    return "can_bin";
+        case RouteHandler::Passthrough:  return "passthrough";
+        case RouteHandler::Drop:         return "drop";
+    }
+    return "?";
+}
+
+inline bool parseRouteHandler(std::string_view name, RouteHandler& out) {
+    for (RouteHandler h : {RouteHandler::SimCanJson, RouteHandler::SimCanBinary,
+                           RouteHandler::CanJson, RouteHandler::CanBinary,
+                           RouteHandler::Passthrough, RouteHandler::Drop}) {
+        if (name == routeHandlerName(h)) {
+            out = h;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Chama fn(level) para cada nível de um tópico/filtro
+template <typename Fn>
+void forEachLevel(std::string_view topic, Fn fn) {
+    size_t pos = 0;
+    for (;;) {
+        size_t slash = topic.find('/', pos);
+        fn(topic.substr(pos, slash == std::string_view::npos ? std::string_view::npos : slash - pos));
+        if (slash == std::string_view::npos) return;
+        pos = slash + 1;
+    }
+}
+
+// true se todo tópico aceito pelo filtro b também é aceito por a
+inline bool filterCovers(std::string_view a, std::string_view b) {
+    std::vector<std::string_view> la, lb;
+    forEachLevel(a, [&](std::string_view l) { la.push_back(l); });
+    forEachLevel(b, [&](std::string_view l) { lb.push_back(l); });
+    for (size_t i = 0; i < la.size(); ++i) {
+        if (la[i] == "#") return true;
+        if (i >= lb.size()) return false;
+        if (lb[i] == "#") return false;
+        if (la[i] != "+" && la[i] != lb[i]) return false;
+    }
+    return la.size() == lb.size();
+}
+
+class RouteTable {
+public:
+    // Compila as regras; lança std::invalid_argument se alguma for inválida
+    explicit RouteTable(const std::vector<RouteRule>& rules) {
+        nodes_.emplace_back();
+        for (const auto &rule : rules) add(rule);
+    }
+
+    RouteTable(const RouteTable&) = delete;
+    RouteTable& operator=(const RouteTable&) = delete;
+
+    // Rotas equivalentes à lógica original
+    static std::vector<RouteRule> defaultRules() {
+        return {
+            { "sim/canmessages", RouteHandler::SimCanJson,   "" },
+            { "sim/canbin",      RouteHandler::SimCanBinary, "" },
+            // Telemetria em volume: QoS 0 quando o publicador estiver atrasado
+            { "sim/#",           RouteHandler::Passthrough,  "moto/#",
+              DeliveryPolicy{POLICY_INHERIT, POLICY_INHERIT, 1, POLICY_INHERIT, OutputFormats()} },
+            { "can/messages",    RouteHandler::CanJson,      "sensor/sensordetector" },
+            { "can/bin",         RouteHandler::CanBinary,    "sensor/sensordetector" }
+        };
+    }
+
+    // [{"pattern": "sim/#", "handler": "passthrough", "target": "moto/#",
+    //   "qos": 0, "retained": false, "adaptive_qos": true, "expiry_s": 5,
+    //   "format": ["json", "cbor"]}, ...]
+    static std::vector<RouteRule> parseRules(const json& j) {
+        if (!j.is_array()) throw std::invalid_argument("rotas: esperado um array JSON");
+        std::vector<RouteRule> rules;
+        for (const auto &r : j) {
+            RouteRule rule;
+            rule.Pattern = r.at("pattern").get<std::string>();
+            std::string handler = r.at("handler").get<std::string>();
+            if (!parseRouteHandler(handler, rule.Handler)) {
+                throw std::invalid_argument("rotas: handler desconhecido \"" + handler + "\"");
+            }
+            rule.Target = r.value("target", "");
+            rule.Delivery = parseDeliveryPolicy(r, "rotas: " + rule.Pattern);
+            // Só as rotas de frames CAN convertem a leitura; nas outras o formato não teria efeito
+            if (rule.Delivery.Formats.Count > 0 &&
+                (rule.Handler == RouteHandler::Passthrough || rule.Handler == RouteHandler::Drop)) {
+                throw std::invalid_argument("rotas: " + rule.Pattern + ": format não vale no handler \"" + handler + "\"");
+            }
+            rules.push_back(std::move(rule));
+        }
+        return rules;
+    }
+
+    // Busca a regra mais específica para o tópico (sem alocar)
+    bool match(std::string_view topic, RouteMatch& out) const {
+        out.Matched = nullptr;
+        out.Captures = 0;
+        return matchFrom(0, topic, 0, out);
+    }
+
+    // Tópico de saída da regra casada; nulo quando a regra não tem modelo
+    mqtt::string_ref target(const RouteMatch& m, std::string_view topic) const {
+        const Route &route = *m.Matched;
+        if (route.Rule.Target.empty() || route.FixedTarget) return route.FixedTarget;
+        return route.Targets.get(topic, [&] { return expand(route, m); });
+    }
+
+    // Filtros para assinar: os padrões das regras, sem os já cobertos por outro
+    std::vector<std::string> subscriptions() const {
+        std::vector<std::string> out;
+        for (size_t i = 0; i < routes_.size(); ++i) {
+            const std::string &p = routes_[i]->Rule.Pattern;
+            bool covered = false;
+            for (size_t j = 0; j < routes_.size() && !covered; ++j) {
+                const std::string &q = routes_[j]->Rule.Pattern;
+                if (j != i && filterCovers(q, p) && (q != p || j < i)) covered = true;
+            }
+            if (!covered) out.push_back(p);
+        }
+        return out;
+    }
+
+    size_t size() const { return routes_.size(); }
+    const Route& at(size_t i) const { return *routes_[i]; }
+
+private:
+    static constexpr uint32_t NONE = 0xFFFFFFFF;
+
+    struct Node {
+        // As chaves apontam para o Pattern da regra que criou o nó
+        std::unordered_map<std::string_view, uint32_t> Children;
+        uint32_t Plus = NONE;   // filho "+"
+        int32_t  Hash = -1;     // regra terminada em "#" neste nível
+        int32_t  Here = -1;     // regra que termina exatamente neste nó
+    };
+
+    void add(const RouteRule& rule) {
+        if (rule.Pattern.empty()) throw std::invalid_argument("rotas: filtro vazio");
+
+        auto route = std::unique_ptr<Route>(new Route());
+        route->Rule = rule;
+        route->Index = routes_.size();
+        const std::string &pattern = route->Rule.Pattern;
+        int32_t index = static_cast<int32_t>(routes_.size());
+
+        // Percorre/cria os nós do filtro
+        uint32_t node = 0;
+        bool terminal = false;
+        forEachLevel(pattern, [&](std::string_view level) {
+            if (terminal) throw std::invalid_argument("rotas: \"#\" precisa ser o último nível em " + pattern);
+            if (level == "#") {
+                ++route->Wildcards;
+                terminal = true;
+                return;
+            }
+            if (level.find_first_of("+#") != std::string_view::npos && level != "+") {
+                throw std::invalid_argument("rotas: curinga ocupando parte de um nível em " + pattern);
+            }
+            if (level == "+") {
+                ++route->Wildcards;
+                if (nodes_[node].Plus == NONE) {
+                    nodes_[node].Plus = static_cast<uint32_t>(nodes_.size());
+                    nodes_.emplace_back();
+                }
+                node = nodes_[node].Plus;
+                return;
+            }
+            auto it = nodes_[node].Children.find(level);
+            if (it == nodes_[node].Children.end()) {
+                uint32_t child = static_cast<uint32_t>(nodes_.size());
+                nodes_.emplace_back();
+                it = nodes_[node].Children.emplace(level, child).first;
+            }
+            node = it->second;
+        });
+        if (route->Wildcards > MAX_ROUTE_WILDCARDS) {
+            throw std::invalid_argument("rotas: curingas demais em " + pattern);
+        }
+
+        int32_t &slot = terminal ? nodes_[node].Hash : nodes_[node].Here;
+        if (slot >= 0) throw std::invalid_argument("rotas: filtro duplicado " + pattern);
+
+        // Modelo de saída: no máximo um curinga por curinga do filtro
+        size_t targetWildcards = 0;
+        bool targetHash = false;
+        if (!rule.Target.empty()) {
+            forEachLevel(rule.Target, [&](std::string_view level) {
+                if (targetHash) throw std::invalid_argument("rotas: \"#\" precisa ser o último nível em " + rule.Target);
+                if (level == "+" || level == "#") ++targetWildcards;
+                targetHash = level == "#";
+            });
+        }
+        if (targetWildcards > route->Wildcards) {
+            throw std::invalid_argument("rotas: o modelo " + rule.Target + " usa mais curingas que " + pattern);
+        }
+        if (!rule.Target.empty() && targetWildcards == 0) {
+            route->FixedTarget = mqtt::string_ref(rule.Target);
+        }
+        slot = index;
+        routes_.push_back(std::move(route));
+    }
+
+    bool matchFrom(uint32_t n, std::string_view topic, size_t pos, RouteMatch& m) const {
+        const Node &node = nodes_[n];
+        if (pos == std::string_view::npos) {
+            if (node.Here >= 0) {
+                m.Matched = routes_[node.Here].get();
+                return true;
+            }
+            if (node.Hash >= 0) {
+                // "a/#" também casa com o próprio "a"
+                m.Captured[m.Captures++] = std::string_view();
+                m.Matched = routes_[node.Hash].get();
+                return true;
+            }
+            return false;
+        }
+
+        size_t slash = topic.find('/', pos);
+        std::string_view level = topic.substr(pos, slash == std::string_view::npos
+                                                   ? std::string_view::npos : slash - pos);
+        size_t next = slash == std::string_view::npos ? std::string_view::npos : slash + 1;
+        // Tópicos "$..." não casam com curinga no primeiro nível
+        bool wildcards = !(pos == 0 && !level.empty() && level[0] == '$');
+
+        auto it = node.Children.find(level);
+        if (it != node.Children.end() && matchFrom(it->second, topic, next, m)) return true;
+
+        if (wildcards && node.Plus != NONE) {
+            size_t saved = m.Captures;
+            m.Captured[m.Captures++] = level;
+            if (matchFrom(node.Plus, topic, next, m)) return true;
+            m.Captures = saved;
+        }
+        if (wildcards && node.Hash >= 0) {
+            m.Captured[m.Captures++] = topic.substr(pos);
+            m.Matched = routes_[node.Hash].get();
+            return true;
+        }
+        return false;
+    }
+
+    // Monta o tópico de saída trocando os curingas do modelo pelas capturas
+    static std::string expand(const Route& route, const RouteMatch& m) {
+        std::string out;
+        size_t k = 0;
+        bool first = true;
+        forEachLevel(route.Rule.Target, [&](std::string_view level) {
+            bool wildcard = level == "+" || level == "#";
+            std::string_view part = wildcard && k < m.Captures ? m.Captured[k++] : level;
+            if (level == "#" && part.empty()) return;   // casamento no nível pai
+            if (!first) out.push_back('/');
+            out.append(part.data(), part.size());
+            first = false;
+        });
+        return out;
+    }
+
+    std::vector<Node> nodes_;
+    std::vector<std::unique_ptr<Route>> routes_;
+};
+
+inline const RouteTable& defaultRouteTable() {
+    static const RouteTable table(RouteTable::defaultRules());
+    return table;
+}
+
+/* -----------------------------------------------------------------------
+   Métricas.
+   Cada thread escreve só no seu shard (atômicos relaxados com um único
+   escritor: sem disputa de cache line entre threads) e o snapshot soma
+   todos os shards. A latência (chegada -> confirmação da publicação) vai
+   num histograma log-linear no estilo HDR: 16 sub-faixas por potência
+   de 2, erro relativo abaixo de 6,25%.
+   -----------------------------------------------------------------------*/
+inline int64_t monotonicNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+enum class Counter : size_t {
+    Received,        // mensagens roteadas
+    Unrouted,        // tópico sem rota
+    Published,       // publicações confirmadas pelo broker
+    PublishFailed,
+    ParseErrors,     // JSON de entrada inválido (ou exceção na conversão)
+    InvalidFrames,   // frames binários inválidos
+    UnmappedIds,     // ArbitrationId sem decoder
+    Deduplicated,    // leituras não publicadas por não terem mudado
+    RateLimited,     // descartadas pela política de limite de taxa
+    CaptureDropped,  // não gravadas na captura (fila do gravador cheia)
+    FusionDropped,   // leituras de veículos além do limite da fusão
+    QosDowngraded,   // publicadas em QoS 0 pela política adaptativa
+    TopicAliased,    // publicações que saíram só com o alias do tópico
+    Reconnects,      // conexões refeitas depois de uma queda
+    Spooled,         // gravadas no spool em disco sem conexão
+    SpoolDrained,    // reenviadas do spool depois da reconexão
+    SpoolDropped,    // saíram do spool sem envio (anel cheio ou expiradas)
+    DeadLettered,    // entradas inválidas copiadas para o dead-letter
+    StopDropped,     // oferecidas depois do encerramento, ou que não saíram no prazo dele
+    Count
+};
+
+inline const char* counterName(Counter c) {
+    static const char* const names[] = {
+        "received", "unrouted", "published", "publish_failed",
+        "parse_errors", "invalid_frames", "unmapped_ids", "deduplicated",
+        "rate_limited", "capture_dropped", "fusion_dropped",
+        "qos_downgraded", "topic_aliased", "reconnects", "spooled",
+        "spool_drained", "spool_dropped", "dead_lettered", "stop_dropped"
+    };
+    return names[static_cast<size_t>(c)];
+}
+
+class LatencyHistogram {
+public:
+    static constexpr unsigned SUB_BITS  = 4;
+    static constexpr size_t   SUB_COUNT = size_t(1) << SUB_BITS;
+    static constexpr unsigned MAX_EXP   = 40;          // ~18 min em ns
+    static constexpr size_t   BUCKETS   = (MAX_EXP - SUB_BITS + 2) * SUB_COUNT;
+
+    static size_t bucketOf(uint64_t ns) {
+        if (ns < SUB_COUNT) return static_cast<size_t>(ns);
+        unsigned exp = 63u - static_cast<unsigned>(__builtin_clzll(ns));
+        if (exp > MAX_EXP) return BUCKETS - 1;
+        size_t sub = static_cast<size_t>(ns >> (exp - SUB_BITS)) & (SUB_COUNT - 1);
+        return (exp - SUB_BITS + 1) * SUB_COUNT + sub;
+    }
+
+    // Maior valor que cai no bucket
+    static uint64_t upperBound(size_t bucket) {
+        if (bucket < SUB_COUNT) return bucket;
+        unsigned exp = static_cast<unsigned>(bucket / SUB_COUNT) + SUB_BITS - 1;
+        uint64_t sub = bucket % SUB_COUNT;
+        return ((SUB_COUNT + sub + 1) << (exp - SUB_BITS)) - 1;
+    }
+};
+
+constexpr size_t MAX_METRIC_ROUTES = 64;                // rotas além disso somam na última
+constexpr size_t METRIC_ARB_IDS    = 0x800;             // IDs de 11 bits; estendidos somam à parte
+
+struct LatencySnapshot {
+    std::vector<uint64_t> Buckets = std::vector<uint64_t>(LatencyHistogram::BUCKETS);
+    uint64_t Count = 0;
+    uint64_t SumNs = 0;
+    uint64_t SloMisses = 0;    // acima do SLO da fila (0 quando não há SLO)
+
+    LatencySnapshot& operator+=(const LatencySnapshot& o) {
+        for (size_t i = 0; i < Buckets.size(); ++i) Buckets[i] += o.Buckets[i];
+        Count += o.Count;
+        SumNs += o.SumNs;
+        SloMisses += o.SloMisses;
+        return *this;
+    }
+
+    // Percentil (0..1) da latência, em ns
+    uint64_t percentile(double q) const {
+        if (Count == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(Count - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < Buckets.size(); ++i) {
+            seen += Buckets[i];
+            if (seen >= rank) return LatencyHistogram::upperBound(i);
+        }
+        return LatencyHistogram::upperBound(Buckets.size() - 1);
+    }
+};
+
+struct MetricsSnapshot {
+    uint64_t Counters[static_cast<size_t>(Counter::Count)] = {};
+    uint64_t ByRoute[MAX_METRIC_ROUTES] = {};
+    std::vector<std::pair<uint32_t, uint64_t>> ByArbitrationId;   // só os não zerados
+    uint64_t ExtendedIds = 0;
+    uint64_t ByParseError[PARSE_ERROR_COUNT] = {};                // entradas inválidas por motivo
+    LatencySnapshot Latency[PRIORITY_LANES];                      // por fila de prioridade
+    int64_t SloNs[PRIORITY_LANES] = {};
+
+    uint64_t counter(Counter c) const { return Counters[static_cast<size_t>(c)]; }
+
+    LatencySnapshot totalLatency() const {
+        LatencySnapshot total;
+        for (const auto &lane : Latency) total += lane;
+        return total;
+    }
+};
+
+// Filas e janela no momento do snapshot (lidas do pipeline; com vários
+// shards, a soma de todos)
+struct MetricsGauges {
+    size_t WorkerBacklog = 0;
+    size_t PublishQueue = 0;
+    size_t InFlight = 0;
+    size_t RateLimitBacklog = 0;   // em espera nas filas do limite de taxa
+    size_t SpoolBacklog = 0;       // no spool em disco, esperando a conexão
+
+    MetricsGauges& operator+=(const MetricsGauges& o) {
+        WorkerBacklog += o.WorkerBacklog;
+        PublishQueue += o.PublishQueue;
+        InFlight += o.InFlight;
+        RateLimitBacklog += o.RateLimitBacklog;
+        SpoolBacklog += o.SpoolBacklog;
+        return *this;
+    }
+};
+
+class Metrics {
+public:
+    using GaugeSource = std::function<MetricsGauges()>;
+
+    // Cada pipeline registra de onde ler suas filas; o id serve para
+    // remover o registro quando ele for destruído.
+    size_t addGaugeSource(GaugeSource source) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        gaugeSources_.emplace_back(++lastGaugeId_, std::move(source));
+        return lastGaugeId_;
+    }
+
+    void removeGaugeSource(size_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        gaugeSources_.erase(std::remove_if(gaugeSources_.begin(), gaugeSources_.end(),
+            [id](const std::pair<size_t, GaugeSource>& g) { return g.first == id; }), gaugeSources_.end());
+    }
+
+    MetricsGauges gauges() const {
+        MetricsGauges total;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto &g : gaugeSources_) total += g.second();
+        return total;
+    }
+
+    void count(Counter c, uint64_t n = 1) { bump(shard().Counters[static_cast<size_t>(c)], n); }
+
+    void countRoute(size_t index) {
+        bump(shard().ByRoute[std::min(index, MAX_METRIC_ROUTES - 1)]);
+    }
+
+    void countArbitrationId(uint32_t arb) {
+        Shard &s = shard();
+        bump(arb < METRIC_ARB_IDS ? s.ByArbitrationId[arb] : s.ExtendedIds);
+    }
+
+    void countParseError(ParseError e) {
+        bump(shard().ByParseError[std::min(static_cast<size_t>(e), PARSE_ERROR_COUNT - 1)]);
+    }
+
+    void recordLatency(int64_t ns, PriorityLane lane = PriorityLane::Normal) {
+        Shard &s = shard();
+        size_t l = static_cast<size_t>(lane);
+        uint64_t v = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+        bump(s.Latency[l][LatencyHistogram::bucketOf(v)]);
+        bump(s.LatencySumNs[l], v);
+        int64_t slo = slo_[l].load(std::memory_order_relaxed);
+        if (slo > 0 && ns > slo) bump(s.SloMisses[l]);
+    }
+
+    // Latência máxima esperada da fila (0 = sem SLO)
+    void setSlo(PriorityLane lane, std::chrono::nanoseconds slo) {
+        slo_[static_cast<size_t>(lane)].store(slo.count(), std::memory_order_relaxed);
+    }
+
+    MetricsSnapshot snapshot() const {
+        MetricsSnapshot out;
+        std::vector<uint64_t> ids(METRIC_ARB_IDS);
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto &s : shards_) {
+            for (size_t i = 0; i < static_cast<size_t>(Counter::Count); ++i) out.Counters[i] += load(s->Counters[i]);
+            for (size_t i = 0; i < MAX_METRIC_ROUTES; ++i) out.ByRoute[i] += load(s->ByRoute[i]);
+            for (size_t i = 0; i < METRIC_ARB_IDS; ++i) ids[i] += load(s->ByArbitrationId[i]);
+            for (size_t i = 0; i < PARSE_ERROR_COUNT; ++i) out.ByParseError[i] += load(s->ByParseError[i]);
+            for (size_t l = 0; l < PRIORITY_LANES; ++l) {
+                LatencySnapshot &lane = out.Latency[l];
+                for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+                    uint64_t n = load(s->Latency[l][i]);
+                    lane.Buckets[i] += n;
+                    lane.Count += n;
+                }
+                lane.SumNs += load(s->LatencySumNs[l]);
+                lane.SloMisses += load(s->SloMisses[l]);
+            }
+            out.ExtendedIds += load(s->ExtendedIds);
+        }
+        for (uint32_t i = 0; i < METRIC_ARB_IDS; ++i) {
+            if (ids[i]) out.ByArbitrationId.emplace_back(i, ids[i]);
+        }
+        for (size_t l = 0; l < PRIORITY_LANES; ++l) out.SloNs[l] = slo_[l].load(std::memory_order_relaxed);
+        return out;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> Counters[static_cast<size_t>(Counter::Count)] = {};
+        std::atomic<uint64_t> ByRoute[MAX_METRIC_ROUTES] = {};
+        std::atomic<uint64_t> ByArbitrationId[METRIC_ARB_IDS] = {};
+        std::atomic<uint64_t> ExtendedIds{0};
+        std::atomic<uint64_t> ByParseError[PARSE_ERROR_COUNT] = {};
+        std::atomic<uint64_t> Latency[PRIORITY_LANES][LatencyHistogram::BUCKETS] = {};
+        std::atomic<uint64_t> LatencySumNs[PRIORITY_LANES] = {};
+        std::atomic<uint64_t> SloMisses[PRIORITY_LANES] = {};
+    };
+
+    // Um só escritor por shard: load + store basta, sem RMW atômico
+    static void bump(std::atomic<uint64_t>& c, uint64_t n = 1) {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static uint64_t load(const std::atomic<uint64_t>& c) { return c.load(std::memory_order_relaxed); }
+
+    // Shard do thread atual, criado no primeiro uso. Os shards ficam até
+    // o fim do processo, para os totais não caírem quando um thread sai.
+    Shard& shard() {
+        thread_local Shard* mine = nullptr;
+        if (!mine) {
+            std::unique_ptr<Shard> s(new Shard());
+            mine = s.get();
+            std::lock_guard<std::mutex> lock(mutex_);
+            shards_.push_back(std::move(s));
+        }
+        return *mine;
+    }
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::vector<std::pair<size_t, GaugeSource>> gaugeSources_;
+    size_t lastGaugeId_ = 0;
+    std::atomic<int64_t> slo_[PRIORITY_LANES] = {};
+};
+
+// Instância global, como o logger
+inline Metrics& metrics() {
+    static Metrics instance;
+    return instance;
+}
+
+// {"count":..,"mean":..,"p50":..,"p99":..,"p999":..[,"slo":..,"slo_misses":..]}
+inline void writeLatencyJson(JsonWriter& w, const LatencySnapshot& lat, int64_t sloNs) {
+    w.raw('{');
+    w.key("count");
+    w.integer(static_cast<long long>(lat.Count));
+    w.raw(',');
+    w.key("mean");
+    w.integer(static_cast<long long>(lat.Count ? lat.SumNs / lat.Count : 0));
+    w.raw(',');
+    w.key("p50");
+    w.integer(static_cast<long long>(lat.percentile(0.50)));
+    w.raw(',');
+    w.key("p99");
+    w.integer(static_cast<long long>(lat.percentile(0.99)));
+    w.raw(',');
+    w.key("p999");
+    w.integer(static_cast<long long>(lat.percentile(0.999)));
+    if (sloNs > 0) {
+        w.raw(',');
+        w.key("slo");
+        w.integer(static_cast<long long>(sloNs));
+        w.raw(',');
+        w.key("slo_misses");
+        w.integer(static_cast<long long>(lat.SloMisses));
+    }
+    w.raw('}');
+}
+
+// {"counters":{...},"routes":{...},"arbitration_ids":{...},"rejected":{...},
+//  "latency_ns":{...},"latency_ns_by_lane":{"normal":{...},"high":{...}},"gauges":{...}}
+inline void writeMetricsJson(JsonWriter& w, const MetricsSnapshot& snap,
+                             const RouteTable& routes, const MetricsGauges& gauges) {
+    char hex[16];
+    w.raw('{');
+    w.key("counters");
+    w.raw('{');
+    for (size_t i = 0; i < static_cast<size_t>(Counter::Count); ++i) {
+        if (i) w.raw(',');
+        w.key(counterName(static_cast<Counter>(i)));
+        w.integer(static_cast<long long>(snap.Counters[i]));
+    }
+    w.raw('}');
+    w.raw(',');
+    w.key("routes");
+    w.raw('{');
+    for (size_t i = 0; i < routes.size() && i < MAX_METRIC_ROUTES; ++i) {
+        if (i) w.raw(',');
+        w.key(routes.at(i).Rule.Pattern);
+        w.integer(static_cast<long long>(snap.ByRoute[i]));
+    }
+    w.raw('}');
+    w.raw(',');
+    w.key("arbitration_ids");
+    w.raw('{');
+    bool first = true;
+    for (const auto &entry : snap.ByArbitrationId) {
+        if (!first) w.raw(',');
+        first = false;
+        std::snprintf(hex, sizeof(hex), "0x%X", entry.first);
+        w.key(hex);
+        w.integer(static_cast<long long>(entry.second));
+    }
+    if (snap.ExtendedIds) {
+        if (!first) w.raw(',');
+        w.key("extended");
+        w.integer(static_cast<long long>(snap.ExtendedIds));
+    }
+    w.raw('}');
+    w.raw(',');
+    w.key("rejected");
+    w.raw('{');
+    for (size_t i = 1; i < PARSE_ERROR_COUNT; ++i) {
+        if (i > 1) w.raw(',');
+        w.key(parseErrorName(static_cast<ParseError>(i)));
+        w.integer(static_cast<long long>(snap.ByParseError[i]));
+    }
+    w.raw('}');
+    w.raw(',');
+    w.key("latency_ns");
+    writeLatencyJson(w, snap.totalLatency(), 0);
+    w.raw(',');
+    w.key("latency_ns_by_lane");
+    w.raw('{');
+    for (size_t l = 0; l < PRIORITY_LANES; ++l) {
+        if (l) w.raw(',');
+        w.key(priorityLaneName(static_cast<PriorityLane>(l)));
+        writeLatencyJson(w, snap.Latency[l], snap.SloNs[l]);
+    }
+    w.raw('}');
+    w.raw(',');
+    w.key("gauges");
+    w.raw('{');
+    w.key("worker_backlog");
+    w.integer(static_cast<long long>(gauges.WorkerBacklog));
+    w.raw(',');
+    w.key("publish_queue");
+    w.integer(static_cast<long long>(gauges.PublishQueue));
+    w.raw(',');
+    w.key("in_flight");
+    w.integer(static_cast<long long>(gauges.InFlight));
+    w.raw(',');
+    w.key("rate_limit_backlog");
+    w.integer(static_cast<long long>(gauges.RateLimitBacklog));
+    w.raw(',');
+    w.key("spool_backlog");
+    w.integer(static_cast<long long>(gauges.SpoolBacklog));
+    w.raw('}');
+    w.raw('}');
+}
+
+// Formato texto do Prometheus (version 0.0.4)
+inline std::string renderPrometheus(const MetricsSnapshot& snap, const RouteTable& routes,
+                                    const MetricsGauges& gauges) {
+    std::string out;
+    char line[256];
+    auto add = [&](const char* fmt, auto... args) {
+        int n = std::snprintf(line, sizeof(line), fmt, args...);
+        if (n > 0) out.append(line, std::min<size_t>(static_cast<size_t>(n), sizeof(line) - 1));
+    };
+
+    for (size_t i = 0; i < static_cast<size_t>(Counter::Count); ++i) {
+        const char* name = counterName(static_cast<Counter>(i));
+        add("# TYPE cppbroker_%s_total counter\ncppbroker_%s_total %llu\n",
+            name, name, static_cast<unsigned long long>(snap.Counters[i]));
+    }
+
+    out += "# TYPE cppbroker_route_received_total counter\n";
+    for (size_t i = 0; i < routes.size() && i < MAX_METRIC_ROUTES; ++i) {
+        out += "cppbroker_route_received_total{route=\"";
+        for (char c : routes.at(i).Rule.Pattern) {
+            if (c == '\\' || c == '"') out.push_back('\\');
+            if (c == '\n') { out += "\\n"; continue; }
+            out.push_back(c);
+        }
+        out += "\"} " + std::to_string(snap.ByRoute[i]) + "\n";
+    }
+
+    out += "# TYPE cppbroker_arbitration_id_total counter\n";
+    for (const auto &entry : snap.ByArbitrationId) {
+        add("cppbroker_arbitration_id_total{id=\"0x%X\"} %llu\n",
+            entry.first, static_cast<unsigned long long>(entry.second));
+    }
+    if (snap.ExtendedIds) {
+        add("cppbroker_arbitration_id_total{id=\"extended\"} %llu\n",
+            static_cast<unsigned long long>(snap.ExtendedIds));
+    }
+
+    out += "# TYPE cppbroker_rejected_total counter\n";
+    for (size_t i = 1; i < PARSE_ERROR_COUNT; ++i) {
+        add("cppbroker_rejected_total{reason=\"%s\"} %llu\n",
+            parseErrorName(static_cast<ParseError>(i)), static_cast<unsigned long long>(snap.ByParseError[i]));
+    }
+
+    // Histograma em segundos, por fila; só os buckets com amostras (mais o +Inf)
+    out += "# TYPE cppbroker_latency_seconds histogram\n";
+    for (size_t l = 0; l < PRIORITY_LANES; ++l) {
+        const LatencySnapshot &lat = snap.Latency[l];
+        const char* lane = priorityLaneName(static_cast<PriorityLane>(l));
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < lat.Buckets.size(); ++i) {
+            if (!lat.Buckets[i]) continue;
+            cumulative += lat.Buckets[i];
+            add("cppbroker_latency_seconds_bucket{lane=\"%s\",le=\"%.9g\"} %llu\n", lane,
+                static_cast<double>(LatencyHistogram::upperBound(i)) / 1e9,
+                static_cast<unsigned long long>(cumulative));
+        }
+        add("cppbroker_latency_seconds_bucket{lane=\"%s\",le=\"+Inf\"} %llu\n", lane,
+            static_cast<unsigned long long>(lat.Count));
+        add("cppbroker_latency_seconds_sum{lane=\"%s\"} %.9f\n", lane, static_cast<double>(lat.SumNs) / 1e9);
+        add("cppbroker_latency_seconds_count{lane=\"%s\"} %llu\n", lane, static_cast<unsigned long long>(lat.Count));
+    }
+    out += "# TYPE cppbroker_latency_slo_misses_total counter\n";
+    for (size_t l = 0; l < PRIORITY_LANES; ++l) {
+        if (snap.SloNs[l] <= 0) continue;
+        add("cppbroker_latency_slo_misses_total{lane=\"%s\"} %llu\n", priorityLaneName(static_cast<PriorityLane>(l)),
+            static_cast<unsigned long long>(snap.Latency[l].SloMisses));
+    }
+
+    add("# TYPE cppbroker_worker_backlog gauge\ncppbroker_worker_backlog %zu\n", gauges.WorkerBacklog);
+    add("# TYPE cppbroker_publish_queue gauge\ncppbroker_publish_queue %zu\n", gauges.PublishQueue);
+    add("# TYPE cppbroker_in_flight gauge\ncppbroker_in_flight %zu\n", gauges.InFlight);
+    add("# TYPE cppbroker_rate_limit_backlog gauge\ncppbroker_rate_limit_backlog %zu\n", gauges.RateLimitBacklog);
+    add("# TYPE cppbroker_spool_backlog gauge\ncppbroker_spool_backlog %zu\n", gauges.SpoolBacklog);
+    return out;
+}
+
+/* -----------------------------------------------------------------------
+   Exposição das métricas: tarefa periódica (publica no tópico $SYS) e
+   um endpoint HTTP mínimo para o Prometheus (GET em qualquer caminho).
+   -----------------------------------------------------------------------*/
+struct MetricsOptions {
+    std::chrono::seconds Interval{10};           // 0 = não publica
+    std::string Topic = "$SYS/cppbroker/metrics";
+    int HttpPort = 0;                             // 0 = sem endpoint HTTP
+    std::chrono::milliseconds HighPrioritySlo{50}; // latência máxima da fila high (0 = sem SLO)
+};
+
+class PeriodicTask {
+public:
+    PeriodicTask(std::chrono::milliseconds interval, std::function<void()> task)
+        : interval_(interval), task_(std::move(task)), thread_([this] { run(); }) {}
+
+    ~PeriodicTask() { stop(); }
+
+    PeriodicTask(const PeriodicTask&) = delete;
+    PeriodicTask& operator=(const PeriodicTask&) = delete;
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopped_) return;
+            stopped_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!cv_.wait_for(lock, interval_, [this] { return stopped_; })) {
+            lock.unlock();
+            task_();
+            lock.lock();
+        }
+    }
+
+    std::chrono::milliseconds interval_;
+    std::function<void()> task_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopped_ = false;
+    std::thread thread_;
+};
+
+class MetricsHttpServer {
+public:
+    // Lança std::runtime_error se não conseguir abrir a porta
+    MetricsHttpServer(int port, std::function<std::string()> render)
+        : render_(std::move(render))
+    {
+        fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd_ < 0) throw std::runtime_error("metrics: socket() falhou");
+        int on = 1;
+        ::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        if (::bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(fd_, 8) < 0) {
+            ::close(fd_);
+            throw std::runtime_error("metrics: não foi possível escutar na porta " + std::to_string(port));
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~MetricsHttpServer() { stop(); }
+
+    MetricsHttpServer(const MetricsHttpServer&) = delete;
+    MetricsHttpServer& operator=(const MetricsHttpServer&) = delete;
+
+    void stop() {
+        if (!running_.exchange(false)) return;
+        if (thread_.joinable()) thread_.join();
+        ::close(fd_);
+    }
+
+private:
+    void run() {
+        while (running_.load()) {
+            pollfd pfd{fd_, POLLIN, 0};
+            if (::poll(&pfd, 1, 200) <= 0) continue;   // acorda para ver running_
+            int client = ::accept(fd_, nullptr, nullptr);
+            if (client < 0) continue;
+
+            // Só lê o começo da requisição; qualquer GET devolve as métricas
+            char request[1024];
+            pollfd cfd{client, POLLIN, 0};
+            if (::poll(&cfd, 1, 1000) > 0) (void)::recv(client, request, sizeof(request), 0);
+
+            std::string body = render_();
+            std::string response = "HTTP/1.0 200 OK\r\n"
+                                   "Content-Type: text/plain; version=0.0.4\r\n"
+                                   "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                                   "Connection: close\r\n\r\n" + body;
+            size_t sent = 0;
+            while (sent < response.size()) {
+                ssize_t n = ::send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0) break;
+                sent += static_cast<size_t>(n);
+            }
+            ::close(client);
+        }
+    }
+
+    std::function<std::string()> render_;
+    int fd_ = -1;
+    std::atomic<bool> running_{true};
+    std::thread thread_;
+};
+
+/* -----------------------------------------------------------------------
+   Detecção de mudança (opcional): os sensores repetem o mesmo frame a
+   10-100 Hz mesmo sem mudança, e cada repetição reescreveria o retained
+   do Mosquitto. Guarda o último valor publicado por decoder (vetor
+   indexado pelo slot da DecoderTable, um por família de origem: real e
+   simulador) e descarta o frame se os bytes de dados forem os mesmos.
+   Com deadband, também descarta quando só a distância mudou, e menos que
+   o limite. O heartbeat republica mesmo sem mudança depois de X ms.
+   IDs sem decoder sempre passam.
+   -----------------------------------------------------------------------*/
+struct DedupOptions {
+    bool Enabled = false;
+    std::chrono::milliseconds Heartbeat{1000};   // 0 = sem heartbeat
+    double DistanceDeadband = 0;                 // 0 = qualquer mudança publica
+};
+
+class ChangeFilter {
+public:
+    ChangeFilter(const DecoderTable& decoders, const DedupOptions& opts)
+        : decoders_(decoders), opts_(opts),
+          heartbeatNs_(std::chrono::duration_cast<std::chrono::nanoseconds>(opts.Heartbeat).count()),
+          entries_(decoders.size() * 2) {}
+
+    // true se a leitura deve ser publicada (e passa a ser a última).
+    // reading = decodeReading(decoder, can), já feita por quem chama.
+    bool admit(FrameSource source, const CanData& can, const SensorReading& reading, int64_t nowNs) {
+        uint16_t slot = decoders_.slotOf(static_cast<uint32_t>(can.ArbitrationId));
+        if (slot == DecoderTable::NO_SLOT) return true;
+        Entry &e = entries_[slot * 2 + static_cast<size_t>(source)];
+
+        uint64_t bytes = packData(can.Data);
+        uint64_t length = can.Data.size();
+        int64_t last = e.LastNs.load(std::memory_order_relaxed);
+        bool expired = last == 0 || (heartbeatNs_ > 0 && nowNs - last >= heartbeatNs_);
+
+        if (!expired) {
+            if (e.Bytes.load(std::memory_order_relaxed) == bytes &&
+                e.Length.load(std::memory_order_relaxed) == length) {
+                return false;
+            }
+            if (opts_.DistanceDeadband > 0 &&
+                reading.Status == e.Status.load(std::memory_order_relaxed) &&
+                reading.SideSet == e.SideSet.load(std::memory_order_relaxed) &&
+                std::fabs(reading.Distance - e.Distance.load(std::memory_order_relaxed)) < opts_.DistanceDeadband) {
+                return false;
+            }
+        }
+
+        // Publica: guarda o que foi enviado (a deadband compara com ele,
+        // então mudanças pequenas e seguidas não se acumulam sem publicar)
+        e.Bytes.store(bytes, std::memory_order_relaxed);
+        e.Length.store(length, std::memory_order_relaxed);
+        e.Status.store(reading.Status, std::memory_order_relaxed);
+        e.SideSet.store(reading.SideSet, std::memory_order_relaxed);
+        e.Distance.store(reading.Distance, std::memory_order_relaxed);
+        e.LastNs.store(nowNs, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    // O mesmo ArbitrationId vai sempre para o mesmo worker (chave de
+    // ordenação), então cada entrada tem, na prática, um só escritor. Os
+    // atômicos relaxados só evitam corrida se a chave cair em outro worker
+    // (ex.: JSON sem o campo do ID) ou em outro shard, que compartilha o
+    // filtro; no pior caso sai uma publicação a mais.
+    struct Entry {
+        std::atomic<uint64_t>    Bytes{0};
+        std::atomic<uint64_t>    Length{0};
+        std::atomic<bool>        Status{false};
+        std::atomic<bool>        SideSet{false};   // o lado, por decoder (os rótulos são fixos)
+        std::atomic<double>      Distance{0};
+        std::atomic<int64_t>     LastNs{0};     // 0 = nada publicado ainda
+    };
+
+    // CAN clássico: os 8 bytes numa palavra só (uma comparação). CAN FD:
+    // hash FNV-1a dos bytes.
+    static uint64_t packData(const InlineBytes<CAN_MAX_DATA_LEN>& data) {
+        uint64_t word = 0;
+        if constexpr (CAN_MAX_DATA_LEN <= sizeof(word)) {
+            std::memcpy(&word, data.begin(), data.size());
+        } else {
+            word = 14695981039346656037ull;
+            for (uint8_t b : data) word = (word ^ b) * 1099511628211ull;
+        }
+        return word;
+    }
+
+    const DecoderTable& decoders_;
+    DedupOptions opts_;
+    int64_t heartbeatNs_;
+    std::vector<Entry> entries_;
+};
+
+/* -----------------------------------------------------------------------
+   Limite de taxa por tópico de saída (token bucket).
+   Cada regra (filtro MQTT sobre o tópico de saída) tem seu balde e sua
+   fila de espera; o limite global vale para todo o tráfego, e quem não
+   casa com nenhuma regra espera na fila global. Sem ficha disponível, a
+   política da regra decide: descartar a nova, descartar a mais antiga da
+   fila ou manter só a última por tópico (coalesce). Assim uma enxurrada
+   em "moto/#" é cortada antes de chegar à fila do publicador e não
+   atrasa os tópicos de segurança. Regra com taxa 0 = sem limite e fora
+   do limite global.
+   -----------------------------------------------------------------------*/
+enum class OverflowPolicy { DropNewest, DropOldest, CoalesceLatest };
+
+inline bool parseOverflowPolicy(std::string_view name, OverflowPolicy& out) {
+    if (name == "drop-newest")     out = OverflowPolicy::DropNewest;
+    else if (name == "drop-oldest") out = OverflowPolicy::DropOldest;
+    else if (name == "coalesce")    out = OverflowPolicy::CoalesceLatest;
+    else return false;
+    return true;
+}
+
+struct RateLimit {
+    std::string    Filter;                  // vazio = limite global
+    double         RatePerSec = 0;          // 0 = sem limite
+    double         Burst = 0;               // 0 = uma ficha por segundo de taxa
+    OverflowPolicy Policy = OverflowPolicy::DropOldest;
+    size_t         Backlog = 256;           // mensagens em espera na regra
+};
+
+// "FILTRO=TAXA[:BURST[:POLÍTICA]]" (sem "FILTRO=" para o limite global)
+inline bool parseRateLimit(std::string_view spec, bool global, RateLimit& out) {
+    out = RateLimit();
+    if (!global) {
+        size_t eq = spec.rfind('=');
+        if (eq == std::string_view::npos || eq == 0) return false;
+        out.Filter.assign(spec.data(), eq);
+        spec.remove_prefix(eq + 1);
+    }
+    std::string_view parts[3];
+    size_t n = 0;
+    while (n < 3) {
+        size_t colon = spec.find(':');
+        parts[n++] = spec.substr(0, colon);
+        if (colon == std::string_view::npos) break;
+        spec.remove_prefix(colon + 1);
+    }
+    auto number = [](std::string_view text, double& value) {
+        std::string copy(text);
+        char* end = nullptr;
+        value = std::strtod(copy.c_str(), &end);
+        return !copy.empty() && end && *end == '\0' && value >= 0;
+    };
+    if (!number(parts[0], out.RatePerSec)) return false;
+    if (n > 1 && !parts[1].empty() && !number(parts[1], out.Burst)) return false;
+    if (n > 2 && !parseOverflowPolicy(parts[2], out.Policy)) return false;
+    return true;
+}
+
+// Balde de fichas no formato GCRA: em vez do saldo de fichas guarda o
+// "instante teórico" da próxima, num único atômico. Vários threads tiram
+// fichas com CAS, sem trava; a ficha que sobra de uma tentativa que não
+// usou nada volta com refund().
+class TokenBucket {
+public:
+    TokenBucket(double ratePerSec, double burst) {
+        if (ratePerSec <= 0) return;
+        double size = std::max(1.0, burst > 0 ? burst : ratePerSec);
+        intervalNs_ = std::max<int64_t>(1, std::llround(1e9 / ratePerSec));
+        toleranceNs_ = static_cast<int64_t>((size - 1) * 1e9 / ratePerSec);
+    }
+
+    bool unlimited() const { return intervalNs_ == 0; }
+
+    bool available(int64_t nowNs) const {
+        return unlimited() || tat_.load(std::memory_order_relaxed) - nowNs <= toleranceNs_;
+    }
+
+    bool tryTake(int64_t nowNs) {
+        if (unlimited()) return true;
+        int64_t tat = tat_.load(std::memory_order_relaxed);
+        do {
+            if (tat - nowNs > toleranceNs_) return false;
+        } while (!tat_.compare_exchange_weak(tat, std::max(tat, nowNs) + intervalNs_,
+                                             std::memory_order_relaxed));
+        return true;
+    }
+
+    void refund() {
+        if (!unlimited()) tat_.fetch_sub(intervalNs_, std::memory_order_relaxed);
+    }
+
+private:
+    int64_t intervalNs_ = 0;             // 0 = sem limite
+    int64_t toleranceNs_ = 0;            // rajada além da primeira ficha
+    std::atomic<int64_t> tat_{0};
+};
+
+// Mensagem pronta para o publicador; o instante de chegada alimenta o
+// histograma de latência quando a entrega é confirmada (0 = não mede).
+struct OutgoingMessage {
+    mqtt::message_ptr Msg;   // do publicador até o envio (o alias do tópico entra no send)
+    int64_t ArrivalNs = 0;
+    PriorityLane Lane = PriorityLane::Normal;
+};
+
+class RateShaper {
+public:
+    enum class Verdict { Pass, Held, Dropped };
+
+    RateShaper(const std::vector<RateLimit>& limits, const RateLimit& global)
+        : global_(global.RatePerSec, global.Burst)
+    {
+        for (const auto &limit : limits) lanes_.emplace_back(new Lane(limit));
+        RateLimit fallback = global;
+        fallback.RatePerSec = 0;   // a fila global só espera pelo balde global
+        lanes_.emplace_back(new Lane(fallback));
+    }
+
+    // Decide na entrada: Pass = pode ir já para a fila do publicador;
+    // Held = ficou na fila da regra; Dropped = descartada pela política
+    // (a própria mensagem ou, em drop-oldest/coalesce, outra que saiu).
+    // Com a fila da regra vazia e ficha nos baldes não trava nada; a trava
+    // da regra só protege a fila de espera.
+    Verdict offer(OutgoingMessage& msg, int64_t nowNs) {
+        Lane &lane = laneOf(msg.Msg->get_topic());
+        if (lane.Held.load(std::memory_order_acquire) == 0 && takeTokens(lane, nowNs)) {
+            return Verdict::Pass;
+        }
+
+        std::lock_guard<std::mutex> lock(lane.Mutex);
+        if (lane.Pending.empty() && takeTokens(lane, nowNs)) return Verdict::Pass;
+
+        switch (lane.Config.Policy) {
+        case OverflowPolicy::DropNewest:
+            if (lane.Pending.size() >= lane.Config.Backlog) return Verdict::Dropped;
+            break;
+        case OverflowPolicy::CoalesceLatest:
+            for (auto &pending : lane.Pending) {
+                if (pending.Msg->get_topic() == msg.Msg->get_topic()) {
+                    pending = std::move(msg);   // fica só a última do tópico
+                    return Verdict::Dropped;
+                }
+            }
+            // Tópico novo: mesma regra de espaço do drop-oldest
+            [[fallthrough]];
+        case OverflowPolicy::DropOldest:
+            if (lane.Pending.size() >= lane.Config.Backlog) {
+                lane.Pending.pop_front();
+                lane.Pending.push_back(std::move(msg));
+                return Verdict::Dropped;
+            }
+            break;
+        }
+        lane.Pending.push_back(std::move(msg));
+        lane.Held.fetch_add(1, std::memory_order_release);
+        ++pending_;
+        return Verdict::Held;
+    }
+
+    // Libera as mensagens em espera que já têm ficha, na ordem das regras.
+    // push(msg) devolve false se a fila do publicador encheu. Com force,
+    // ignora os limites (encerramento).
+    template <typename Push>
+    void drain(int64_t nowNs, Push push, bool force = false) {
+        if (pending_ == 0) return;
+        for (auto &lanePtr : lanes_) {
+            Lane &lane = *lanePtr;
+            if (lane.Held.load(std::memory_order_acquire) == 0) continue;
+            std::lock_guard<std::mutex> lock(lane.Mutex);
+            while (!lane.Pending.empty()) {
+                if (!force && !takeTokens(lane, nowNs)) break;
+                if (!push(lane.Pending.front())) {
+                    if (!force) refundTokens(lane);
+                    return;
+                }
+                lane.Pending.pop_front();
+                lane.Held.fetch_sub(1, std::memory_order_release);
+                --pending_;
+            }
+        }
+    }
+
+    size_t pending() const { return pending_.load(std::memory_order_relaxed); }
+
+private:
+    struct Lane {
+        explicit Lane(const RateLimit& config)
+            : Config(config), Bucket(config.RatePerSec, config.Burst),
+              Exempt(!config.Filter.empty() && Bucket.unlimited()) {}
+        RateLimit Config;
+        TokenBucket Bucket;
+        bool Exempt;                        // regra sem limite: nem o global vale
+        std::mutex Mutex;                   // só para Pending
+        std::deque<OutgoingMessage> Pending;
+        std::atomic<size_t> Held{0};        // Pending.size(), lido sem a trava
+    };
+
+    // Ficha da regra e do balde global, ou nenhuma das duas
+    bool takeTokens(Lane& lane, int64_t nowNs) {
+        if (!lane.Bucket.tryTake(nowNs)) return false;
+        if (lane.Exempt || global_.tryTake(nowNs)) return true;
+        lane.Bucket.refund();
+        return false;
+    }
+
+    void refundTokens(Lane& lane) {
+        lane.Bucket.refund();
+        if (!lane.Exempt) global_.refund();
+    }
+
+    // Regra do tópico (a primeira que casa; senão a fila global),
+    // cacheada por tópico
+    Lane& laneOf(const std::string& topic) {
+        {
+            std::shared_lock<std::shared_mutex> lock(cacheMutex_);
+            auto it = laneByTopic_.find(topic);
+            if (it != laneByTopic_.end()) return *lanes_[it->second];
+        }
+        size_t index = lanes_.size() - 1;
+        for (size_t i = 0; i + 1 < lanes_.size(); ++i) {
+            if (filterCovers(lanes_[i]->Config.Filter, topic)) {
+                index = i;
+                break;
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(cacheMutex_);
+        if (laneByTopic_.size() < 4096) laneByTopic_.emplace(topic, index);
+        return *lanes_[index];
+    }
+
+    TokenBucket global_;
+    std::vector<std::unique_ptr<Lane>> lanes_;
+    std::shared_mutex cacheMutex_;
+    std::unordered_map<std::string, size_t> laneByTopic_;
+    std::atomic<size_t> pending_{0};
+};
+
+/* -----------------------------------------------------------------------
+   Captura e replay do tráfego de entrada.
+   A captura grava cada mensagem recebida (instante, id do tópico,
+   payload) em segmentos binários só de acréscimo, "<prefixo>.000001.cap",
+   "<prefixo>.000002.cap", ... O callback só enfileira o ponteiro da
+   mensagem do Paho; um thread escreve em disco. Com a fila cheia a
+   mensagem não é gravada (conta capture_dropped), sem travar o pipeline.
+
+   Formato (little-endian), cada segmento independente dos outros:
+     cabeçalho: "CBCAP" 0x01 0x00 0x00
+     tópico:    u8 1 | u16 id | u16 tamanho | bytes
+     mensagem:  u8 2 | u16 id | u32 tamanho | i64 ns (system_clock) | bytes
+   O tópico é definido no segmento antes da primeira mensagem que o usa.
+
+   O replay mapeia os segmentos em memória e entrega as mensagens ao
+   pipeline, intercalando os arquivos pelo instante, na velocidade
+   original, N vezes mais rápido ou sem espera.
+   -----------------------------------------------------------------------*/
+constexpr char    CAPTURE_MAGIC[8] = {'C', 'B', 'C', 'A', 'P', 1, 0, 0};
+constexpr uint8_t CAPTURE_TOPIC    = 1;
+constexpr uint8_t CAPTURE_MESSAGE  = 2;
+constexpr size_t  CAPTURE_TOPIC_HEADER   = 1 + 2 + 2;
+constexpr size_t  CAPTURE_MESSAGE_HEADER = 1 + 2 + 4 + 8;
+
+struct CaptureOptions {
+    std::string Prefix;                          // vazio = sem captura
+    size_t SegmentBytes = size_t(64) << 20;      // tamanho de cada segmento
+    size_t QueueCapacity = 16384;
+};
+
+inline void putLe16(std::string& out, uint16_t v) {
+    out.push_back(static_cast<char>(v));
+    out.push_back(static_cast<char>(v >> 8));
+}
+
+inline void putLe32(std::string& out, uint32_t v) {
+    putLe16(out, static_cast<uint16_t>(v));
+    putLe16(out, static_cast<uint16_t>(v >> 16));
+}
+
+inline void putLe64(std::string& out, uint64_t v) {
+    putLe32(out, static_cast<uint32_t>(v));
+    putLe32(out, static_cast<uint32_t>(v >> 32));
+}
+
+inline uint16_t readLe16(const uint8_t* p) {
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+// "<prefixo>.000001.cap"
+inline std::string captureSegmentName(const std::string& prefix, size_t seq) {
+    char suffix[24];
+    std::snprintf(suffix, sizeof(suffix), ".%06zu.cap", seq);
+    return prefix + suffix;
+}
+
+class CaptureWriter {
+public:
+    explicit CaptureWriter(const CaptureOptions& opts)
+        : opts_(opts), queue_(opts.QueueCapacity)
+    {
+        openSegment();   // falha aqui (ex.: diretório inexistente) já sai do construtor
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~CaptureWriter() { stop(); }
+
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    // Thread do callback: só enfileira, nunca espera
+    void record(const mqtt::const_message_ptr& msg) {
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        if (!queue_.try_push(Record{now, msg})) {
+            metrics().count(Counter::CaptureDropped);
+            return;
+        }
+        waiter_.notify();
+    }
+
+    // Grava o que estiver na fila e fecha o segmento atual
+    void stop() {
+        if (!running_.exchange(false)) return;
+        waiter_.wakeAll();
+        if (thread_.joinable()) thread_.join();
+        closeSegment();
+    }
+
+    size_t backlog() const { return queue_.size_approx(); }
+
+private:
+    struct Record {
+        int64_t TimeNs = 0;
+        mqtt::const_message_ptr Msg;
+    };
+
+    void run() {
+        Record rec;
+        for (;;) {
+            if (queue_.try_pop(rec)) {
+                write(rec);
+                rec.Msg.reset();
+                continue;
+            }
+            if (!running_.load(std::memory_order_acquire)) {
+                while (queue_.try_pop(rec)) write(rec);
+                return;
+            }
+            // Fila vazia: manda para o disco o que está no buffer
+            if (file_) std::fflush(file_);
+            waiter_.wait([this] {
+                return queue_.size_approx() == 0 && running_.load(std::memory_order_relaxed);
+            }, std::chrono::milliseconds(100));
+        }
+    }
+
+    void write(const Record& rec) {
+        if (!file_) return;
+        const std::string &topic = rec.Msg->get_topic();
+        const std::string &payload = rec.Msg->get_payload();
+        size_t need = CAPTURE_TOPIC_HEADER + topic.size() + CAPTURE_MESSAGE_HEADER + payload.size();
+        if (written_ > sizeof(CAPTURE_MAGIC) && written_ + need > opts_.SegmentBytes) {
+            closeSegment();
+            try {
+                openSegment();
+            }
+            catch (const std::exception &ex) {
+                LOG_ERROR(ex.what() << "; captura interrompida");
+                return;
+            }
+        }
+
+        if (topic.size() > UINT16_MAX) {
+            LOG_WARN("Tópico longo demais para a captura: " << topic.substr(0, 64) << "...");
+            return;
+        }
+
+        // Ids válidos só dentro do segmento; ao esgotar, começa outro
+        auto it = topicIds_.find(topic);
+        if (it == topicIds_.end()) {
+            if (topicIds_.size() > UINT16_MAX) {
+                closeSegment();
+                try {
+                    openSegment();
+                }
+                catch (const std::exception &ex) {
+                    LOG_ERROR(ex.what() << "; captura interrompida");
+                    return;
+                }
+            }
+            uint16_t id = static_cast<uint16_t>(topicIds_.size());
+            it = topicIds_.emplace(topic, id).first;
+            buffer_.assign(1, static_cast<char>(CAPTURE_TOPIC));
+            putLe16(buffer_, id);
+            putLe16(buffer_, static_cast<uint16_t>(topic.size()));
+            buffer_ += topic;
+            append(buffer_.data(), buffer_.size());
+        }
+
+        buffer_.assign(1, static_cast<char>(CAPTURE_MESSAGE));
+        putLe16(buffer_, it->second);
+        putLe32(buffer_, static_cast<uint32_t>(payload.size()));
+        putLe64(buffer_, static_cast<uint64_t>(rec.TimeNs));
+        append(buffer_.data(), buffer_.size());
+        append(payload.data(), payload.size());
+    }
+
+    void append(const char* data, size_t size) {
+        if (std::fwrite(data, 1, size, file_) != size) {
+            LOG_ERROR("Falha ao gravar a captura em " << captureSegmentName(opts_.Prefix, seq_));
+        }
+        written_ += size;
+    }
+
+    void openSegment() {
+        std::string name = captureSegmentName(opts_.Prefix, ++seq_);
+        file_ = std::fopen(name.c_str(), "wb");
+        if (!file_) throw std::runtime_error("captura: não foi possível criar " + name);
+        std::setvbuf(file_, nullptr, _IOFBF, size_t(1) << 20);
+        topicIds_.clear();
+        written_ = 0;
+        append(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+        LOG_INFO("Gravando a captura em " << name);
+    }
+
+    void closeSegment() {
+        if (!file_) return;
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+
+    CaptureOptions opts_;
+    BoundedMpmcQueue<Record> queue_;
+    IdleWaiter waiter_;
+    std::thread thread_;
+    std::atomic<bool> running_{true};
+
+    // Só o thread de escrita mexe daqui para baixo
+    std::FILE* file_ = nullptr;
+    size_t seq_ = 0;
+    size_t written_ = 0;
+    std::unordered_map<std::string, uint16_t> topicIds_;
+    std::string buffer_;
+};
+
+// Um segmento mapeado em memória, lido em sequência
+class CaptureSegment {
+public:
+    struct Entry {
+        int64_t TimeNs = 0;
+        mqtt::string_ref Topic;
+        std::string_view Payload;   // aponta para o mapeamento
+    };
+
+    explicit CaptureSegment(const std::string& path) : path_(path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("captura: não foi possível abrir " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(CAPTURE_MAGIC))) {
+            ::close(fd);
+            throw std::runtime_error("captura: arquivo inválido " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        void* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("captura: mmap falhou em " + path);
+        data_ = static_cast<const uint8_t*>(p);
+        ::madvise(p, size_, MADV_SEQUENTIAL);
+        if (std::memcmp(data_, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+            ::munmap(p, size_);
+            throw std::runtime_error("captura: cabeçalho inválido em " + path);
+        }
+        pos_ = sizeof(CAPTURE_MAGIC);
+    }
+
+    ~CaptureSegment() { ::munmap(const_cast<uint8_t*>(data_), size_); }
+
+    CaptureSegment(const CaptureSegment&) = delete;
+    CaptureSegment& operator=(const CaptureSegment&) = delete;
+
+    // Próxima mensagem; false no fim. Um registro cortado no fim (gravação
+    // interrompida) encerra o segmento com um aviso.
+    bool next(Entry& e) {
+        while (pos_ < size_) {
+            const uint8_t* p = data_ + pos_;
+            size_t left = size_ - pos_;
+            if (p[0] == CAPTURE_TOPIC && left >= CAPTURE_TOPIC_HEADER) {
+                uint16_t id = readLe16(p + 1);
+                size_t len = readLe16(p + 3);
+                if (left - CAPTURE_TOPIC_HEADER < len) break;
+                if (topics_.size() <= id) topics_.resize(size_t(id) + 1);
+                topics_[id] = mqtt::string_ref(reinterpret_cast<const char*>(p + CAPTURE_TOPIC_HEADER), len);
+                pos_ += CAPTURE_TOPIC_HEADER + len;
+                continue;
+            }
+            if (p[0] == CAPTURE_MESSAGE && left >= CAPTURE_MESSAGE_HEADER) {
+                uint16_t id = readLe16(p + 1);
+                size_t len = readLe32(p + 3);
+                if (left - CAPTURE_MESSAGE_HEADER < len) break;
+                if (id >= topics_.size() || !topics_[id]) break;
+                e.TimeNs = static_cast<int64_t>(readLe64(p + 7));
+                e.Topic = topics_[id];
+                e.Payload = std::string_view(reinterpret_cast<const char*>(p + CAPTURE_MESSAGE_HEADER), len);
+                pos_ += CAPTURE_MESSAGE_HEADER + len;
+                return true;
+            }
+            break;
+        }
+        if (pos_ < size_) {
+            LOG_WARN("Captura " << path_ << " truncada ou corrompida no byte " << pos_);
+            pos_ = size_;
+        }
+        return false;
+    }
+
+private:
+    std::string path_;
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    size_t pos_ = 0;
+    std::vector<mqtt::string_ref> topics_;   // por id, no segmento
+};
+
+// Arquivos de uma captura: o próprio caminho, se existir, ou os segmentos
+// "<prefixo>.NNNNNN.cap" em sequência.
+inline std::vector<std::string> captureFiles(const std::string& pathOrPrefix) {
+    struct stat st;
+    if (::stat(pathOrPrefix.c_str(), &st) == 0 && S_ISREG(st.st_mode)) return {pathOrPrefix};
+    std::vector<std::string> files;
+    for (size_t seq = 1; ; ++seq) {
+        std::string name = captureSegmentName(pathOrPrefix, seq);
+        if (::stat(name.c_str(), &st) != 0) break;
+        files.push_back(std::move(name));
+    }
+    return files;
+}
+
+class CaptureReplayer {
+public:
+    using Sink = std::function<void(mqtt::const_message_ptr)>;
+
+    // Cada entrada é uma sequência de arquivos (ex.: os segmentos de uma
+    // captura); as sequências são intercaladas pelo instante gravado.
+    explicit CaptureReplayer(std::vector<std::vector<std::string>> sources)
+        : sources_(std::move(sources)) {}
+
+    // speed: 1 = tempo original, N = N vezes mais rápido, 0 = sem espera.
+    // Retorna o número de mensagens entregues.
+    size_t run(const Sink& sink, double speed, const std::atomic<bool>* cancel = nullptr) {
+        std::vector<Cursor> cursors(sources_.size());
+        for (size_t i = 0; i < sources_.size(); ++i) {
+            cursors[i].Files = &sources_[i];
+            advance(cursors[i]);
+        }
+
+        size_t delivered = 0;
+        int64_t firstNs = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (;;) {
+            if (cancel && cancel->load(std::memory_order_relaxed)) break;
+            Cursor* next = nullptr;
+            for (auto &c : cursors) {
+                if (c.Valid && (!next || c.Current.TimeNs < next->Current.TimeNs)) next = &c;
+            }
+            if (!next) break;
+
+            const CaptureSegment::Entry &e = next->Current;
+            if (delivered == 0) firstNs = e.TimeNs;
+            if (speed > 0) {
+                auto offset = std::chrono::nanoseconds(
+                    static_cast<int64_t>(static_cast<double>(e.TimeNs - firstNs) / speed));
+                // Em fatias, para o cancelamento não esperar uma pausa longa da gravação
+                auto due = start + offset;
+                while (std::chrono::steady_clock::now() < due) {
+                    if (cancel && cancel->load(std::memory_order_relaxed)) return delivered;
+                    std::this_thread::sleep_until(std::min(due, std::chrono::steady_clock::now() + std::chrono::milliseconds(100)));
+                }
+            }
+            // O tópico reaproveita o buffer do segmento; o payload é copiado
+            // porque a mensagem pode sobreviver ao mapeamento (workers)
+            sink(makePooledMessage(e.Topic, e.Payload));
+            ++delivered;
+            advance(*next);
+        }
+        return delivered;
+    }
+
+private:
+    struct Cursor {
+        const std::vector<std::string>* Files = nullptr;
+        size_t NextFile = 0;
+        std::unique_ptr<CaptureSegment> Segment;
+        CaptureSegment::Entry Current;
+        bool Valid = false;
+    };
+
+    static void advance(Cursor& c) {
+        for (;;) {
+            if (c.Segment && c.Segment->next(c.Current)) {
+                c.Valid = true;
+                return;
+            }
+            if (c.NextFile >= c.Files->size()) {
+                c.Segment.reset();
+                c.Valid = false;
+                return;
+            }
+            c.Segment.reset(new CaptureSegment((*c.Files)[c.NextFile++]));
+        }
+    }
+
+    std::vector<std::vector<std::string>> sources_;
+};
+
+/* -----------------------------------------------------------------------
+   Spool em disco para as quedas da conexão.
+   Sem conexão com o broker, o publicador grava as mensagens de saída num
+   anel de tamanho fixo num arquivo mapeado em memória, em vez de
+   acumulá-las no processo: a memória fica estável numa queda longa e,
+   com o anel cheio, saem as mais antigas (spool_dropped). Quando a
+   conexão volta, o anel é esvaziado em lotes, num ritmo limitado e ao
+   lado do tráfego ao vivo, sem uma rajada na reconexão. O arquivo
+   sobrevive a um reinício do processo: o que sobrou sai na conexão
+   seguinte (não a uma queda de energia: não há msync por mensagem).
+
+   Formato (ordem de bytes do host; o arquivo não sai da máquina):
+     cabeçalho (64 bytes): "CBSPOOL" 0x01 | u64 capacidade | u64 início |
+                           u64 fim | u64 mensagens
+     registro (alinhado a 8): u32 tamanho | u16 tópico | u8 content type |
+                           u8 flags | i64 expira (µs unix, 0 = nunca) |
+                           tópico | content type | payload
+   Início e fim são posições lógicas crescentes (a física é o resto pela
+   capacidade). Um registro que não cabe até o fim do anel recomeça no
+   zero, depois de um marcador de volta (ou sem ele, se nem o cabeçalho
+   do registro couber).
+   -----------------------------------------------------------------------*/
+constexpr char     SPOOL_MAGIC[8] = {'C', 'B', 'S', 'P', 'O', 'O', 'L', 1};
+constexpr size_t   SPOOL_HEADER = 64;
+constexpr size_t   SPOOL_RECORD_HEADER = 16;
+constexpr uint32_t SPOOL_WRAP = 0xFFFFFFFFu;
+constexpr size_t   SPOOL_MIN_BYTES = size_t(64) << 10;
+
+constexpr uint8_t SPOOL_QOS_MASK = 0x03;
+constexpr uint8_t SPOOL_RETAINED = 0x04;
+constexpr uint8_t SPOOL_UTF8     = 0x08;
+constexpr uint8_t SPOOL_HIGH     = 0x10;   // fila de alta prioridade
+
+struct SpoolOptions {
+    std::string Path;                       // vazio = sem spool
+    size_t Bytes = size_t(64) << 20;        // tamanho do anel
+    double DrainRate = 1000;                // mensagens/s ao esvaziar
+    size_t DrainBatch = 64;                 // rajada máxima de um lote
+
+    bool enabled() const { return !Path.empty(); }
+};
+
+// Uma mensagem do spool; os views valem só durante a chamada
+struct SpoolEntry {
+    std::string_view Topic;
+    std::string_view ContentType;
+    std::string_view Payload;
+    int Qos = 0;
+    bool Retained = false;
+    bool Utf8 = false;
+    PriorityLane Lane = PriorityLane::Normal;
+    int64_t ExpiresAtUs = 0;   // 0 = não expira
+};
+
+inline int64_t unixMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+class DiskSpool {
+public:
+    // Abre o anel de path ou cria um novo com bytes de capacidade. O
+    // espaço é reservado em disco já aqui (um mapeamento sem espaço
+    // daria SIGBUS na escrita). Lança std::runtime_error.
+    DiskSpool(const std::string& path, size_t bytes)
+        : path_(path), capacity_(std::max(SPOOL_MIN_BYTES, bytes) & ~size_t(7))
+    {
+        size_t size = SPOOL_HEADER + capacity_;
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) throw std::runtime_error("spool: não foi possível abrir " + path + ": " + std::strerror(errno));
+        struct stat st;
+        if (::fstat(fd, &st) != 0) st.st_size = 0;
+        bool sameSize = static_cast<size_t>(st.st_size) == size;
+        // Cabeçalho de uma execução anterior, lido antes de redimensionar
+        Header previous{};
+        bool hadSpool = static_cast<size_t>(st.st_size) >= SPOOL_HEADER &&
+                        ::pread(fd, &previous, sizeof(previous), 0) == static_cast<ssize_t>(sizeof(previous)) &&
+                        std::memcmp(previous.Magic, SPOOL_MAGIC, sizeof(SPOOL_MAGIC)) == 0;
+        int rc = sameSize ? 0 : ::ftruncate(fd, static_cast<off_t>(size));
+        if (rc == 0) rc = ::posix_fallocate(fd, 0, static_cast<off_t>(size));
+        if (rc != 0) {
+            ::close(fd);
+            throw std::runtime_error("spool: sem espaço para " + std::to_string(size) + " bytes em " + path);
+        }
+        void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("spool: mmap falhou em " + path);
+        map_ = static_cast<uint8_t*>(p);
+        data_ = map_ + SPOOL_HEADER;
+
+        Header &h = header();
+        if (!sameSize || std::memcmp(h.Magic, SPOOL_MAGIC, sizeof(SPOOL_MAGIC)) != 0 ||
+            h.Capacity != capacity_ || h.Head > h.Tail || h.Tail - h.Head > capacity_) {
+            if (hadSpool) {
+                LOG_WARN("Spool " << path_ << " de outro tamanho ou inválido; " << previous.Count
+                         << " mensagem(ns) da execução anterior descartada(s), recomeçando vazio.");
+                if (previous.Count > 0) metrics().count(Counter::SpoolDropped, previous.Count);
+            }
+            std::memset(&h, 0, sizeof(h));
+            std::memcpy(h.Magic, SPOOL_MAGIC, sizeof(SPOOL_MAGIC));
+            h.Capacity = capacity_;
+        } else if (h.Count > 0) {
+            LOG_INFO("Spool " << path_ << ": " << h.Count << " mensagem(ns) de uma execução anterior.");
+        }
+    }
+
+    ~DiskSpool() {
+        ::msync(map_, SPOOL_HEADER + capacity_, MS_SYNC);
+        ::munmap(map_, SPOOL_HEADER + capacity_);
+    }
+
+    DiskSpool(const DiskSpool&) = delete;
+    DiskSpool& operator=(const DiskSpool&) = delete;
+
+    // Grava no fim do anel, tirando as mais antigas se faltar espaço.
+    // false = não cabe nem no anel vazio.
+    bool append(const SpoolEntry& e) {
+        size_t body = e.Topic.size() + e.ContentType.size() + e.Payload.size();
+        size_t need = (SPOOL_RECORD_HEADER + body + 7) & ~size_t(7);
+        if (need > capacity_ || e.Topic.size() > UINT16_MAX || e.ContentType.size() > UINT8_MAX) return false;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        Header &h = header();
+        size_t pos = 0, pad = 0;
+        for (;;) {
+            if (h.Count == 0) h.Head = h.Tail = 0;
+            pos = static_cast<size_t>(h.Tail % capacity_);
+            pad = capacity_ - pos < need ? capacity_ - pos : 0;
+            if (capacity_ - (h.Tail - h.Head) >= pad + need) break;
+            dropOldest(h);
+        }
+        if (pad > 0) {
+            if (pad >= SPOOL_RECORD_HEADER) std::memcpy(data_ + pos, &SPOOL_WRAP, sizeof(SPOOL_WRAP));
+            h.Tail += pad;
+            pos = 0;
+        }
+
+        uint8_t* p = data_ + pos;
+        uint32_t size = static_cast<uint32_t>(body);
+        uint16_t topicLen = static_cast<uint16_t>(e.Topic.size());
+        uint8_t typeLen = static_cast<uint8_t>(e.ContentType.size());
+        uint8_t flags = static_cast<uint8_t>((e.Qos & SPOOL_QOS_MASK) | (e.Retained ? SPOOL_RETAINED : 0) |
+                                             (e.Utf8 ? SPOOL_UTF8 : 0) |
+                                             (e.Lane == PriorityLane::High ? SPOOL_HIGH : 0));
+        std::memcpy(p, &size, 4);
+        std::memcpy(p + 4, &topicLen, 2);
+        p[6] = typeLen;
+        p[7] = flags;
+        std::memcpy(p + 8, &e.ExpiresAtUs, 8);
+        p += SPOOL_RECORD_HEADER;
+        for (std::string_view part : {e.Topic, e.ContentType, e.Payload}) {
+            if (part.empty()) continue;   // data() pode ser nulo
+            std::memcpy(p, part.data(), part.size());
+            p += part.size();
+        }
+        h.Tail += need;
+        ++h.Count;
+        return true;
+    }
+
+    // Entrega a mais antiga a use (views dentro do mapeamento, sob o
+    // lock) e a retira. false = vazio. Um registro inconsistente esvazia
+    // o anel com um aviso.
+    template <typename Fn>
+    bool pop(Fn&& use) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Header &h = header();
+        if (h.Count == 0) return false;
+        size_t pos = skipWrap(h);
+        const uint8_t* p = data_ + pos;
+        uint32_t size;
+        uint16_t topicLen;
+        std::memcpy(&size, p, 4);
+        std::memcpy(&topicLen, p + 4, 2);
+        uint8_t typeLen = p[6];
+        uint8_t flags = p[7];
+        if (size > capacity_ - pos - SPOOL_RECORD_HEADER || size_t(topicLen) + typeLen > size) {
+            LOG_ERROR("Spool " << path_ << " corrompido na posição " << h.Head << "; "
+                      << h.Count << " mensagem(ns) descartada(s).");
+            metrics().count(Counter::SpoolDropped, h.Count);
+            h.Head = h.Tail = h.Count = 0;
+            return false;
+        }
+        SpoolEntry e;
+        std::memcpy(&e.ExpiresAtUs, p + 8, 8);
+        const char* body = reinterpret_cast<const char*>(p + SPOOL_RECORD_HEADER);
+        e.Topic = std::string_view(body, topicLen);
+        e.ContentType = std::string_view(body + topicLen, typeLen);
+        e.Payload = std::string_view(body + topicLen + typeLen, size - topicLen - typeLen);
+        e.Qos = flags & SPOOL_QOS_MASK;
+        e.Retained = (flags & SPOOL_RETAINED) != 0;
+        e.Utf8 = (flags & SPOOL_UTF8) != 0;
+        e.Lane = (flags & SPOOL_HIGH) ? PriorityLane::High : PriorityLane::Normal;
+        use(static_cast<const SpoolEntry&>(e));
+        h.Head += (SPOOL_RECORD_HEADER + size + 7) & ~size_t(7);
+        if (--h.Count == 0) warnedFull_ = false;
+        return true;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return static_cast<size_t>(header().Count);
+    }
+
+    bool empty() const { return size() == 0; }
+    const std::string& path() const { return path_; }
+
+private:
+    struct Header {
+        char     Magic[8];
+        uint64_t Capacity;
+        uint64_t Head;
+        uint64_t Tail;
+        uint64_t Count;
+        uint64_t Reserved[3];
+    };
+    static_assert(sizeof(Header) == SPOOL_HEADER, "cabeçalho do spool");
+
+    Header& header() const { return *reinterpret_cast<Header*>(map_); }
+
+    // Posição física do registro no início, pulando a volta do anel
+    size_t skipWrap(Header& h) {
+        size_t pos = static_cast<size_t>(h.Head % capacity_);
+        uint32_t size = 0;
+        if (capacity_ - pos >= SPOOL_RECORD_HEADER) std::memcpy(&size, data_ + pos, 4);
+        if (capacity_ - pos < SPOOL_RECORD_HEADER || size == SPOOL_WRAP) {
+            h.Head += capacity_ - pos;
+            pos = 0;
+        }
+        return pos;
+    }
+
+    void dropOldest(Header& h) {
+        size_t pos = skipWrap(h);
+        uint32_t size;
+        std::memcpy(&size, data_ + pos, 4);
+        h.Head += (SPOOL_RECORD_HEADER + std::min<size_t>(size, capacity_ - pos - SPOOL_RECORD_HEADER) + 7) & ~size_t(7);
+        --h.Count;
+        if (h.Head > h.Tail) h.Head = h.Tail = h.Count = 0;   // tamanho inconsistente
+        metrics().count(Counter::SpoolDropped);
+        if (!warnedFull_) {
+            LOG_WARN("Spool " << path_ << " cheio; descartando as mensagens mais antigas.");
+            warnedFull_ = true;
+        }
+    }
+
+    std::string path_;
+    size_t capacity_;
+    uint8_t* map_ = nullptr;
+    uint8_t* data_ = nullptr;
+    mutable std::mutex mutex_;
+    bool warnedFull_ = false;   // um aviso até o anel esvaziar
+};
+
+/* -----------------------------------------------------------------------
+   Fusão por veículo (opcional).
+   Os consumidores assinavam os quatro tópicos de sensor e juntavam as
+   leituras de novo. Com a fusão ligada, o pipeline guarda a última
+   leitura de cada decoder por veículo e publica, a cada intervalo, um
+   snapshot com todos os sensores num só payload, mais estatísticas da
+   janela: distância mínima e velocidade de aproximação (unidades de
+   distância por segundo, positiva quando o objeto se aproxima).
+   O veículo é o primeiro curinga capturado pela rota (ex.:
+   "veiculos/+/can/bin"); sem curinga, tudo é um veículo só ("").
+   Por veículo, um vetor contíguo indexado pelo slot da DecoderTable; a
+   janela é um anel fixo e o mínimo sai de um deque monotônico, O(1)
+   amortizado por amostra. Só leituras com status ativo entram na janela.
+   -----------------------------------------------------------------------*/
+struct FusionOptions {
+    std::chrono::milliseconds Interval{0};     // 0 = desligado
+    std::chrono::milliseconds Window{1000};    // janela das estatísticas
+    std::string Topic = "simsensor/fused";     // + "/<veículo>" quando houver
+    bool Only = false;                          // só o snapshot, sem as leituras por sensor
+
+    bool enabled() const { return Interval.count() > 0; }
+};
+
+constexpr size_t FUSION_WINDOW_SAMPLES = 64;     // amostras por sensor (as mais antigas saem antes)
+constexpr size_t FUSION_MAX_VEHICLES   = 4096;   // um curinga aberto não cresce sem limite
+
+class FusionWindow {
+public:
+    void add(int64_t ns, double distance, int64_t windowNs) {
+        expire(ns, windowNs);
+        if (count_ == FUSION_WINDOW_SAMPLES) dropOldest();
+        Sample s{ns, distance, nextSeq_++};
+        samples_[(head_ + count_++) % FUSION_WINDOW_SAMPLES] = s;
+        // Deque do mínimo: quem não for menor que a nova amostra nunca mais será o mínimo
+        while (minCount_ > 0 && minAt(minCount_ - 1).Distance >= distance) --minCount_;
+        mins_[(minHead_ + minCount_++) % FUSION_WINDOW_SAMPLES] = s;
+    }
+
+    void expire(int64_t nowNs, int64_t windowNs) {
+        while (count_ > 0 && nowNs - samples_[head_].Ns > windowNs) dropOldest();
+    }
+
+    size_t size() const { return count_; }
+    double min() const { return minAt(0).Distance; }   // só com size() > 0
+
+    // Variação da mais antiga para a mais recente, por segundo
+    double closingRate() const {
+        if (count_ < 2) return 0;
+        const Sample &first = samples_[head_];
+        const Sample &last = samples_[(head_ + count_ - 1) % FUSION_WINDOW_SAMPLES];
+        if (last.Ns <= first.Ns) return 0;
+        return (first.Distance - last.Distance) * 1e9 / static_cast<double>(last.Ns - first.Ns);
+    }
+
+private:
+    struct Sample {
+        int64_t  Ns;
+        double   Distance;
+        uint64_t Seq;
+    };
+
+    const Sample& minAt(size_t i) const { return mins_[(minHead_ + i) % FUSION_WINDOW_SAMPLES]; }
+
+    void dropOldest() {
+        if (minCount_ > 0 && minAt(0).Seq == samples_[head_].Seq) {
+            minHead_ = (minHead_ + 1) % FUSION_WINDOW_SAMPLES;
+            --minCount_;
+        }
+        head_ = (head_ + 1) % FUSION_WINDOW_SAMPLES;
+        --count_;
+    }
+
+    Sample samples_[FUSION_WINDOW_SAMPLES];
+    Sample mins_[FUSION_WINDOW_SAMPLES];
+    size_t head_ = 0, count_ = 0;
+    size_t minHead_ = 0, minCount_ = 0;
+    uint64_t nextSeq_ = 0;
+};
+
+class FusionTable {
+public:
+    FusionTable(const DecoderTable& decoders, const FusionOptions& opts)
+        : decoders_(decoders), opts_(opts),
+          windowNs_(std::chrono::duration_cast<std::chrono::nanoseconds>(opts.Window).count()) {}
+
+    // Registra a leitura no veículo. IDs sem decoder não entram.
+    void update(std::string_view vehicle, const CanDecoder& decoder, std::string_view algorithm,
+                const SensorReading& reading, int64_t nowNs) {
+        uint16_t slot = decoders_.slotOf(decoder.ArbitrationId);
+        if (slot == DecoderTable::NO_SLOT) return;
+        Vehicle* v = findOrAdd(vehicle);
+        if (!v) return;
+
+        std::lock_guard<std::mutex> lock(v->Mutex);
+        Sensor &s = v->Sensors[slot];
+        s.Decoder = &decoder;
+        s.AlgorithmID.assign(algorithm);
+        s.Reading = reading;
+        s.LastNs = nowNs;
+        if (reading.Status) s.Window.add(nowNs, reading.Distance, windowNs_);
+        v->Dirty = true;
+    }
+
+    // Chama publish(tópico, payload) para cada veículo com leitura nova
+    // desde a chamada anterior. O payload só vale durante a chamada.
+    // publish() roda sem nenhuma trava da tabela: com a fila do publicador
+    // cheia, os workers seguem atualizando e um veículo novo ainda entra.
+    template <typename Publish>
+    void collect(int64_t nowNs, Publish publish) {
+        // Os veículos nunca saem da tabela: basta copiar os ponteiros
+        thread_local std::vector<Vehicle*> pending;
+        pending.clear();
+        {
+            std::shared_lock<std::shared_mutex> lock(vehiclesMutex_);
+            for (const auto &v : vehicles_) pending.push_back(v.get());
+        }
+        JsonWriter &w = threadJsonWriter();
+        for (Vehicle* v : pending) {
+            {
+                std::lock_guard<std::mutex> vehicleLock(v->Mutex);
+                if (!v->Dirty) continue;
+                v->Dirty = false;
+                writeSnapshot(w, *v, nowNs);
+            }
+            publish(v->Topic, w.view());
+        }
+    }
+
+    size_t vehicles() const {
+        std::shared_lock<std::shared_mutex> lock(vehiclesMutex_);
+        return vehicles_.size();
+    }
+
+private:
+    struct Sensor {
+        const CanDecoder* Decoder = nullptr;   // nulo = nunca recebido
+        InlineString<CAN_MAX_ALGORITHM_ID_LEN + 1> AlgorithmID{};
+        SensorReading     Reading{};
+        int64_t           LastNs = 0;
+        FusionWindow      Window;
+    };
+
+    struct Vehicle {
+        std::string Name;
+        mqtt::string_ref Topic;
+        std::mutex Mutex;
+        bool Dirty = false;
+        std::vector<Sensor> Sensors;
+    };
+
+    Vehicle* findOrAdd(std::string_view name) {
+        {
+            std::shared_lock<std::shared_mutex> lock(vehiclesMutex_);
+            auto it = index_.find(name);
+            if (it != index_.end()) return it->second;
+        }
+        std::unique_lock<std::shared_mutex> lock(vehiclesMutex_);
+        auto it = index_.find(name);
+        if (it != index_.end()) return it->second;
+        if (vehicles_.size() >= FUSION_MAX_VEHICLES) {
+            metrics().count(Counter::FusionDropped);
+            return nullptr;
+        }
+        std::unique_ptr<Vehicle> v(new Vehicle());
+        v->Name.assign(name.data(), name.size());
+        v->Topic = mqtt::string_ref(name.empty() ? opts_.Topic : opts_.Topic + "/" + v->Name);
+        v->Sensors.resize(decoders_.size());
+        Vehicle* raw = v.get();
+        vehicles_.push_back(std::move(v));
+        index_.emplace(std::string_view(raw->Name), raw);   // a chave aponta para o nome do próprio veículo
+        return raw;
+    }
+
+    // {"Vehicle":"...","Timestamp":"...","Sensors":[{...}, ...]}
+    void writeSnapshot(JsonWriter& w, Vehicle& v, int64_t nowNs) {
+        InlineString<32> timestamp;
+        timestampService().format(0, timestamp);
+
+        w.clear();
+        w.raw('{');
+        if (!v.Name.empty()) {
+            w.key("Vehicle");
+            w.string(v.Name);
+            w.raw(',');
+        }
+        w.key("Timestamp");
+        w.string(timestamp.view());
+        w.raw(',');
+        w.key("Sensors");
+        w.raw('[');
+        bool first = true;
+        for (auto &s : v.Sensors) {
+            if (!s.Decoder) continue;
+            s.Window.expire(nowNs, windowNs_);
+            if (!first) w.raw(',');
+            first = false;
+
+            w.raw('{');
+            w.key("ArbitrationId");
+            w.integer(s.Decoder->ArbitrationId);
+            if (s.Decoder->Topic) {
+                w.raw(',');
+                w.key("Topic");
+                w.string(s.Decoder->Topic);
+            }
+            w.raw(',');
+            w.key("AlgorithmID");
+            w.string(s.AlgorithmID.empty() ? std::string_view("Unknown") : s.AlgorithmID.view());
+            w.raw(',');
+            w.key("Status");
+            w.boolean(s.Reading.Status);
+            w.raw(',');
+            w.key("DistanceToVehicle");
+            w.number(s.Reading.Distance);
+            if (s.Reading.Side) {
+                w.raw(',');
+                w.key("Side");
+                w.string(s.Reading.Side);
+            }
+            w.raw(',');
+            w.key("AgeMs");
+            w.integer((nowNs - s.LastNs) / 1000000);
+            w.raw(',');
+            w.key("Window");
+            w.raw('{');
+            w.key("Samples");
+            w.integer(static_cast<long long>(s.Window.size()));
+            if (s.Window.size() > 0) {
+                w.raw(',');
+                w.key("MinDistance");
+                w.number(s.Window.min());
+                w.raw(',');
+                w.key("ClosingRate");
+                w.number(s.Window.closingRate());
+            }
+            w.raw('}');
+            w.raw('}');
+        }
+        w.raw(']');
+        w.raw('}');
+    }
+
+    const DecoderTable &decoders_;
+    FusionOptions opts_;
+    int64_t windowNs_;
+
+    mutable std::shared_mutex vehiclesMutex_;
+    std::vector<std::unique_ptr<Vehicle>> vehicles_;
+    std::unordered_map<std::string_view, Vehicle*> index_;
+};
+
+/* -----------------------------------------------------------------------
+   Rotas e decoders em uso por um pipeline.
+   Ficam num snapshot imutável que uma recarga (SIGHUP) troca por inteiro,
+   sem parar o fluxo: cada mensagem leva o snapshot com que foi roteada
+   até terminar de ser processada (o RouteMatch aponta para dentro dele),
+   e o antigo é liberado quando a última mensagem dele sai do pipeline.
+   -----------------------------------------------------------------------*/
+struct RoutingTables {
+    std::shared_ptr<const RouteTable>   Routes;
+    std::shared_ptr<const DecoderTable> Decoders;
+    std::shared_ptr<FusionTable>        Fusion;   // sobre estes decoders; compartilhada pelos shards (nulo = cada pipeline cria a sua, se ligada)
+    std::shared_ptr<ChangeFilter>       Changes;  // idem para o dedup
+};
+
+// Tabelas de vida mais longa que o pipeline (ex.: as padrão, estáticas)
+inline RoutingTables borrowTables(const RouteTable& routes, const DecoderTable& decoders) {
+    return RoutingTables{std::shared_ptr<const RouteTable>(&routes, [](const RouteTable*) {}),
+                         std::shared_ptr<const DecoderTable>(&decoders, [](const DecoderTable*) {}),
+                         nullptr, nullptr};
+}
+
+struct RoutingSnapshot {
+    RoutingTables Tables;
+
+    const RouteTable& routes() const { return *Tables.Routes; }
+    const DecoderTable& decoders() const { return *Tables.Decoders; }
+    FusionTable* fusion() const { return Tables.Fusion.get(); }     // nulo = fusão desligada
+    ChangeFilter* changes() const { return Tables.Changes.get(); }  // nulo = dedup desligado
+};
+
+/* -----------------------------------------------------------------------
+   Afinidade de CPU dos estágios (Linux).
+   Cada estágio pode ficar preso a uma lista de CPUs: o I/O do Paho, os
+   workers (um núcleo por worker, em rodízio na lista), o publicador e os
+   threads de fundo (log, captura, métricas, laço de eventos). Sem
+   migrações do escalonador, os alertas não pagam a troca de núcleo nem
+   o cache frio.
+   A memória segue pela política de primeiro toque do kernel: as filas
+   de cada estágio são alocadas (e zeradas) com o thread já preso às
+   CPUs do estágio, então as páginas ficam no nó NUMA delas.
+   -----------------------------------------------------------------------*/
+class CpuSet {
+public:
+    CpuSet() { CPU_ZERO(&mask_); }
+
+    // Lista no formato do kernel: "0-3,6,8-9"
+    static bool parse(std::string_view list, CpuSet& out) {
+        CpuSet set;
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            std::string_view item = list.substr(0, comma);
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            size_t dash = item.find('-');
+            size_t first = 0, last = 0;
+            if (!parseCpu(item.substr(0, dash), first)) return false;
+            last = first;
+            if (dash != std::string_view::npos && !parseCpu(item.substr(dash + 1), last)) return false;
+            if (last < first) return false;
+            for (size_t cpu = first; cpu <= last; ++cpu) set.add(cpu);
+            if (comma != std::string_view::npos && list.empty()) return false;   // vírgula no fim
+        }
+        if (set.empty()) return false;
+        out = set;
+        return true;
+    }
+
+    // CPUs permitidas ao thread atual
+    static CpuSet current() {
+        CpuSet set;
+        if (::pthread_getaffinity_np(::pthread_self(), sizeof(cpu_set_t), &set.mask_) != 0) CPU_ZERO(&set.mask_);
+        return set;
+    }
+
+    void add(size_t cpu) { CPU_SET(cpu, &mask_); }
+    bool contains(size_t cpu) const { return cpu < CPU_SETSIZE && CPU_ISSET(cpu, &mask_); }
+    bool empty() const { return count() == 0; }
+    size_t count() const { return static_cast<size_t>(CPU_COUNT(&mask_)); }
+
+    bool subsetOf(const CpuSet& other) const {
+        for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (contains(cpu) && !other.contains(cpu)) return false;
+        }
+        return true;
+    }
+
+    // Só a i-ésima CPU do conjunto (em rodízio); vazio continua vazio
+    CpuSet nth(size_t i) const {
+        CpuSet one;
+        size_t n = count();
+        if (n == 0) return one;
+        i %= n;
+        for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (contains(cpu) && i-- == 0) {
+                one.add(cpu);
+                break;
+            }
+        }
+        return one;
+    }
+
+    std::string str() const {
+        std::string out;
+        for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (!contains(cpu)) continue;
+            size_t last = cpu;
+            while (contains(last + 1)) ++last;
+            if (!out.empty()) out += ',';
+            out += std::to_string(cpu);
+            if (last > cpu) out += "-" + std::to_string(last);
+            cpu = last;
+        }
+        return out;
+    }
+
+    const cpu_set_t& native() const { return mask_; }
+
+private:
+    static bool parseCpu(std::string_view text, size_t& cpu) {
+        auto res = std::from_chars(text.data(), text.data() + text.size(), cpu);
+        return !text.empty() && res.ec == std::errc() && res.ptr == text.data() + text.size() && cpu < CPU_SETSIZE;
+    }
+
+    cpu_set_t mask_;
+};
+
+// Prende o thread atual às CPUs; vazio não muda nada
+inline bool pinCurrentThread(const CpuSet& cpus) {
+    if (cpus.empty()) return true;
+    return ::pthread_setaffinity_np(::pthread_self(), sizeof(cpu_set_t), &cpus.native()) == 0;
+}
+
+// Prende o thread atual enquanto existir e depois volta à máscara de
+// antes. Os threads criados nesse meio herdam a máscara, e a memória
+// tocada aqui fica no nó dessas CPUs.
+class ScopedThreadAffinity {
+public:
+    explicit ScopedThreadAffinity(const CpuSet& cpus) {
+        if (cpus.empty()) return;
+        saved_ = CpuSet::current();
+        active_ = pinCurrentThread(cpus);
+    }
+
+    ~ScopedThreadAffinity() {
+        if (active_) pinCurrentThread(saved_);
+    }
+
+    ScopedThreadAffinity(const ScopedThreadAffinity&) = delete;
+    ScopedThreadAffinity& operator=(const ScopedThreadAffinity&) = delete;
+
+private:
+    CpuSet saved_;
+    bool active_ = false;
+};
+
+// Listas vazias = sem afinidade própria (herda a de quem cria o thread)
+struct AffinityOptions {
+    CpuSet Io;           // thread do Paho (e o do replay, que faz o papel dele)
+    CpuSet Workers;      // um núcleo por worker, em rodízio
+    CpuSet Publisher;
+    CpuSet Background;   // log, captura, métricas e laço de eventos (o thread principal)
+    CpuSet Fallback;     // estágios sem lista quando Background está definido: a máscara da partida
+    size_t WorkerOffset = 0;   // início do rodízio (shards não dividem o mesmo núcleo)
+
+    bool enabled() const {
+        return !Io.empty() || !Workers.empty() || !Publisher.empty() || !Background.empty();
+    }
+
+    CpuSet io() const { return Io.empty() ? Fallback : Io; }
+    CpuSet publisher() const { return Publisher.empty() ? Fallback : Publisher; }
+    CpuSet worker(size_t i) const { return Workers.empty() ? Fallback : Workers.nth(WorkerOffset + i); }
+};
+
+/* -----------------------------------------------------------------------
+   Pool de workers: o callback do Paho apenas enfileira a mensagem e os
+   workers fazem o parse, a conversão e a publicação.
+   Cada worker tem sua própria fila; a chave (ArbitrationId ou tópico)
+   escolhe sempre o mesmo worker, mantendo a ordem por chave.
+   A rota é resolvida uma única vez, no callback, e segue junto com a
+   mensagem (as capturas apontam para o tópico dela).
+   -----------------------------------------------------------------------*/
+struct InboundMessage {
+    mqtt::const_message_ptr Msg;
+    RouteMatch              Match;
+    int64_t                 ArrivalNs = 0;   // monotonicNanos() na chegada
+    PriorityLane            Lane = PriorityLane::Normal;
+    std::shared_ptr<const RoutingSnapshot> Routing;   // rotas com que Match foi resolvido
+};
+
+struct PublisherOptions {
+    size_t QueueCapacity = 8192;
+    size_t MaxInFlight = 256;        // janela de publicações QoS1 sem confirmação
+    size_t AggregateReadings = 0;    // 0 = uma mensagem por leitura
+    std::chrono::milliseconds AggregateInterval{100};
+    std::vector<RateLimit> TopicLimits;   // por filtro do tópico de saída
+    RateLimit GlobalLimit;                // RatePerSec 0 = sem limite global
+    bool AdaptiveQos = false;             // padrão de "adaptive_qos" para quem não define
+    double AdaptiveQueueFill = 0.5;       // contrapressão: fila normal acima desta fração
+    bool Mqtt5 = false;                   // conexão em v5: propriedades e aliases de tópico
+    uint16_t TopicAliases = 32;           // aliases pedidos (o broker pode aceitar menos); 0 = não usa
+    bool PayloadFormat = true;            // declara content type e formato UTF-8 dos payloads JSON
+    SpoolOptions Spool;                   // spool em disco para as quedas da conexão
+
+    bool rateLimited() const { return !TopicLimits.empty() || GlobalLimit.RatePerSec > 0; }
+};
+
+// Entradas inválidas: uma a cada SampleEvery (por thread) vai para o log
+// e, com prefixo, para Prefix + tópico de origem com o motivo
+struct DeadLetterOptions {
+    std::string Prefix = "dead-letter/";   // vazio = só o log
+    uint32_t SampleEvery = 100;            // 1 = todas
+};
+
+struct PipelineOptions {
+    // 0 => processa inline no thread de callback (comportamento antigo)
+    size_t Workers = std::max(1u, std::thread::hardware_concurrency());
+    size_t QueueCapacity = 1024;
+    PublisherOptions Publisher;
+    MetricsOptions Metrics;
+    DedupOptions Dedup;
+    CaptureOptions Capture;
+    FusionOptions Fusion;
+    AffinityOptions Affinity;
+    DeadLetterOptions DeadLetter;
+};
+
+class WorkerPool {
+public:
+    using Handler = std::function<void(const InboundMessage&)>;
+
+    // As filas e o thread de cada worker nascem já nas CPUs dele
+    WorkerPool(size_t workers, size_t queueCapacity, Handler handler,
+               const AffinityOptions& affinity = AffinityOptions())
+        : handler_(std::move(handler))
+    {
+        for (size_t i = 0; i < workers; ++i) {
+            ScopedThreadAffinity placement(affinity.worker(i));
+            workers_.emplace_back(new Worker(queueCapacity));
+        }
+        for (size_t i = 0; i < workers; ++i) {
+            ScopedThreadAffinity placement(affinity.worker(i));
+            Worker* worker = workers_[i].get();
+            worker->thread = std::thread([this, worker] { run(*worker); });
+        }
+    }
+
+    ~WorkerPool() { stop(); }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Enfileira no worker da chave, na fila de prioridade da mensagem. Se a
+    // fila estiver cheia, segura o thread chamador (contrapressão) em vez de
+    // descartar a mensagem. A ordem por chave se mantém porque cada chave
+    // (arbitration id) pertence sempre à mesma fila. Com o pool parado, a
+    // mensagem que não cabe é contada como stop_dropped.
+    void submit(uint32_t key, InboundMessage msg) {
+        Worker& w = *workers_[key % workers_.size()];
+        auto &queue = w.queues[static_cast<size_t>(msg.Lane)];
+        while (!queue.try_push(std::move(msg))) {
+            if (!running_.load(std::memory_order_relaxed)) {
+                metrics().count(Counter::StopDropped);
+                return;
+            }
+            std::this_thread::yield();
+        }
+        w.waiter.notify();
+    }
+
+    // Para os workers depois de esvaziar as filas. Passado o prazo
+    // (monotonicNanos), o que sobrou nas filas só é contado.
+    void stop(int64_t deadlineNs = std::numeric_limits<int64_t>::max()) {
+        stopByNs_.store(deadlineNs, std::memory_order_relaxed);
+        if (!running_.exchange(false)) return;
+        for (auto &w : workers_) {
+            w->waiter.wakeAll();
+            if (w->thread.joinable()) w->thread.join();
+        }
+    }
+
+    size_t size() const { return workers_.size(); }
+
+    // Mensagens esperando em todas as filas (aproximado)
+    size_t backlog() const {
+        size_t total = 0;
+        for (const auto &w : workers_) total += w->pending();
+        return total;
+    }
+
+private:
+    struct Worker {
+        // A fila de alta prioridade só recebe os poucos ids de segurança,
+        // então basta uma fração da capacidade.
+        explicit Worker(size_t capacity)
+            : queues{BoundedMpmcQueue<InboundMessage>(capacity),
+                     BoundedMpmcQueue<InboundMessage>(std::max<size_t>(64, capacity / 4))} {}
+
+        // Alta prioridade primeiro; a normal só quando a outra está vazia
+        bool pop(InboundMessage& msg) {
+            for (size_t l = PRIORITY_LANES; l-- > 0; ) {
+                if (queues[l].try_pop(msg)) return true;
+            }
+            return false;
+        }
+
+        size_t pending() const {
+            size_t total = 0;
+            for (const auto &q : queues) total += q.size_approx();
+            return total;
+        }
+
+        BoundedMpmcQueue<InboundMessage> queues[PRIORITY_LANES];
+        std::thread thread;
+        IdleWaiter waiter;
+    };
+
+    void run(Worker& w) {
+        InboundMessage msg;
+        unsigned idleSpins = 0;
+        for (;;) {
+            if (!running_.load(std::memory_order_acquire)) {
+                // Esvazia o que sobrou antes de sair, até o prazo
+                while (monotonicNanos() < stopByNs_.load(std::memory_order_relaxed) && w.pop(msg)) handler_(msg);
+                uint64_t dropped = 0;
+                while (w.pop(msg)) ++dropped;
+                if (dropped > 0) metrics().count(Counter::StopDropped, dropped);
+                return;
+            }
+            if (w.pop(msg)) {
+                idleSpins = 0;
+                handler_(msg);
+                msg.Msg.reset();
+                msg.Routing.reset();   // não segura rotas antigas numa fila parada
+                continue;
+            }
+            if (++idleSpins < 64) {
+                std::this_thread::yield();
+                continue;
+            }
+            // Fila vazia há algum tempo: dorme até o produtor avisar.
+            w.waiter.wait([&] {
+                return w.pending() == 0 && running_.load(std::memory_order_relaxed);
+            }, std::chrono::milliseconds(100));
+            idleSpins = 0;
+        }
+    }
+
+    Handler handler_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<bool> running_{true};
+    std::atomic<int64_t> stopByNs_{std::numeric_limits<int64_t>::max()};
+};
+
+/* -----------------------------------------------------------------------
+   Aliases de tópico do MQTT 5, por conexão. O broker diz no CONNACK
+   quantos aceita. Um tópico ganha alias na segunda publicação, enquanto
+   houver número livre: essa ainda leva o tópico junto com o alias, e as
+   seguintes só o número. Os tópicos de saída são poucos (decoders e
+   alvos das rotas); com a tabela cheia, os novos seguem por extenso.
+   Só o thread de publicação mexe na tabela, na ordem de envio.
+   -----------------------------------------------------------------------*/
+constexpr uint32_t TOPIC_ALIAS_MIN_USES = 2;
+constexpr size_t TOPIC_ALIAS_CANDIDATES = 1024;   // contagens guardadas de tópicos ainda sem alias
+
+class TopicAliasTable {
+public:
+    void reset(uint16_t maximum) {
+        maximum_ = maximum;
+        next_ = 1;
+        aliases_.clear();
+        uses_.clear();
+    }
+
+    // 0 = sem alias. sendTopic diz se o tópico ainda precisa ir junto.
+    uint16_t lookup(const std::string& topic, bool& sendTopic) {
+        sendTopic = true;
+        if (maximum_ == 0) return 0;
+        auto it = aliases_.find(topic);
+        if (it != aliases_.end()) {
+            sendTopic = false;
+            return it->second;
+        }
+        if (next_ > maximum_) return 0;
+        auto use = uses_.find(topic);
+        if (use == uses_.end()) {
+            if (uses_.size() >= TOPIC_ALIAS_CANDIDATES) uses_.clear();
+            use = uses_.emplace(topic, 0).first;
+        }
+        if (++use->second < TOPIC_ALIAS_MIN_USES) return 0;
+        uses_.erase(use);
+        uint16_t alias = static_cast<uint16_t>(next_++);
+        aliases_.emplace(topic, alias);
+        return alias;
+    }
+
+    // A publicação que levaria o tópico não saiu: o broker não conhece o
+    // alias. O número fica sem uso até a próxima conexão.
+    void forget(const std::string& topic) { aliases_.erase(topic); }
+
+    size_t size() const { return aliases_.size(); }
+    uint16_t maximum() const { return maximum_; }
+
+private:
+    uint16_t maximum_ = 0;
+    uint32_t next_ = 1;
+    std::unordered_map<std::string, uint16_t> aliases_;
+    std::unordered_map<std::string, uint32_t> uses_;
+};
+
+/* -----------------------------------------------------------------------
+   Estágio de publicação: as conversões entregam as mensagens numa fila
+   e um thread as publica, limitando quantas ficam sem confirmação do
+   broker (janela) e acompanhando cada entrega pelo listener do Paho.
+   Modo de agregação (opcional): junta até N leituras por tópico num
+   único payload JSON de array, enviado ao encher ou após X ms.
+   Com limites de taxa, as mensagens passam pelo RateShaper antes da fila.
+   Cada fila de prioridade tem sua própria fila; a de alta prioridade é
+   servida primeiro e tem uma reserva na janela, para não esperar atrás
+   de um pico de telemetria normal.
+   Com spool, o que sai sem conexão vai para o disco e volta depois da
+   reconexão no ritmo de DrainRate, em lotes de até DrainBatch.
+   -----------------------------------------------------------------------*/
+class Publisher : public virtual mqtt::iaction_listener {
+public:
+    // Chamado com a mensagem (quando disponível) e o código de retorno do Paho
+    using FailureHandler = std::function<void(const mqtt::const_message_ptr&, int)>;
+
+    // cpus: as filas e o thread de publicação nascem nelas
+    Publisher(mqtt::async_client& cli, const PublisherOptions& opts,
+              FailureHandler onFailure = FailureHandler(), const CpuSet& cpus = CpuSet())
+        : Publisher(cli, opts, std::move(onFailure), ScopedThreadAffinity(cpus)) {}
+
+    ~Publisher() override { stop(); }
+
+    Publisher(const Publisher&) = delete;
+    Publisher& operator=(const Publisher&) = delete;
+
+    // Publica uma cópia do payload, numa mensagem própria.
+    // arrivalNs (monotonicNanos() da mensagem de origem) alimenta o
+    // histograma de latência da fila quando a entrega é confirmada; 0 = não mede.
+    void publish(const mqtt::string_ref& topic, std::string_view payload, int64_t arrivalNs = 0,
+                 PriorityLane lane = PriorityLane::Normal, const Delivery& delivery = Delivery()) {
+        enqueue(Outgoing{makeMessage(topic, PayloadPool::instance().copy(payload), lane, delivery),
+                         arrivalNs, lane});
+    }
+
+    // Repassa um payload já existente (buffer compartilhado, sem cópia).
+    void forward(const mqtt::string_ref& topic, const mqtt::binary_ref& payload, int64_t arrivalNs = 0,
+                 PriorityLane lane = PriorityLane::Normal, const Delivery& delivery = Delivery()) {
+        enqueue(Outgoing{makeMessage(topic, payload, lane, delivery), arrivalNs, lane});
+    }
+
+    // Publica uma leitura convertida; com agregação, ela entra no lote do tópico.
+    void publishReading(const mqtt::string_ref& topic, std::string_view payload, int64_t arrivalNs = 0,
+                        PriorityLane lane = PriorityLane::Normal, const Delivery& delivery = Delivery()) {
+        if (opts_.AggregateReadings == 0) {
+            publish(topic, payload, arrivalNs, lane, delivery);
+            return;
+        }
+        if (!running_.load(std::memory_order_relaxed)) {
+            metrics().count(Counter::StopDropped);
+            return;
+        }
+        Outgoing full;
+        {
+            std::lock_guard<std::mutex> lock(batchMutex_);
+            // Busca pelo string_view: a std::string da chave só nasce no primeiro lote do tópico
+            const std::string &name = topic.str();
+            auto it = batches_.find(std::string_view(name));
+            if (it == batches_.end()) it = batches_.emplace(name, Batch()).first;
+            Batch &batch = it->second;
+            if (batch.Count == 0) {
+                batch.Topic = topic;
+                batch.Payload.assign(1, '[');
+                batch.Started = std::chrono::steady_clock::now();
+                batch.ArrivalNs = arrivalNs;   // a latência do lote conta da primeira leitura
+                batch.Lane = lane;
+                batch.Policy = delivery;
+            } else {
+                batch.Payload.push_back(',');
+            }
+            batch.Payload.append(payload.data(), payload.size());
+            if (++batch.Count >= opts_.AggregateReadings) full = takeBatch(batch);
+        }
+        if (full.Msg) enqueue(std::move(full));
+    }
+
+    // Prazo do encerramento (monotonicNanos), dado antes de parar os
+    // workers: a partir dele nenhum produtor espera pela fila cheia.
+    void setStopDeadline(int64_t deadlineNs) {
+        stopByNs_.store(std::min(deadlineNs, stopByNs_.load()), std::memory_order_relaxed);
+        waiter_.notify();
+    }
+
+    // Envia os lotes pendentes, esvazia a fila e espera as entregas em voo,
+    // tudo dentro do prazo. O que não saiu até ele vai para o spool (ou só
+    // é contado). Depois disso o Paho não deve mais chamar este listener.
+    // Retorna false se sobraram entregas sem confirmação.
+    bool stop(std::chrono::milliseconds deadline = std::chrono::seconds(5)) {
+        if (!running_.load()) return inFlight_.load() == 0;
+        setStopDeadline(monotonicNanos() + std::chrono::duration_cast<std::chrono::nanoseconds>(deadline).count());
+        flushBatches(true);
+        // O que está esperando ficha sai agora, sem limite
+        while (shaper_ && shaper_->pending() > 0 && !pastStopDeadline()) {
+            shaper_->drain(monotonicNanos(), [this](Outgoing& m) { return push(m); }, true);
+            waiter_.notify();
+            std::this_thread::yield();
+        }
+        running_.store(false);
+        waiter_.wakeAll();
+        if (thread_.joinable()) thread_.join();
+        discardUnsent();
+
+        std::unique_lock<std::mutex> lock(windowMutex_);
+        windowCv_.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(stopByNs_.load())),
+                             [this] { return inFlight_.load() == 0; });
+        if (spool_ && !spool_->empty()) {
+            LOG_INFO(spool_->size() << " mensagem(ns) ficam no spool " << spool_->path() << " para a próxima conexão.");
+        }
+        if (inFlight_.load() != 0) {
+            LOG_WARN(inFlight_.load() << " publicação(ões) sem confirmação ao encerrar.");
+            return false;
+        }
+        return true;
+    }
+
+    // A cada conexão: o máximo de aliases do CONNACK (0 = o broker não
+    // aceita). A tabela recomeça, porque os aliases não passam de uma
+    // conexão para outra.
+    uint16_t setTopicAliasMaximum(uint16_t brokerMaximum) {
+        uint16_t maximum = opts_.Mqtt5 ? std::min(brokerMaximum, opts_.TopicAliases) : 0;
+        aliasMaximum_.store(maximum, std::memory_order_relaxed);
+        aliasEpoch_.fetch_add(1, std::memory_order_release);
+        return maximum;
+    }
+
+    // Estado da conexão, dado pelo connection_lost e pela reconexão. Com
+    // spool, desconectado, o que sai espera nele. Na queda os aliases da
+    // sessão acabam já: sem spool o send() não olha a conexão, e até o
+    // CONNACK seguinte (setTopicAliasMaximum) os tópicos vão por extenso.
+    // Começa desconectado, até a primeira conexão.
+    void setConnected(bool up) {
+        if (!up) setTopicAliasMaximum(0);
+        connected_.store(up, std::memory_order_release);
+        if (up) waiter_.notify();
+    }
+
+    size_t inFlight() const { return inFlight_.load(std::memory_order_relaxed); }
+    size_t queued() const {
+        size_t total = 0;
+        for (const auto &q : queues_) total += q.size_approx();
+        return total;
+    }
+    size_t rateLimitBacklog() const { return shaper_ ? shaper_->pending() : 0; }
+    size_t spooled() const { return spool_ ? spool_->size() : 0; }
+    uint64_t delivered() const { return delivered_.load(std::memory_order_relaxed); }
+    uint64_t failed() const { return failed_.load(std::memory_order_relaxed); }
+
+    // Listener do Paho (threads do Paho)
+    void on_success(const mqtt::token& tok) override {
+        delivered_.fetch_add(1, std::memory_order_relaxed);
+        metrics().count(Counter::Published);
+        if (int64_t arrival = arrivalOf(tok)) metrics().recordLatency(monotonicNanos() - arrival, laneOf(tok));
+        dropContext(tok.get_user_context());
+        release();
+    }
+
+    void on_failure(const mqtt::token& tok) override {
+        auto dtok = dynamic_cast<const mqtt::delivery_token*>(&tok);
+        mqtt::const_message_ptr msg = dtok ? dtok->get_message() : mqtt::const_message_ptr();
+        int rc = tok.get_return_code();
+        // Em voo na queda: volta pelo spool. As que saíram só com o alias
+        // têm o tópico original guardado no contexto do token.
+        const mqtt::string_ref* aliased = topicOf(tok);
+        if (spool_ && msg && connectionFailure(rc)) {
+            spoolMessage(*msg, aliased ? aliased->str() : msg->get_topic(), laneOf(tok));
+        } else {
+            failed_.fetch_add(1, std::memory_order_relaxed);
+            metrics().count(Counter::PublishFailed);
+            onFailure_(msg, rc);
+        }
+        dropContext(tok.get_user_context());
+        release();
+    }
+
+private:
+    // O placement vive até o fim deste construtor (é um temporário do
+    // construtor delegante): filas, RateShaper e thread nascem nas CPUs
+    Publisher(mqtt::async_client& cli, const PublisherOptions& opts, FailureHandler onFailure,
+              const ScopedThreadAffinity& /*placement*/)
+        : client_(cli), opts_(opts),
+          queues_{BoundedMpmcQueue<Outgoing>(opts.QueueCapacity),
+                  BoundedMpmcQueue<Outgoing>(std::max<size_t>(64, opts.QueueCapacity / 4))},
+          drain_(opts.Spool.DrainRate, static_cast<double>(std::max<size_t>(1, opts.Spool.DrainBatch))),
+          onFailure_(std::move(onFailure))
+    {
+        if (opts_.rateLimited()) shaper_.reset(new RateShaper(opts_.TopicLimits, opts_.GlobalLimit));
+        if (opts_.Spool.enabled()) spool_.reset(new DiskSpool(opts_.Spool.Path, opts_.Spool.Bytes));
+        if (!onFailure_) {
+            onFailure_ = [](const mqtt::const_message_ptr& msg, int rc) {
+                LOG_ERROR("Falha na entrega para "
+                          << (!msg ? std::string("(desconhecido)")
+                              : msg->get_topic().empty() ? std::string("(tópico por alias)") : msg->get_topic())
+                          << " (código " << rc << ")");
+            };
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    using Outgoing = OutgoingMessage;
+
+    struct Batch {
+        mqtt::string_ref Topic;
+        std::string Payload;
+        size_t Count = 0;
+        std::chrono::steady_clock::time_point Started;
+        int64_t ArrivalNs = 0;
+        PriorityLane Lane = PriorityLane::Normal;
+        Delivery Policy;   // a da leitura que abriu o lote
+    };
+
+    // O instante de chegada e a fila viajam no user context do token
+    // (bit 0 = fila, bit 1 = contexto alocado, o resto = ns; cabe num
+    // ponteiro de 64 bits), sem alocar nada por publicação. Só a que sai
+    // com o alias e sem o tópico leva um AliasedContext, que guarda o
+    // tópico original para o spool caso a conexão caia com ela em voo;
+    // o bloco sai do BlockPool e volta para ele na confirmação.
+    struct AliasedContext {
+        int64_t ArrivalNs;
+        PriorityLane Lane;
+        mqtt::string_ref Topic;
+    };
+    static constexpr uintptr_t CONTEXT_LANE = 1, CONTEXT_BOXED = 2;
+
+    static void* contextOf(const Outgoing& out, const mqtt::string_ref* aliasedTopic) {
+        if (aliasedTopic) {
+            AliasedContext* box = PoolAllocator<AliasedContext>().allocate(1);
+            new (box) AliasedContext{out.ArrivalNs, out.Lane, *aliasedTopic};
+            return reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(box) | CONTEXT_BOXED);
+        }
+        uint64_t ctx = (static_cast<uint64_t>(out.ArrivalNs) << 2) | static_cast<uint64_t>(out.Lane);
+        return reinterpret_cast<void*>(static_cast<uintptr_t>(ctx));
+    }
+    static AliasedContext* boxOf(void* ctx) {
+        uintptr_t bits = reinterpret_cast<uintptr_t>(ctx);
+        if (!(bits & CONTEXT_BOXED)) return nullptr;
+        return reinterpret_cast<AliasedContext*>(bits & ~(CONTEXT_LANE | CONTEXT_BOXED));
+    }
+    static void dropContext(void* ctx) {
+        AliasedContext* box = boxOf(ctx);
+        if (!box) return;
+        box->~AliasedContext();
+        PoolAllocator<AliasedContext>().deallocate(box, 1);
+    }
+
+    static int64_t arrivalOf(const mqtt::token& tok) {
+        if (auto* box = boxOf(tok.get_user_context())) return box->ArrivalNs;
+        return static_cast<int64_t>(reinterpret_cast<uintptr_t>(tok.get_user_context()) >> 2);
+    }
+    static PriorityLane laneOf(const mqtt::token& tok) {
+        if (auto* box = boxOf(tok.get_user_context())) return box->Lane;
+        return static_cast<PriorityLane>(reinterpret_cast<uintptr_t>(tok.get_user_context()) & CONTEXT_LANE);
+    }
+    static const mqtt::string_ref* topicOf(const mqtt::token& tok) {
+        auto* box = boxOf(tok.get_user_context());
+        return box ? &box->Topic : nullptr;
+    }
+
+    // Janela de cada fila: a alta prioridade pode passar do limite normal
+    // em até um quarto dele, para sempre haver espaço para ela.
+    size_t windowOf(PriorityLane lane) const {
+        if (lane == PriorityLane::Normal) return opts_.MaxInFlight;
+        return opts_.MaxInFlight + std::max<size_t>(1, opts_.MaxInFlight / 4);
+    }
+
+    bool push(Outgoing& msg) { return queues_[static_cast<size_t>(msg.Lane)].try_push(std::move(msg)); }
+
+    // Fila normal atrasada: a fila passou da fração configurada ou a janela está cheia
+    bool underPressure() const {
+        const auto &queue = queues_[static_cast<size_t>(PriorityLane::Normal)];
+        return static_cast<double>(queue.size_approx()) >= opts_.AdaptiveQueueFill * static_cast<double>(queue.capacity()) ||
+               inFlight_.load(std::memory_order_relaxed) >= opts_.MaxInFlight;
+    }
+
+    mqtt::message_ptr makeMessage(const mqtt::string_ref& topic, const mqtt::binary_ref& payload,
+                                  PriorityLane lane, const Delivery& delivery) {
+        auto msg = makePooledMessage(topic, payload);
+        int qos = delivery.Qos;
+        if (delivery.Adaptive && qos > 0 && lane == PriorityLane::Normal && underPressure()) {
+            qos = 0;
+            metrics().count(Counter::QosDowngraded);
+        }
+        msg->set_qos(qos);
+        msg->set_retained(delivery.Retained);
+        if (!opts_.Mqtt5) return msg;   // numa conexão 3.1.1 não há propriedades
+        bool format = opts_.PayloadFormat && delivery.ContentType;
+        if (delivery.ExpirySeconds == 0 && !format) return msg;
+        mqtt::properties props;
+        if (delivery.ExpirySeconds > 0) {
+            props.add(mqtt::property(mqtt::property::MESSAGE_EXPIRY_INTERVAL, static_cast<int32_t>(delivery.ExpirySeconds)));
+        }
+        if (format) {
+            // O consumidor sabe o que chegou sem olhar o payload
+            if (delivery.Utf8) props.add(mqtt::property(mqtt::property::PAYLOAD_FORMAT_INDICATOR, 1));
+            props.add(mqtt::property(mqtt::property::CONTENT_TYPE, std::string(delivery.ContentType)));
+        }
+        msg->set_properties(std::move(props));
+        return msg;
+    }
+
+    Outgoing takeBatch(Batch& batch) {
+        batch.Payload.push_back(']');
+        Outgoing out{makeMessage(batch.Topic, PayloadPool::instance().copy(batch.Payload), batch.Lane, batch.Policy),
+                     batch.ArrivalNs, batch.Lane};
+        batch.Count = 0;
+        batch.Payload.clear();
+        return out;
+    }
+
+    // Fecha os lotes vencidos (ou todos, com force)
+    void flushBatches(bool force) {
+        if (opts_.AggregateReadings == 0) return;
+        std::vector<Outgoing> ready;
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(batchMutex_);
+            for (auto &entry : batches_) {
+                Batch &batch = entry.second;
+                if (batch.Count > 0 && (force || now - batch.Started >= opts_.AggregateInterval)) {
+                    ready.push_back(takeBatch(batch));
+                }
+            }
+        }
+        for (auto &msg : ready) enqueue(std::move(msg));
+    }
+
+    // Fila cheia: segura o produtor (contrapressão), como no WorkerPool.
+    // Com limite de taxa, só entra na fila o que o RateShaper liberar.
+    // Depois do stop() ninguém mais envia: a mensagem só é contada.
+    void enqueue(Outgoing msg) {
+        if (!running_.load(std::memory_order_relaxed)) {
+            metrics().count(Counter::StopDropped);
+            return;
+        }
+        if (shaper_) {
+            switch (shaper_->offer(msg, monotonicNanos())) {
+            case RateShaper::Verdict::Pass:
+                break;
+            case RateShaper::Verdict::Held:
+                waiter_.notify();
+                return;
+            case RateShaper::Verdict::Dropped:
+                metrics().count(Counter::RateLimited);
+                return;
+            }
+        }
+        while (!push(msg)) {
+            if (!running_.load(std::memory_order_relaxed) || pastStopDeadline()) {
+                metrics().count(Counter::StopDropped);
+                return;
+            }
+            std::this_thread::yield();
+        }
+        waiter_.notify();
+    }
+
+    // Próxima mensagem que cabe na janela, da fila mais prioritária primeiro
+    bool pop(Outgoing& msg) {
+        size_t inFlight = inFlight_.load();
+        for (size_t l = PRIORITY_LANES; l-- > 0; ) {
+            if (inFlight < windowOf(static_cast<PriorityLane>(l)) && queues_[l].try_pop(msg)) return true;
+        }
+        return false;
+    }
+
+    void run() {
+        auto idleTimeout = std::chrono::milliseconds(100);
+        if (opts_.AggregateReadings > 0) {
+            idleTimeout = std::max(std::chrono::milliseconds(1),
+                                   std::min(idleTimeout, opts_.AggregateInterval / 4));
+        }
+
+        Outgoing msg;
+        for (;;) {
+            // No encerramento, só até o prazo (nem a janela cheia segura)
+            if (!running_.load(std::memory_order_relaxed) && pastStopDeadline()) return;
+            flushBatches(false);
+            if (shaper_) {
+                shaper_->drain(monotonicNanos(), [this](Outgoing& m) { return push(m); });
+            }
+            bool draining = spool_ && connected_.load(std::memory_order_acquire) && !spool_->empty();
+            if (draining) drainSpool();
+
+            if (pop(msg)) {
+                send(std::move(msg));
+                msg.Msg.reset();
+                continue;
+            }
+
+            // Janela cheia para a fila normal: espera confirmações antes de
+            // mandar mais (a alta prioridade ainda tem a reserva)
+            if (inFlight_.load() >= opts_.MaxInFlight && queued() > 0) {
+                std::unique_lock<std::mutex> lock(windowMutex_);
+                windowCv_.wait_for(lock, std::chrono::milliseconds(10), [this] {
+                    return inFlight_.load() < opts_.MaxInFlight
+                        || (inFlight_.load() < windowOf(PriorityLane::High)
+                            && queues_[static_cast<size_t>(PriorityLane::High)].size_approx() > 0);
+                });
+                continue;
+            }
+            if (!running_.load()) return;
+
+            // Com mensagens esperando ficha, acorda logo para liberá-las;
+            // com o spool esvaziando, a cada próximo lote
+            bool waiting = shaper_ && shaper_->pending() > 0;
+            waiter_.wait([this] {
+                return queued() == 0 && running_.load(std::memory_order_relaxed);
+            }, waiting ? std::chrono::milliseconds(1) : draining ? std::chrono::milliseconds(10) : idleTimeout);
+        }
+    }
+
+    // Alias na ordem de envio: a publicação que leva o tópico sai antes
+    // das que só levam o número. Devolve true se o tópico foi tirado.
+    bool applyTopicAlias(mqtt::message& msg) {
+        uint64_t epoch = aliasEpoch_.load(std::memory_order_acquire);
+        if (epoch != aliasSeen_) {
+            aliases_.reset(aliasMaximum_.load(std::memory_order_relaxed));
+            aliasSeen_ = epoch;
+        }
+        bool sendTopic = true;
+        uint16_t alias = aliases_.lookup(msg.get_topic(), sendTopic);
+        if (alias == 0) return false;
+        mqtt::properties props = msg.get_properties();
+        props.add(mqtt::property(mqtt::property::TOPIC_ALIAS, alias));
+        msg.set_properties(std::move(props));
+        if (!sendTopic) {
+            msg.set_topic(mqtt::string_ref());
+            metrics().count(Counter::TopicAliased);
+        }
+        return !sendTopic;
+    }
+
+    // Devolve true se a mensagem foi para o spool em vez de sair
+    bool send(Outgoing out) {
+        // Sem conexão, direto para o spool (sem spool, o Paho recusa e conta como falha)
+        if (spool_ && !connected_.load(std::memory_order_acquire)) {
+            spoolMessage(*out.Msg, out.Msg->get_topic(), out.Lane);
+            return true;
+        }
+        inFlight_.fetch_add(1);
+        mqtt::string_ref topic = out.Msg->get_topic_ref();
+        bool aliasOnly = applyTopicAlias(*out.Msg);
+        void* ctx = contextOf(out, aliasOnly ? &topic : nullptr);
+        try {
+            client_.publish(out.Msg, ctx, *this);
+        }
+        catch (const mqtt::exception &ex) {
+            dropContext(ctx);
+            // Só a que levava o tópico apresentava o alias ao broker; uma
+            // que saía só com o número não muda o que ele já conhece
+            if (!aliasOnly) aliases_.forget(topic.str());
+            bool spooled = spool_ && connectionFailure(ex.get_return_code());
+            if (spooled) {
+                spoolMessage(*out.Msg, topic.str(), out.Lane);
+            } else {
+                failed_.fetch_add(1, std::memory_order_relaxed);
+                metrics().count(Counter::PublishFailed);
+                onFailure_(out.Msg, ex.get_return_code());
+            }
+            release();
+            return spooled;
+        }
+        return false;
+    }
+
+    // A falha veio da queda da conexão, e não de uma recusa do broker
+    bool connectionFailure(int rc) const {
+        return !connected_.load(std::memory_order_acquire) || rc == MQTTASYNC_DISCONNECTED ||
+               rc == MQTTASYNC_OPERATION_INCOMPLETE;
+    }
+
+    // Grava a mensagem no spool com o tópico por extenso: o alias não
+    // vale na próxima conexão. A expiração passa a contar de agora.
+    void spoolMessage(const mqtt::message& msg, const std::string& topic, PriorityLane lane) {
+        SpoolEntry e;
+        e.Topic = topic;
+        const mqtt::binary &payload = msg.get_payload();
+        e.Payload = std::string_view(payload.data(), payload.size());
+        e.Qos = msg.get_qos();
+        e.Retained = msg.is_retained();
+        e.Lane = lane;
+        const mqtt::properties &props = msg.get_properties();
+        std::string contentType;
+        if (props.contains(mqtt::property::CONTENT_TYPE)) {
+            contentType = mqtt::get<std::string>(props, mqtt::property::CONTENT_TYPE);
+            e.ContentType = contentType;
+        }
+        e.Utf8 = props.contains(mqtt::property::PAYLOAD_FORMAT_INDICATOR);
+        if (props.contains(mqtt::property::MESSAGE_EXPIRY_INTERVAL)) {
+            e.ExpiresAtUs = unixMicros() +
+                static_cast<int64_t>(mqtt::get<uint32_t>(props, mqtt::property::MESSAGE_EXPIRY_INTERVAL)) * 1000000;
+        }
+        metrics().count(spool_->append(e) ? Counter::Spooled : Counter::SpoolDropped);
+    }
+
+    // Mensagem de volta do spool, com o que restou da expiração
+    mqtt::message_ptr restore(const SpoolEntry& e, int64_t expirySeconds) {
+        auto msg = makePooledMessage(mqtt::string_ref(std::string(e.Topic)), e.Payload);
+        msg->set_qos(e.Qos);
+        msg->set_retained(e.Retained);
+        if (!opts_.Mqtt5 || (expirySeconds == 0 && !e.Utf8 && e.ContentType.empty())) return msg;
+        mqtt::properties props;
+        if (expirySeconds > 0) {
+            props.add(mqtt::property(mqtt::property::MESSAGE_EXPIRY_INTERVAL, static_cast<int32_t>(expirySeconds)));
+        }
+        if (e.Utf8) props.add(mqtt::property(mqtt::property::PAYLOAD_FORMAT_INDICATOR, 1));
+        if (!e.ContentType.empty()) {
+            props.add(mqtt::property(mqtt::property::CONTENT_TYPE, std::string(e.ContentType)));
+        }
+        msg->set_properties(std::move(props));
+        return msg;
+    }
+
+    // Reenvia do spool o que o ritmo permitir, sem passar da janela da
+    // fila normal: o tráfego ao vivo não espera atrás do atrasado. Para
+    // no encerramento e na queda da conexão; se a queda vier no meio do
+    // envio, a mensagem volta ao spool e o esvaziamento para ali, em vez
+    // de rodar o anel do início para o fim.
+    void drainSpool() {
+        int64_t now = monotonicNanos();
+        int64_t nowUs = unixMicros();
+        while (running_.load(std::memory_order_relaxed) && connected_.load(std::memory_order_acquire) &&
+               inFlight_.load() < opts_.MaxInFlight && drain_.available(now)) {
+            Outgoing out;
+            bool expired = false;
+            bool found = spool_->pop([&](const SpoolEntry& e) {
+                int64_t remaining = 0;
+                if (e.ExpiresAtUs != 0) {
+                    remaining = (e.ExpiresAtUs - nowUs + 999999) / 1000000;
+                    expired = remaining <= 0;
+                }
+                if (!expired) out = Outgoing{restore(e, remaining), 0, e.Lane};
+            });
+            if (!found) return;
+            if (expired) {
+                metrics().count(Counter::SpoolDropped);
+                continue;
+            }
+            drain_.tryTake(now);
+            if (send(std::move(out))) return;
+            metrics().count(Counter::SpoolDrained);
+        }
+    }
+
+    bool pastStopDeadline() const {
+        return monotonicNanos() >= stopByNs_.load(std::memory_order_relaxed);
+    }
+
+    // Depois do thread de publicação: o que ficou nas filas e esperando
+    // ficha vai para o spool, ou só é contado
+    void discardUnsent() {
+        uint64_t left = 0;
+        auto discard = [&](Outgoing& out) {
+            if (spool_) spoolMessage(*out.Msg, out.Msg->get_topic(), out.Lane);
+            else ++left;
+            return true;
+        };
+        if (shaper_) shaper_->drain(monotonicNanos(), discard, true);
+        Outgoing out;
+        for (auto &queue : queues_) {
+            while (queue.try_pop(out)) discard(out);
+        }
+        if (left == 0) return;
+        metrics().count(Counter::StopDropped, left);
+        LOG_WARN(left << " publicação(ões) descartada(s) no prazo do encerramento.");
+    }
+
+    void release() {
+        inFlight_.fetch_sub(1);
+        std::lock_guard<std::mutex> lock(windowMutex_);
+        windowCv_.notify_all();
+    }
+
+    mqtt::async_client& client_;
+    PublisherOptions opts_;
+    BoundedMpmcQueue<Outgoing> queues_[PRIORITY_LANES];
+    std::unique_ptr<RateShaper> shaper_;
+    TokenBucket drain_;                  // ritmo de esvaziamento do spool
+    std::unique_ptr<DiskSpool> spool_;   // nulo = sem spool
+    std::atomic<bool> connected_{false};
+    FailureHandler onFailure_;
+    IdleWaiter waiter_;
+    std::thread thread_;
+    std::atomic<bool> running_{true};
+    std::atomic<int64_t> stopByNs_{std::numeric_limits<int64_t>::max()};
+
+    std::atomic<size_t> inFlight_{0};
+    std::mutex windowMutex_;
+    std::condition_variable windowCv_;
+    std::atomic<uint64_t> delivered_{0};
+    std::atomic<uint64_t> failed_{0};
+
+    std::mutex batchMutex_;
+    std::map<std::string, Batch, std::less<>> batches_;   // busca heterogênea, por string_view
+
+    TopicAliasTable aliases_;   // só o thread de publicação
+    uint64_t aliasSeen_ = 0;
+    std::atomic<uint16_t> aliasMaximum_{0};
+    std::atomic<uint64_t> aliasEpoch_{0};
+};
+
+/* -----------------------------------------------------------------------
+   Callback para lidar com mensagens recebidas.
+   -----------------------------------------------------------------------*/
+class BrokerLogicCallback : public virtual mqtt::callback
+{
+public:
+    // Recebe a referência do client, para podermos republicar mensagens.
+    // A tabela de rotas decide o handler de cada tópico; os tópicos de
+    // saída por ArbitrationId vêm dos decoders.
+    BrokerLogicCallback(mqtt::async_client& cli,
+                        const PipelineOptions& opts = PipelineOptions(),
+                        const RouteTable& routes = defaultRouteTable(),
+                        const DecoderTable& decoders = defaultDecoderTable())
+        : BrokerLogicCallback(cli, opts, borrowTables(routes, decoders)) {}
+
+    BrokerLogicCallback(mqtt::async_client& cli, const PipelineOptions& opts, RoutingTables tables)
+        : client_(cli), dedup_(opts.Dedup), fusion_(opts.Fusion), adaptiveQos_(opts.Publisher.AdaptiveQos),
+          deadLetter_(opts.DeadLetter),
+          publisher_(cli, opts.Publisher, Publisher::FailureHandler(), opts.Affinity.publisher())
+    {
+        routing_ = makeSnapshot(std::move(tables));
+        routingVersion_.store(nextRoutingVersion(), std::memory_order_release);
+        if (!opts.Capture.Prefix.empty()) capture_.reset(new CaptureWriter(opts.Capture));
+        if (opts.Workers > 0) {
+            pool_.reset(new WorkerPool(opts.Workers, opts.QueueCapacity,
+                [this](const InboundMessage& m) { processMessage(m); }, opts.Affinity));
+        }
+        gaugeId_ = metrics().addGaugeSource([this] { return gauges(); });
+        metrics().setSlo(PriorityLane::High, opts.Metrics.HighPrioritySlo);
+        if (opts.Metrics.Interval.count() > 0) {
+            metricsTopic_ = mqtt::string_ref(opts.Metrics.Topic);
+            metricsTask_.reset(new PeriodicTask(opts.Metrics.Interval, [this] { publishMetrics(); }));
+        }
+        if (fusion_.enabled()) {
+            fusionTask_.reset(new PeriodicTask(fusion_.Interval, [this] { publishFusion(); }));
+        }
+        if (opts.Metrics.HttpPort > 0) {
+            try {
+                metricsHttp_.reset(new MetricsHttpServer(opts.Metrics.HttpPort, [this] {
+                    return renderPrometheus(metrics().snapshot(), routing()->routes(), metrics().gauges());
+                }));
+            }
+            catch (const std::exception &ex) {
+                // Sem o endpoint o broker continua funcionando
+                LOG_ERROR(ex.what());
+            }
+        }
+    }
+
+    ~BrokerLogicCallback() override { shutdown(); }
+
+    // Encerramento ordenado: esvazia as filas dos workers, envia o que o
+    // publicador ainda tem e espera as confirmações QoS1, tudo num só
+    // prazo. Mensagens que chegarem depois são ignoradas. Retorna false se
+    // sobraram publicações sem confirmação.
+    bool shutdown(std::chrono::milliseconds deadline = std::chrono::seconds(5)) {
+        if (stopping_.exchange(true)) return true;
+        int64_t stopBy = monotonicNanos() + std::chrono::duration_cast<std::chrono::nanoseconds>(deadline).count();
+        publisher_.setStopDeadline(stopBy);   // os workers não ficam presos na fila cheia
+        // Primeiro as métricas e os workers (que ainda publicam), depois o publicador
+        metricsHttp_.reset();
+        metricsTask_.reset();
+        fusionTask_.reset();
+        metrics().removeGaugeSource(gaugeId_);
+        if (capture_) capture_->stop();
+        if (pool_) pool_->stop(stopBy);
+        return publisher_.stop(deadline);
+    }
+
+    // Estado das filas e da janela de publicação deste pipeline
+    MetricsGauges gauges() const {
+        MetricsGauges g;
+        g.WorkerBacklog = pool_ ? pool_->backlog() : 0;
+        g.PublishQueue = publisher_.queued();
+        g.InFlight = publisher_.inFlight();
+        g.RateLimitBacklog = publisher_.rateLimitBacklog();
+        g.SpoolBacklog = publisher_.spooled();
+        return g;
+    }
+
+    // Máximo de aliases de tópico aceito pelo broker nesta conexão
+    uint16_t setTopicAliasMaximum(uint16_t brokerMaximum) { return publisher_.setTopicAliasMaximum(brokerMaximum); }
+
+    // Conexão pronta (CONNACK lido e assinaturas feitas) ou perdida
+    void setConnected(bool up) { publisher_.setConnected(up); }
+
+    // Quem refaz a conexão; definido antes de conectar
+    void setConnectionLostHandler(std::function<void()> handler) { onConnectionLost_ = std::move(handler); }
+
+    // Queda da conexão (thread do Paho): o publicador passa a gravar no
+    // spool e a reconexão é agendada
+    void connection_lost(const std::string& cause) override {
+        publisher_.setConnected(false);
+        if (stopping_.load(std::memory_order_relaxed)) return;
+        LOG_WARN("Conexão com o broker perdida" << (cause.empty() ? std::string() : ": " + cause) << ".");
+        if (onConnectionLost_) onConnectionLost_();
+    }
+
+    // Publica o snapshot das métricas (de todo o processo) em JSON no tópico $SYS
+    void publishMetrics() {
+        JsonWriter &w = threadJsonWriter();
+        writeMetricsJson(w, metrics().snapshot(), routing()->routes(), metrics().gauges());
+        publisher_.publish(metricsTopic_, w.view());
+    }
+
+    // Publica o snapshot fundido de cada veículo com leitura nova
+    void publishFusion() {
+        auto snapshot = routing();
+        if (!snapshot->fusion()) return;
+        snapshot->fusion()->collect(monotonicNanos(), [this](const mqtt::string_ref& topic, std::string_view payload) {
+            publisher_.publish(topic, payload);
+        });
+    }
+
+    // Rotas e decoders em uso agora. Cada thread guarda o último snapshot
+    // que leu e só toma a trava quando a versão muda (numa recarga); as
+    // versões são únicas no processo, então o cache serve a qualquer shard.
+    const std::shared_ptr<const RoutingSnapshot>& routing() const {
+        struct Cached {
+            uint64_t Version = 0;
+            std::shared_ptr<const RoutingSnapshot> Snapshot;
+        };
+        thread_local Cached cached;
+        if (cached.Version != routingVersion_.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(routingMutex_);
+            cached.Snapshot = routing_;
+            cached.Version = routingVersion_.load(std::memory_order_relaxed);
+        }
+        return cached.Snapshot;
+    }
+
+    // Troca as tabelas sem parar o fluxo. As mensagens já roteadas terminam
+    // com as tabelas antigas; o dedup e a fusão recomeçam do zero com os
+    // novos decoders.
+    void reload(RoutingTables tables) {
+        std::shared_ptr<const RoutingSnapshot> snapshot = makeSnapshot(std::move(tables));
+        std::lock_guard<std::mutex> lock(routingMutex_);
+        routing_.swap(snapshot);   // o antigo sai depois da trava
+        routingVersion_.store(nextRoutingVersion(), std::memory_order_release);
+    }
+
+    // Método chamado quando chega uma mensagem (thread do Paho).
+    // Resolve a rota e, com workers, só enfileira; o trabalho pesado
+    // fica com o pool.
+    void message_arrived(mqtt::const_message_ptr msg) override {
+        if (stopping_.load(std::memory_order_relaxed)) {
+            LOG_DEBUG("Encerrando; mensagem ignorada: " << msg->get_topic());
+            return;
+        }
+        if (capture_) capture_->record(msg);
+        InboundMessage in;
+        in.ArrivalNs = monotonicNanos();
+        in.Routing = routing();
+        if (!in.Routing->routes().match(msg->get_topic(), in.Match)) {
+            metrics().count(Counter::Unrouted);
+            LOG_WARN("Tópico não previsto na lógica: " << msg->get_topic());
+            return;
+        }
+        metrics().count(Counter::Received);
+        metrics().countRoute(in.Match.Matched->Index);
+        if (in.Match.Matched->Rule.Handler == RouteHandler::Drop) return;
+        in.Msg = std::move(msg);
+        if (pool_) {
+            RouteHandler handler = in.Match.Matched->Rule.Handler;
+            uint32_t key = orderingKey(*in.Msg, handler);
+            in.Lane = laneOf(*in.Routing, handler, key);
+            pool_->submit(key, std::move(in));
+            return;
+        }
+        processMessage(in);
+    }
+
+    // Parse, conversão e publicação de uma mensagem já roteada.
+    // Tópico e payload são vistos direto no buffer da mensagem do Paho.
+    void processMessage(const InboundMessage& in) {
+        const mqtt::message &msg = *in.Msg;
+        const RoutingSnapshot &routing = *in.Routing;
+        std::string_view topic   = msg.get_topic();
+        std::string_view payload = msg.get_payload();
+        mqtt::string_ref target  = routing.routes().target(in.Match, topic);
+        // Veículo da fusão: primeiro curinga da rota
+        std::string_view vehicle = in.Match.Captures > 0 ? in.Match.Captured[0] : std::string_view();
+        const RouteRule &rule = in.Match.Matched->Rule;
+
+        LOG_TRACE("\n[Recebido] Tópico: " << topic << "\n"
+                  << "Payload: " << payload);
+
+        try {
+            switch (rule.Handler) {
+            // JSON do simulador ("sim/canmessages"): algorithm_id e can_message, sem DOM
+            case RouteHandler::SimCanJson:
+                handleCanJson<CanMessageSimulator>(routing, msg, rule, target, vehicle, in.ArrivalNs);
+                break;
+            // Mesmo frame do simulador em formato binário ("sim/canbin")
+            case RouteHandler::SimCanBinary:
+                handleCanFrame<CanMessageSimulator>(routing, msg, rule, target, vehicle, in.ArrivalNs);
+                break;
+            // JSON do frame real ("can/messages"): AlgorithmID e CAN_Message, sem DOM
+            case RouteHandler::CanJson:
+                handleCanJson<CanMessage>(routing, msg, rule, target, vehicle, in.ArrivalNs);
+                break;
+            // Frame real em formato binário ("can/bin")
+            case RouteHandler::CanBinary:
+                handleCanFrame<CanMessage>(routing, msg, rule, target, vehicle, in.ArrivalNs);
+                break;
+            // Redireciona com o mesmo buffer de payload ("sim/x" -> "moto/x")
+            case RouteHandler::Passthrough: {
+                if (!target) {
+                    LOG_WARN("Rota " << rule.Pattern << " sem tópico de saída");
+                    break;
+                }
+                Delivery delivery = resolveDelivery(rule.Delivery, adaptiveQos_);
+                delivery.ContentType = nullptr;   // repassado sem conhecer o formato
+                publisher_.forward(target, msg.get_payload_ref(), in.ArrivalNs, PriorityLane::Normal, delivery);
+                LOG_DEBUG("(Simulação) Tópico: " << topic
+                          << " -> Redirecionado para: " << target.str()
+                          << " com valor: " << payload);
+                break;
+            }
+            case RouteHandler::Drop:
+                break;
+            }
+        }
+        catch (std::exception &ex) {
+            // Só o inesperado (falta de memória etc.): entrada inválida não lança
+            metrics().count(Counter::ParseErrors);
+            LOG_ERROR("Erro ao processar mensagem: " << ex.what());
+        }
+    }
+
+private:
+    mqtt::async_client& client_;
+
+    // Rotas e decoders (só leitura: os workers consultam em paralelo).
+    // Trocado inteiro na recarga, sob routingMutex_; os leitores passam
+    // pelo cache por thread de routing(), que só relê quando a versão muda.
+    std::shared_ptr<const RoutingSnapshot> routing_;   // escrito sob routingMutex_
+    mutable std::mutex routingMutex_;
+    std::atomic<uint64_t> routingVersion_{0};
+    DedupOptions dedup_;
+    FusionOptions fusion_;
+    bool adaptiveQos_;   // padrão de "adaptive_qos" das rotas e decoders que não o definem
+    DeadLetterOptions deadLetter_;
+
+    // Estágio de publicação (fila, janela de QoS1 e agregação)
+    Publisher publisher_;
+
+    // Tópicos de saída dos decoders, compartilhados entre as mensagens
+    TopicCache topics_;
+
+    // Pool de processamento (nulo no modo inline)
+    std::unique_ptr<WorkerPool> pool_;
+
+    // Gravação do tráfego de entrada (nulo sem --capture)
+    std::unique_ptr<CaptureWriter> capture_;
+
+    // Exposição das métricas (nulos quando desligados)
+    mqtt::string_ref metricsTopic_;
+    std::unique_ptr<PeriodicTask> metricsTask_;
+    std::unique_ptr<MetricsHttpServer> metricsHttp_;
+    size_t gaugeId_ = 0;
+
+    // Snapshot periódico da fusão por veículo (nulo quando desligada)
+    std::unique_ptr<PeriodicTask> fusionTask_;
+
+    std::atomic<bool> stopping_{false};
+    std::function<void()> onConnectionLost_;   // nulo = sem reconexão
+
+    // Chave de ordenação: mensagens CAN com o mesmo ArbitrationId caem no
+    // mesmo worker. Só procura o campo no texto, sem fazer o parse do JSON.
+    // Os demais tópicos mantêm a ordem por tópico.
+    static uint32_t orderingKey(const mqtt::message& msg, RouteHandler handler) {
+        std::string_view topic = msg.get_topic();
+        if (handler == RouteHandler::SimCanBinary || handler == RouteHandler::CanBinary) {
+            const std::string &payload = msg.get_payload();
+            if (payload.size() >= 4)
+                return readLe32(reinterpret_cast<const uint8_t*>(payload.data()));
+            return 0;
+        }
+        if (handler == RouteHandler::SimCanJson || handler == RouteHandler::CanJson) {
+            std::string_view payload(msg.get_payload());
+            const char* key = (handler == RouteHandler::CanJson) ? "\"ArbitrationId\""
+                                                                 : "\"arbitration_id\"";
+            size_t pos = payload.find(key);
+            if (pos != std::string_view::npos) {
+                pos = payload.find(':', pos);
+                uint32_t id = 0;
+                bool digits = false;
+                for (size_t i = pos + 1; pos != std::string_view::npos && i < payload.size(); ++i) {
+                    char c = payload[i];
+                    if (c >= '0' && c <= '9') {
+                        id = id * 10 + static_cast<uint32_t>(c - '0');
+                        digits = true;
+                    } else if (digits || (c != ' ' && c != '\t' && c != '\n' && c != '\r')) {
+                        break;
+                    }
+                }
+                return id;
+            }
+            return 0;
+        }
+        return static_cast<uint32_t>(std::hash<std::string_view>()(topic));
+    }
+
+    // Fila de prioridade do frame, pelo decoder do ArbitrationId da chave.
+    // Os tópicos que não são CAN ficam na fila normal.
+    static PriorityLane laneOf(const RoutingSnapshot& routing, RouteHandler handler, uint32_t key) {
+        if (handler == RouteHandler::Passthrough || handler == RouteHandler::Drop) return PriorityLane::Normal;
+        const CanDecoder* decoder = routing.decoders().find(key);
+        return decoder ? decoder->Lane : PriorityLane::Normal;
+    }
+
+    // false se a leitura não mudou desde a última publicada
+    static bool changed(const RoutingSnapshot& routing, FrameSource source, const CanData& can,
+                        const SensorReading& reading) {
+        ChangeFilter* changes = routing.changes();
+        if (!changes || changes->admit(source, can, reading, monotonicNanos())) return true;
+        metrics().count(Counter::Deduplicated);
+        return false;
+    }
+
+    // Contagem por ArbitrationId e dos IDs sem decoder
+    static void countArbitrationId(const DecoderTable& decoders, uint32_t arb) {
+        metrics().countArbitrationId(arb);
+        if (!decoders.find(arb)) metrics().count(Counter::UnmappedIds);
+    }
+
+    // Versão de um snapshot novo, única entre todos os pipelines (0 = nenhum)
+    static uint64_t nextRoutingVersion() {
+        static std::atomic<uint64_t> next{0};
+        return next.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    std::shared_ptr<const RoutingSnapshot> makeSnapshot(RoutingTables tables) const {
+        auto snapshot = std::make_shared<RoutingSnapshot>();
+        snapshot->Tables = std::move(tables);
+        if (dedup_.Enabled && !snapshot->Tables.Changes) {
+            snapshot->Tables.Changes = std::make_shared<ChangeFilter>(snapshot->decoders(), dedup_);
+        }
+        if (fusion_.enabled() && !snapshot->Tables.Fusion) {
+            snapshot->Tables.Fusion = std::make_shared<FusionTable>(snapshot->decoders(), fusion_);
+        }
+        return snapshot;
+    }
+
+    // Log similar ao .NET
+    static void logCanData(const CanData& can) {
+        if (!logger().enabled(LogLevel::Trace)) return;
+        LogLine line(LogLevel::Trace);
+        line << "Arbitration ID: " << Hex{static_cast<uint32_t>(can.ArbitrationId)} << "\n"
+             << "Data Bytes: ";
+        for (auto b : can.Data) line << static_cast<int>(b) << " ";
+    }
+
+    // Tópico de saída: o da rota, se houver; senão o do decoder
+    mqtt::string_ref outputTopic(const mqtt::string_ref& routeTarget, const CanDecoder& decoder) {
+        if (routeTarget) return routeTarget;
+        if (decoder.Topic) return topics_.intern(decoder.Topic);
+        return mqtt::string_ref();
+    }
+
+    // O primeiro formato sai no próprio tópico; os outros em "<tópico>/<formato>"
+    mqtt::string_ref formatTopic(const mqtt::string_ref& topic, OutputFormat format, size_t index) {
+        if (index == 0) return topic;
+        thread_local std::string key;
+        key.assign(topic.str());
+        key += '/';
+        key += outputFormatInfo(format).Name;
+        return topics_.intern(key);
+    }
+
+    // Frame JSON de qualquer origem; inválido vai para reject()
+    template <typename Msg>
+    void handleCanJson(const RoutingSnapshot& routing, const mqtt::message& msg, const RouteRule& rule,
+                       const mqtt::string_ref& routeTarget, std::string_view vehicle, int64_t arrivalNs) {
+        Msg canMsg;
+        ParseStatus status = parseCanJson(msg.get_payload(), canMsg);
+        if (!status.ok()) {
+            reject(msg, status, &CanSourceTraits<Msg>::Keys);
+            return;
+        }
+        handleCanMessage(routing, canMsg, rule, routeTarget, vehicle, arrivalNs);
+    }
+
+    // Frame binário de qualquer origem; inválido vai para reject()
+    template <typename Msg>
+    void handleCanFrame(const RoutingSnapshot& routing, const mqtt::message& msg, const RouteRule& rule,
+                        const mqtt::string_ref& routeTarget, std::string_view vehicle, int64_t arrivalNs) {
+        CanFrame frame;
+        ParseStatus status = decodeCanFrame(msg.get_payload(), frame);
+        if (!status.ok()) {
+            reject(msg, status, nullptr);
+            return;
+        }
+        handleCanMessage(routing, frameToMessage<Msg>(frame), rule, routeTarget, vehicle, arrivalNs);
+    }
+
+    // Entrada inválida: na contagem sempre, com o mesmo custo de uma válida;
+    // log e dead-letter só de uma a cada SampleEvery (o texto do erro só
+    // existe nessas). keys = nullptr para os frames binários.
+    void reject(const mqtt::message& msg, const ParseStatus& status, const CanJsonKeys* keys) {
+        metrics().count(keys ? Counter::ParseErrors : Counter::InvalidFrames);
+        metrics().countParseError(status.Error);
+        thread_local uint32_t rejected = 0;
+        uint32_t every = std::max<uint32_t>(deadLetter_.SampleEvery, 1);
+        if (rejected++ % every != 0) return;
+
+        std::string_view topic = msg.get_topic();
+        std::string detail = describeParseError(status, keys);
+        LOG_WARN((keys ? "Mensagem inválida em " : "Frame binário inválido em ") << topic << ": " << detail
+                 << (every > 1 ? " (amostra de 1 a cada " + std::to_string(every) + ")" : std::string()));
+        if (deadLetter_.Prefix.empty()) return;
+
+        // {"topic":...,"error":...,"detail":...,"offset":N,"payload":... ou "payload_hex":...}
+        std::string_view payload = msg.get_payload();
+        JsonWriter &w = threadJsonWriter();
+        w.raw('{');
+        w.key("topic");
+        w.string(topic);
+        w.raw(',');
+        w.key("error");
+        w.string(parseErrorName(status.Error));
+        w.raw(',');
+        w.key("detail");
+        w.string(detail);
+        if (status.Offset != PARSE_NO_OFFSET) {
+            w.raw(',');
+            w.key("offset");
+            w.integer(static_cast<long long>(status.Offset));
+        }
+        w.raw(',');
+        // Texto como veio; binário ou UTF-8 inválido em hexadecimal
+        if (keys && isValidUtf8(payload)) {
+            w.key("payload");
+            w.string(payload);
+        } else {
+            static const char hex[] = "0123456789abcdef";
+            std::string text;
+            text.reserve(payload.size() * 2);
+            for (unsigned char c : payload) {
+                text.push_back(hex[c >> 4]);
+                text.push_back(hex[c & 0xF]);
+            }
+            w.key("payload_hex");
+            w.string(text);
+        }
+        w.raw('}');
+
+        thread_local std::string key;
+        key.assign(deadLetter_.Prefix);
+        key.append(topic.data(), topic.size());
+        Delivery delivery;
+        delivery.Retained = false;
+        publisher_.publish(topics_.intern(key), w.view(), 0, PriorityLane::Normal, delivery);
+        metrics().count(Counter::DeadLettered);
+    }
+
+    // Converte um frame (real ou do simulador) e publica no tópico da rota
+    // ou, sem ele, no do decoder do ArbitrationId
+    template <typename Msg>
+    void handleCanMessage(const RoutingSnapshot& routing, const Msg& canMsg, const RouteRule& rule,
+                          const mqtt::string_ref& routeTarget, std::string_view vehicle, int64_t arrivalNs) {
+        logCanData(canMsg.CAN_Message);
+
+        // Converter para JSON final
+        uint32_t arb = static_cast<uint32_t>(canMsg.CAN_Message.ArbitrationId);
+        countArbitrationId(routing.decoders(), arb);
+        const CanDecoder &decoder = routing.decoders().resolve(arb, canMsg.AlgorithmID.view());
+        // Uma decodificação só, para a fusão, o dedup e a conversão
+        const SensorReading reading = decodeReading(decoder, canMsg.CAN_Message);
+        if (FusionTable* fusion = routing.fusion()) {
+            fusion->update(vehicle, decoder, canMsg.AlgorithmID.view(), reading, arrivalNs);
+            if (fusion_.Only) return;
+        }
+        if (!changed(routing, CanSourceTraits<Msg>::Source, canMsg.CAN_Message, reading)) return;
+        auto jsonMsg = convertCanMessage(canMsg, decoder, reading);
+        const Delivery delivery = resolveDelivery(rule.Delivery.over(decoder.Delivery), adaptiveQos_);
+
+        // Verificar se há um tópico de saída
+        mqtt::string_ref targetTopic = outputTopic(routeTarget, decoder);
+        for (uint8_t i = 0; i < delivery.Formats.Count; ++i) {
+            OutputFormat format = delivery.Formats.List[i];
+            if (format == OutputFormat::Json) {
+                JsonWriter &outPayload = threadJsonWriter();
+                writeJsonMessage(outPayload, jsonMsg);
+                if (!targetTopic) continue;
+                publisher_.publishReading(formatTopic(targetTopic, format, i), outPayload.view(), arrivalNs,
+                                          decoder.Lane, delivery);
+            } else {
+                // Binários não entram na agregação (o lote é um array JSON)
+                std::string_view payload = encodeBinaryReading(format, jsonMsg, arb);
+                if (!targetTopic) continue;
+                Delivery binary = delivery;
+                binary.ContentType = outputFormatInfo(format).ContentType;
+                binary.Utf8 = false;
+                publisher_.publish(formatTopic(targetTopic, format, i), payload, arrivalNs, decoder.Lane, binary);
+            }
+        }
+        if (targetTopic) {
+            LOG_DEBUG("Mensagem redirecionada para o tópico " << targetTopic.str());
+        } else {
+            LOG_DEBUG("ArbitrationId não mapeado para tópico específico.");
+        }
+    }
+};
+
+/* -----------------------------------------------------------------------
+   Laço de eventos do processo (Linux: epoll).
+   Temporizadores (timerfd), sinais (signalfd) e tarefas postadas de
+   outros threads (eventfd) são atendidos num único thread, o que chamou
+   run(). Os sinais tratados precisam estar bloqueados em todos os threads
+   (blockSignals antes de criar os outros), senão a ação padrão vence.
+   -----------------------------------------------------------------------*/
+class EventLoop {
+public:
+    using Handler = std::function<void()>;
+
+    // Lança std::runtime_error se não conseguir criar os descritores
+    EventLoop() {
+        epoll_ = ::epoll_create1(EPOLL_CLOEXEC);
+        wake_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_ < 0 || wake_ < 0) {
+            closeFds();
+            throw std::runtime_error(std::string("event loop: ") + std::strerror(errno));
+        }
+        watch(wake_, Source::Kind::Wake, nullptr);
+    }
+
+    ~EventLoop() { closeFds(); }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Bloqueia os sinais no thread atual (e nos que ele criar depois)
+    static void blockSignals(std::initializer_list<int> signals) {
+        sigset_t set;
+        sigemptyset(&set);
+        for (int s : signals) sigaddset(&set, s);
+        ::pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    }
+
+    // Devolve a ação padrão dos sinais (ex.: um segundo SIGTERM encerra na hora)
+    static void unblockSignals(std::initializer_list<int> signals) {
+        sigset_t set;
+        sigemptyset(&set);
+        for (int s : signals) sigaddset(&set, s);
+        ::pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+    }
+
+    // fn a cada intervalo, a partir de agora + intervalo
+    void every(std::chrono::milliseconds interval, Handler fn) {
+        int fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) throw std::runtime_error(std::string("event loop: timerfd: ") + std::strerror(errno));
+        itimerspec spec{};
+        spec.it_interval.tv_sec = static_cast<time_t>(interval.count() / 1000);
+        spec.it_interval.tv_nsec = static_cast<long>((interval.count() % 1000) * 1000000);
+        spec.it_value = spec.it_interval;
+        ::timerfd_settime(fd, 0, &spec, nullptr);
+        watch(fd, Source::Kind::Timer, std::move(fn));
+    }
+
+    // fn quando o sinal chegar (o sinal já deve estar bloqueado)
+    void onSignal(int signo, Handler fn) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, signo);
+        int fd = ::signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd < 0) throw std::runtime_error(std::string("event loop: signalfd: ") + std::strerror(errno));
+        watch(fd, Source::Kind::Signal, std::move(fn));
+    }
+
+    // Executa fn no thread do laço (qualquer thread pode chamar)
+    void post(Handler fn) {
+        {
+            std::lock_guard<std::mutex> lock(postedMutex_);
+            posted_.push_back(std::move(fn));
+        }
+        wakeUp();
+    }
+
+    // Faz run() retornar depois do evento atual (qualquer thread pode chamar)
+    void stop() {
+        running_.store(false);
+        wakeUp();
+    }
+
+    void run() {
+        epoll_event events[16];
+        while (running_.load()) {
+            int n = ::epoll_wait(epoll_, events, 16, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                LOG_ERROR("epoll_wait falhou: " << std::strerror(errno));
+                return;
+            }
+            for (int i = 0; i < n && running_.load(); ++i) {
+                dispatch(*static_cast<Source*>(events[i].data.ptr));
+            }
+        }
+    }
+
+private:
+    struct Source {
+        enum class Kind { Wake, Timer, Signal };
+        int Fd;
+        Kind Type;
+        Handler Fn;
+    };
+
+    void watch(int fd, Source::Kind kind, Handler fn) {
+        sources_.emplace_back(new Source{fd, kind, std::move(fn)});
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = sources_.back().get();
+        if (::epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            throw std::runtime_error(std::string("event loop: epoll_ctl: ") + std::strerror(errno));
+        }
+    }
+
+    // Esvazia o descritor (timerfd/eventfd/signalfd) e chama o handler
+    void dispatch(Source& src) {
+        switch (src.Type) {
+        case Source::Kind::Wake: {
+            uint64_t count;
+            while (::read(src.Fd, &count, sizeof(count)) > 0) {}
+            std::vector<Handler> tasks;
+            {
+                std::lock_guard<std::mutex> lock(postedMutex_);
+                tasks.swap(posted_);
+            }
+            for (auto &task : tasks) task();
+            break;
+        }
+        case Source::Kind::Timer: {
+            uint64_t expirations;
+            if (::read(src.Fd, &expirations, sizeof(expirations)) > 0) src.Fn();   // atrasos viram uma só chamada
+            break;
+        }
+        case Source::Kind::Signal: {
+            signalfd_siginfo info;
+            bool fired = false;
+            while (::read(src.Fd, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info))) fired = true;
+            if (fired) src.Fn();
+            break;
+        }
+        }
+    }
+
+    void wakeUp() {
+        uint64_t one = 1;
+        if (::write(wake_, &one, sizeof(one)) < 0) {}   // cheio: já há um despertar pendente
+    }
+
+    void closeFds() {
+        for (auto &src : sources_) if (src->Fd != wake_) ::close(src->Fd);
+        if (wake_ >= 0) ::close(wake_);
+        if (epoll_ >= 0) ::close(epoll_);
+    }
+
+    int epoll_ = -1;
+    int wake_ = -1;
+    std::vector<std::unique_ptr<Source>> sources_;
+    std::atomic<bool> running_{true};
+    std::mutex postedMutex_;
+    std::vector<Handler> posted_;
+};
+
+/* -----------------------------------------------------------------------
+   Reconexão com espera exponencial.
+   A sessão é limpa e o Paho não reconecta sozinho, então uma queda da
+   conexão chega pelo connection_lost e a reconexão fica com um thread
+   por conexão. A espera dobra a cada tentativa, do mínimo até o teto, e
+   é sorteada entre a metade e o valor cheio, para os shards (e outras
+   instâncias) não voltarem todos no mesmo instante. A tentativa é do
+   main: conecta, lê o CONNACK e refaz as assinaturas; se lançar, conta
+   como falha.
+   -----------------------------------------------------------------------*/
+struct ReconnectOptions {
+    std::chrono::milliseconds MinDelay{500};
+    std::chrono::milliseconds MaxDelay{30000};
+    std::chrono::milliseconds ConnectTimeout{10000};   // de cada tentativa (e da conexão inicial)
+};
+
+class ConnectionSupervisor {
+public:
+    using Attempt = std::function<void()>;
+
+    ConnectionSupervisor(std::string name, const ReconnectOptions& opts, Attempt attempt)
+        : name_(std::move(name)), opts_(opts), attempt_(std::move(attempt)), rng_(std::random_device()())
+    {
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~ConnectionSupervisor() { stop(); }
+
+    ConnectionSupervisor(const ConnectionSupervisor&) = delete;
+    ConnectionSupervisor& operator=(const ConnectionSupervisor&) = delete;
+
+    // Qualquer thread (o connection_lost do Paho): agenda a reconexão
+    void connectionLost() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            lost_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    // Desiste da tentativa em espera; uma em andamento termina antes
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+private:
+    // Espera antes da tentativa (0 = a primeira)
+    std::chrono::milliseconds delayOf(unsigned attempt) {
+        int64_t ceiling = std::max<int64_t>(1, opts_.MaxDelay.count());
+        int64_t full = std::max<int64_t>(1, opts_.MinDelay.count());
+        for (unsigned i = 0; i < attempt && full < ceiling; ++i) full *= 2;
+        full = std::min(full, ceiling);
+        return std::chrono::milliseconds(std::uniform_int_distribution<int64_t>(full / 2, full)(rng_));
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            cv_.wait(lock, [this] { return lost_ || stopping_; });
+            if (stopping_) return;
+            lost_ = false;
+            auto lostAt = std::chrono::steady_clock::now();
+            for (unsigned attempt = 0; ; ++attempt) {
+                auto delay = delayOf(attempt);
+                if (cv_.wait_for(lock, delay, [this] { return stopping_; })) return;
+                lock.unlock();
+                bool ok = false;
+                std::string error;
+                try {
+                    attempt_();
+                    ok = true;
+                }
+                catch (const std::exception &ex) {
+                    error = ex.what();
+                }
+                lock.lock();
+                if (ok) {
+                    metrics().count(Counter::Reconnects);
+                    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - lostAt).count();
+                    LOG_INFO(name_ << ": reconectado após " << secs << " s (" << attempt + 1 << " tentativa(s)).");
+                    break;
+                }
+                LOG_WARN(name_ << ": tentativa " << attempt + 1 << " de reconexão falhou (" << error << ").");
+            }
+        }
+    }
+
+    std::string name_;
+    ReconnectOptions opts_;
+    Attempt attempt_;
+    std::mt19937_64 rng_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool lost_ = false;
+    bool stopping_ = false;
+};
+
+/* -----------------------------------------------------------------------
+   Arquivo de configuração (--config arquivo.json). Todas as seções são
+   opcionais; o que faltar fica com o padrão, e as opções da linha de
+   comando valem sobre o arquivo:
+     {
+       "connection": {"address": "tcp://172.20.0.14:1884", "client_id": "CppBroker",
+                      "shards": 1, "share_group": "cppbroker", "mqtt_version": 5,
+                      "reconnect_min_ms": 500, "reconnect_max_ms": 30000},
+       "pipeline":   {"workers": 4, "queue_size": 1024, "publish_queue_size": 8192,
+                      "max_inflight": 256, "adaptive_qos": false, "aggregate": 0,
+                      "aggregate_interval_ms": 100, "topic_aliases": 32, "payload_format": true},
+       "fusion":     {"interval_ms": 200, "window_ms": 1000, "topic": "simsensor/fused",
+                      "only": false},
+       "affinity":   {"io": "2", "workers": "4-7", "publisher": "3", "background": "0-1"},
+       "spool":      {"path": "/var/spool/cppbroker.spool", "size_mb": 64, "drain_rate": 1000,
+                      "drain_batch": 64},
+       "dead_letter": {"prefix": "dead-letter/", "sample": 100},
+       "routes":     [{"pattern": "sim/#", "handler": "passthrough", "target": "moto/#",
+                       "qos": 1, "retained": true, "adaptive_qos": true}, ...],
+       "decoders":   [{"arbitration_id": "0x101", "topic": "simsensor/pedestrian", ...}, ...]
+     }
+   "routes" e "decoders" substituem as tabelas padrão e são compilados na
+   carga (trie de rotas, índice direto de decoders). "qos", "retained",
+   "adaptive_qos", "expiry_s" e "format" de uma rota valem sobre os do
+   decoder. No SIGHUP o arquivo
+   é lido de novo e só as tabelas são trocadas; conexão, pipeline,
+   fusão, afinidade, spool e dead-letter precisam de reinício.
+   -----------------------------------------------------------------------*/
+struct BrokerConfig {
+    std::string Address  = "tcp://172.20.0.14:1884";
+    std::string ClientId = "CppBroker";
+    size_t Shards = 1;
+    std::string ShareGroup = "cppbroker";
+    int MqttVersion = 5;       // 3 = 3.1.1: sem aliases, propriedades nem shards
+    ReconnectOptions Reconnect;
+    bool WorkersSet = false;   // sem "workers", os núcleos são divididos entre os shards
+    PipelineOptions Pipeline;
+    std::vector<RouteRule> Routes = RouteTable::defaultRules();
+    std::shared_ptr<const DecoderTable> Decoders;   // nulo = defaultDecoderTable()
+};
+
+inline json readJsonFile(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("não foi possível abrir " + path);
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return json::parse(text);
+}
+
+// Chaves fora da lista são erro: um nome digitado errado não deve virar
+// silenciosamente o valor padrão.
+inline void checkConfigKeys(const json& section, const std::string& name,
+                            std::initializer_list<const char*> known) {
+    if (!section.is_object()) throw std::invalid_argument("config: \"" + name + "\" deve ser um objeto");
+    for (const auto &item : section.items()) {
+        bool found = std::any_of(known.begin(), known.end(), [&](const char* k) { return item.key() == k; });
+        if (!found) throw std::invalid_argument("config: chave desconhecida \"" + name + "." + item.key() + "\"");
+    }
+}
+
+// Aplica o JSON sobre cfg. Lança std::invalid_argument (ou o erro de tipo
+// da nlohmann); os padrões das rotas só são verificados em compileRouting.
+inline void applyConfig(const json& j, BrokerConfig& cfg) {
+    checkConfigKeys(j, "(raiz)", {"connection", "pipeline", "fusion", "affinity", "spool", "dead_letter",
+                                "routes", "decoders"});
+
+    if (j.contains("connection")) {
+        const json &c = j.at("connection");
+        checkConfigKeys(c, "connection", {"address", "client_id", "shards", "share_group", "mqtt_version",
+                                          "reconnect_min_ms", "reconnect_max_ms"});
+        cfg.Address    = c.value("address", cfg.Address);
+        cfg.ClientId   = c.value("client_id", cfg.ClientId);
+        cfg.Shards     = std::max<size_t>(1, c.value("shards", cfg.Shards));
+        cfg.ShareGroup = c.value("share_group", cfg.ShareGroup);
+        cfg.MqttVersion = c.value("mqtt_version", cfg.MqttVersion);
+        if (cfg.MqttVersion != 3 && cfg.MqttVersion != 5) {
+            throw std::invalid_argument("config: \"connection.mqtt_version\" deve ser 3 ou 5");
+        }
+        ReconnectOptions &reconnect = cfg.Reconnect;
+        if (c.contains("reconnect_min_ms")) {
+            reconnect.MinDelay = std::chrono::milliseconds(std::max<long>(1, c.at("reconnect_min_ms").get<long>()));
+        }
+        if (c.contains("reconnect_max_ms")) {
+            reconnect.MaxDelay = std::chrono::milliseconds(std::max<long>(1, c.at("reconnect_max_ms").get<long>()));
+        }
+        if (reconnect.MaxDelay < reconnect.MinDelay) {
+            throw std::invalid_argument("config: \"connection.reconnect_max_ms\" menor que \"reconnect_min_ms\"");
+        }
+    }
+
+    if (j.contains("pipeline")) {
+        const json &p = j.at("pipeline");
+        checkConfigKeys(p, "pipeline", {"workers", "queue_size", "publish_queue_size", "max_inflight",
+                                        "adaptive_qos", "aggregate", "aggregate_interval_ms",
+                                        "topic_aliases", "payload_format"});
+        PipelineOptions &opts = cfg.Pipeline;
+        if (p.contains("workers")) {
+            opts.Workers = p.at("workers").get<size_t>();
+            cfg.WorkersSet = true;
+        }
+        opts.QueueCapacity = std::max<size_t>(2, p.value("queue_size", opts.QueueCapacity));
+        opts.Publisher.QueueCapacity = std::max<size_t>(2, p.value("publish_queue_size", opts.Publisher.QueueCapacity));
+        opts.Publisher.MaxInFlight = std::max<size_t>(1, p.value("max_inflight", opts.Publisher.MaxInFlight));
+        opts.Publisher.AdaptiveQos = p.value("adaptive_qos", opts.Publisher.AdaptiveQos);
+        opts.Publisher.TopicAliases = p.value("topic_aliases", opts.Publisher.TopicAliases);
+        opts.Publisher.PayloadFormat = p.value("payload_format", opts.Publisher.PayloadFormat);
+        opts.Publisher.AggregateReadings = p.value("aggregate", opts.Publisher.AggregateReadings);
+        if (p.contains("aggregate_interval_ms")) {
+            opts.Publisher.AggregateInterval =
+                std::chrono::milliseconds(std::max<long>(1, p.at("aggregate_interval_ms").get<long>()));
+        }
+    }
+
+    if (j.contains("fusion")) {
+        const json &f = j.at("fusion");
+        checkConfigKeys(f, "fusion", {"interval_ms", "window_ms", "topic", "only"});
+        FusionOptions &fusion = cfg.Pipeline.Fusion;
+        if (f.contains("interval_ms")) {
+            fusion.Interval = std::chrono::milliseconds(std::max<long>(0, f.at("interval_ms").get<long>()));
+        }
+        if (f.contains("window_ms")) {
+            fusion.Window = std::chrono::milliseconds(std::max<long>(1, f.at("window_ms").get<long>()));
+        }
+        fusion.Topic = f.value("topic", fusion.Topic);
+        fusion.Only  = f.value("only", fusion.Only);
+        if (fusion.Topic.empty()) throw std::invalid_argument("config: \"fusion.topic\" vazio");
+    }
+
+    if (j.contains("affinity")) {
+        const json &a = j.at("affinity");
+        checkConfigKeys(a, "affinity", {"io", "workers", "publisher", "background"});
+        AffinityOptions &affinity = cfg.Pipeline.Affinity;
+        auto cpus = [&](const char* key, CpuSet& out) {
+            if (!a.contains(key)) return;
+            if (!CpuSet::parse(a.at(key).get<std::string>(), out)) {
+                throw std::invalid_argument(std::string("config: lista de CPUs inválida em \"affinity.") + key + "\"");
+            }
+        };
+        cpus("io", affinity.Io);
+        cpus("workers", affinity.Workers);
+        cpus("publisher", affinity.Publisher);
+        cpus("background", affinity.Background);
+    }
+
+    if (j.contains("spool")) {
+        const json &sp = j.at("spool");
+        checkConfigKeys(sp, "spool", {"path", "size_mb", "drain_rate", "drain_batch"});
+        SpoolOptions &spool = cfg.Pipeline.Publisher.Spool;
+        spool.Path = sp.value("path", spool.Path);
+        if (sp.contains("size_mb")) spool.Bytes = std::max<size_t>(1, sp.at("size_mb").get<size_t>()) << 20;
+        spool.DrainRate = std::max(0.0, sp.value("drain_rate", spool.DrainRate));
+        spool.DrainBatch = std::max<size_t>(1, sp.value("drain_batch", spool.DrainBatch));
+    }
+
+    if (j.contains("dead_letter")) {
+        const json &d = j.at("dead_letter");
+        checkConfigKeys(d, "dead_letter", {"prefix", "sample"});
+        DeadLetterOptions &deadLetter = cfg.Pipeline.DeadLetter;
+        deadLetter.Prefix = d.value("prefix", deadLetter.Prefix);
+        deadLetter.SampleEvery = std::max<uint32_t>(1, d.value("sample", deadLetter.SampleEvery));
+    }
+
+    // Lê as duas tabelas antes de trocar qualquer uma
+    std::vector<RouteRule> routes = j.contains("routes") ? RouteTable::parseRules(j.at("routes")) : cfg.Routes;
+    std::shared_ptr<const DecoderTable> decoders = cfg.Decoders;
+    if (j.contains("decoders")) {
+        decoders = std::make_shared<const DecoderTable>(DecoderTable::parseDecoders(j.at("decoders")));
+    }
+    cfg.Routes = std::move(routes);
+    cfg.Decoders = std::move(decoders);
+}
+
+// Seções do arquivo que só valem ao reiniciar (tudo menos "routes" e
+// "decoders") e que mudaram entre duas leituras, como "a", "b"
+inline std::string restartOnlyChanges(const json& before, const json& after) {
+    std::string changed;
+    for (const char* section : {"connection", "pipeline", "fusion", "affinity", "spool", "dead_letter"}) {
+        auto value = [&](const json& j) { return j.is_object() && j.contains(section) ? j.at(section) : json(); };
+        if (value(before) == value(after)) continue;
+        if (!changed.empty()) changed += ", ";
+        changed += '"' + std::string(section) + '"';
+    }
+    return changed;
+}
+
+// Tabelas prontas para o pipeline. Lança std::invalid_argument.
+inline RoutingTables compileRouting(const BrokerConfig& cfg) {
+    RoutingTables tables;
+    tables.Routes = std::make_shared<const RouteTable>(cfg.Routes);
+    if (cfg.Decoders) {
+        tables.Decoders = cfg.Decoders;
+    } else {
+        tables.Decoders = std::shared_ptr<const DecoderTable>(&defaultDecoderTable(), [](const DecoderTable*) {});
+    }
+    return tables;
+}
+
+// Alguma rota ou decoder com expiração de mensagem (exige MQTT 5)
+inline bool usesMessageExpiry(const RoutingTables& tables) {
+    for (size_t i = 0; i < tables.Routes->size(); ++i) {
+        if (tables.Routes->at(i).Rule.Delivery.usesExpiry()) return true;
+    }
+    for (size_t i = 0; i < tables.Decoders->size(); ++i) {
+        if (tables.Decoders->at(static_cast<uint16_t>(i)).Delivery.usesExpiry()) return true;
+    }
+    return false;
+}
+
+#ifndef BROKER_NO_MAIN   // bench.cpp inclui este arquivo sem o main()
+/* -----------------------------------------------------------------------
+   main(): Conecta ao broker Mosquitto, assina nos tópicos, e processa
+   mensagens via callback. O thread principal fica no EventLoop (métricas,
+   SIGHUP recarrega as rotas e os decoders, SIGTERM/SIGINT encerram com
+   as filas esvaziadas e as publicações confirmadas).
+   -----------------------------------------------------------------------*/
+// Rotas e decoders do arquivo de configuração e do --routes; o JSON lido
+// fica em raw
+static RoutingTables loadRouting(const std::string& configFile, const std::string& routesFile,
+                                 BrokerConfig& cfg, json& raw) {
+    if (!configFile.empty()) {
+        raw = readJsonFile(configFile);
+        applyConfig(raw, cfg);
+    }
+    if (!routesFile.empty()) cfg.Routes = RouteTable::parseRules(readJsonFile(routesFile));
+    return compileRouting(cfg);
+}
+
+int main(int argc, char* argv[]) {
+    // Antes de qualquer thread (logger, workers, Paho): só o laço de
+    // eventos recebe estes sinais
+    EventLoop::blockSignals({SIGTERM, SIGINT, SIGHUP});
+
+    // O arquivo vem antes das demais opções, que valem sobre ele
+    std::string configFile;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) == "--config") configFile = argv[i + 1];
+    }
+    BrokerConfig cfg;
+    json fileJson;   // o arquivo como foi lido, sem as opções da linha de comando
+    try {
+        if (!configFile.empty()) {
+            fileJson = readJsonFile(configFile);
+            applyConfig(fileJson, cfg);
+        }
+    }
+    catch (const std::exception &ex) {
+        std::cerr << "Configuração inválida em " << configFile << ": " << ex.what() << std::endl;
+        return 1;
+    }
+
+    // Endereço do broker local (Mosquitto rodando em 1883)
+    const std::string &address  = cfg.Address;
+    const std::string &clientId = cfg.ClientId;
+
+    PipelineOptions &pipelineOpts = cfg.Pipeline;
+    std::string routesFile;
+    size_t &shardCount = cfg.Shards;
+    std::string &shareGroup = cfg.ShareGroup;
+    bool &workersSet = cfg.WorkersSet;
+    size_t rateBacklog = RateLimit().Backlog;
+    std::vector<std::string> replayPaths;
+    double replaySpeed = 1.0;
+    std::chrono::milliseconds shutdownTimeout = std::chrono::seconds(10);
+    LogLevel logLevel = LogLevel::Info;   // aplicado depois da afinidade (cria o thread do log)
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--config" && i + 1 < argc) {
+            ++i;   // já carregado
+        } else if (arg == "--workers" && i + 1 < argc) {
+            pipelineOpts.Workers = std::strtoul(argv[++i], nullptr, 10);
+            workersSet = true;
+        } else if (arg == "--mqtt-version" && i + 1 < argc) {
+            cfg.MqttVersion = std::atoi(argv[++i]);
+            if (cfg.MqttVersion != 3 && cfg.MqttVersion != 5) {
+                std::cerr << "Versão MQTT inválida: " << argv[i] << " (3 ou 5)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--topic-aliases" && i + 1 < argc) {
+            pipelineOpts.Publisher.TopicAliases = static_cast<uint16_t>(std::min(65535ul, std::strtoul(argv[++i], nullptr, 10)));
+        } else if (arg == "--no-payload-format") {
+            pipelineOpts.Publisher.PayloadFormat = false;
+        } else if (arg == "--reconnect-min" && i + 1 < argc) {
+            cfg.Reconnect.MinDelay = std::chrono::milliseconds(std::max(1ul, std::strtoul(argv[++i], nullptr, 10)));
+        } else if (arg == "--reconnect-max" && i + 1 < argc) {
+            cfg.Reconnect.MaxDelay = std::chrono::milliseconds(std::max(1ul, std::strtoul(argv[++i], nullptr, 10)));
+        } else if (arg == "--spool" && i + 1 < argc) {
+            pipelineOpts.Publisher.Spool.Path = argv[++i];
+        } else if (arg == "--spool-mb" && i + 1 < argc) {
+            pipelineOpts.Publisher.Spool.Bytes = std::max(1ul, std::strtoul(argv[++i], nullptr, 10)) << 20;
+        } else if (arg == "--spool-drain-rate" && i + 1 < argc) {
+            pipelineOpts.Publisher.Spool.DrainRate = std::max(0.0, std::strtod(argv[++i], nullptr));
+        } else if (arg == "--spool-drain-batch" && i + 1 < argc) {
+            pipelineOpts.Publisher.Spool.DrainBatch = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--dead-letter-prefix" && i + 1 < argc) {
+            pipelineOpts.DeadLetter.Prefix = argv[++i];
+        } else if (arg == "--dead-letter-sample" && i + 1 < argc) {
+            pipelineOpts.DeadLetter.SampleEvery =
+                static_cast<uint32_t>(std::min(4294967295ul, std::max(1ul, std::strtoul(argv[++i], nullptr, 10))));
+        } else if (arg == "--shards" && i + 1 < argc) {
+            shardCount = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--share-group" && i + 1 < argc) {
+            shareGroup = argv[++i];
+        } else if ((arg == "--rate-limit" || arg == "--global-rate") && i + 1 < argc) {
+            RateLimit limit;
+            if (!parseRateLimit(argv[++i], arg == "--global-rate", limit)) {
+                std::cerr << "Limite de taxa inválido: " << argv[i] << std::endl;
+                return 1;
+            }
+            limit.Backlog = rateBacklog;
+            if (arg == "--global-rate") pipelineOpts.Publisher.GlobalLimit = limit;
+            else pipelineOpts.Publisher.TopicLimits.push_back(limit);
+        } else if (arg == "--rate-backlog" && i + 1 < argc) {
+            rateBacklog = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+            pipelineOpts.Publisher.GlobalLimit.Backlog = rateBacklog;
+            for (auto &limit : pipelineOpts.Publisher.TopicLimits) limit.Backlog = rateBacklog;
+        } else if (arg == "--dedup") {
+            pipelineOpts.Dedup.Enabled = true;
+        } else if (arg == "--dedup-heartbeat" && i + 1 < argc) {
+            pipelineOpts.Dedup.Heartbeat = std::chrono::milliseconds(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--dedup-deadband" && i + 1 < argc) {
+            pipelineOpts.Dedup.DistanceDeadband = std::max(0.0, std::strtod(argv[++i], nullptr));
+        } else if (arg == "--fusion" && i + 1 < argc) {
+            pipelineOpts.Fusion.Interval = std::chrono::milliseconds(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--fusion-window" && i + 1 < argc) {
+            pipelineOpts.Fusion.Window = std::chrono::milliseconds(std::max(1ul, std::strtoul(argv[++i], nullptr, 10)));
+        } else if (arg == "--fusion-topic" && i + 1 < argc) {
+            pipelineOpts.Fusion.Topic = argv[++i];
+        } else if (arg == "--fusion-only") {
+            pipelineOpts.Fusion.Only = true;
+        } else if ((arg == "--cpu-io" || arg == "--cpu-workers" || arg == "--cpu-publisher" ||
+                    arg == "--cpu-background") && i + 1 < argc) {
+            AffinityOptions &affinity = pipelineOpts.Affinity;
+            CpuSet &cpus = arg == "--cpu-io" ? affinity.Io
+                         : arg == "--cpu-workers" ? affinity.Workers
+                         : arg == "--cpu-publisher" ? affinity.Publisher : affinity.Background;
+            if (!CpuSet::parse(argv[++i], cpus)) {
+                std::cerr << "Lista de CPUs inválida: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--queue-size" && i + 1 < argc) {
+            pipelineOpts.QueueCapacity = std::max(2ul, std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--max-inflight" && i + 1 < argc) {
+            pipelineOpts.Publisher.MaxInFlight = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--aggregate" && i + 1 < argc) {
+            pipelineOpts.Publisher.AggregateReadings = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--adaptive-qos") {
+            pipelineOpts.Publisher.AdaptiveQos = true;
+        } else if (arg == "--aggregate-interval" && i + 1 < argc) {
+            pipelineOpts.Publisher.AggregateInterval =
+                std::chrono::milliseconds(std::max(1ul, std::strtoul(argv[++i], nullptr, 10)));
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            if (!AsyncLogger::parseLevel(argv[++i], logLevel)) {
+                std::cerr << "Nível de log inválido: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--timestamp-precision" && i + 1 < argc) {
+            std::string p = argv[++i];
+            if (p == "s")       timestampService().setPrecision(TimestampPrecision::Seconds);
+            else if (p == "ms") timestampService().setPrecision(TimestampPrecision::Millis);
+            else if (p == "us") timestampService().setPrecision(TimestampPrecision::Micros);
+            else {
+                std::cerr << "Precisão de timestamp inválida: " << p << std::endl;
+                return 1;
+            }
+        } else if (arg == "--timestamp-source" && i + 1 < argc) {
+            std::string src = argv[++i];
+            if (src != "frame" && src != "local") {
+                std::cerr << "Origem de timestamp inválida: " << src << std::endl;
+                return 1;
+            }
+            timestampService().setUseSourceTimestamp(src == "frame");
+        } else if (arg == "--routes" && i + 1 < argc) {
+            routesFile = argv[++i];
+        } else if (arg == "--metrics-interval" && i + 1 < argc) {
+            pipelineOpts.Metrics.Interval = std::chrono::seconds(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--metrics-topic" && i + 1 < argc) {
+            pipelineOpts.Metrics.Topic = argv[++i];
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            pipelineOpts.Metrics.HttpPort = std::atoi(argv[++i]);
+        } else if (arg == "--shutdown-timeout" && i + 1 < argc) {
+            shutdownTimeout = std::chrono::seconds(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--capture" && i + 1 < argc) {
+            pipelineOpts.Capture.Prefix = argv[++i];
+        } else if (arg == "--capture-segment-mb" && i + 1 < argc) {
+            pipelineOpts.Capture.SegmentBytes = std::max(1ul, std::strtoul(argv[++i], nullptr, 10)) << 20;
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayPaths.push_back(argv[++i]);
+        } else if (arg == "--replay-speed" && i + 1 < argc) {
+            std::string speed = argv[++i];
+            replaySpeed = (speed == "max") ? 0.0 : std::max(0.0, std::strtod(speed.c_str(), nullptr));
+        } else if (arg == "--high-priority-slo" && i + 1 < argc) {
+            pipelineOpts.Metrics.HighPrioritySlo = std::chrono::milliseconds(std::strtoul(argv[++i], nullptr, 10));
+        } else {
+            std::cerr << "Opção desconhecida: " << arg << "\n"
+                      << "Uso: " << argv[0] << " [--config arquivo.json] [--workers N] [--queue-size N]"
+                      << " [--timestamp-precision s|ms|us] [--timestamp-source frame|local]"
+                      << " [--max-inflight N] [--adaptive-qos] [--aggregate N] [--aggregate-interval MS]"
+                      << " [--log-level error|warn|info|debug|trace]"
+                      << " [--routes arquivo.json]"
+                      << " [--metrics-interval S] [--metrics-topic T] [--metrics-port N]"
+                      << " [--high-priority-slo MS]"
+                      << " [--shards K] [--share-group G]"
+                      << " [--mqtt-version 3|5] [--topic-aliases N] [--no-payload-format]"
+                      << " [--reconnect-min MS] [--reconnect-max MS]"
+                      << " [--spool ARQUIVO] [--spool-mb N] [--spool-drain-rate N] [--spool-drain-batch N]"
+                      << " [--dead-letter-prefix P] [--dead-letter-sample N]"
+                      << " [--dedup] [--dedup-heartbeat MS] [--dedup-deadband D]"
+                      << " [--fusion MS] [--fusion-window MS] [--fusion-topic T] [--fusion-only]"
+                      << " [--cpu-io L] [--cpu-workers L] [--cpu-publisher L] [--cpu-background L]"
+                      << " [--rate-limit F=T[:B[:P]]] [--global-rate T[:B[:P]]] [--rate-backlog N]"
+                      << " [--capture PREFIXO] [--capture-segment-mb N]"
+                      << " [--replay ARQUIVO|PREFIXO]... [--replay-speed X|max]"
+                      << " [--shutdown-timeout S]"
+                      << std::endl;
+            return 1;
+        }
+    }
+    if (cfg.Reconnect.MaxDelay < cfg.Reconnect.MinDelay) {
+        std::cerr << "--reconnect-max menor que --reconnect-min" << std::endl;
+        return 1;
+    }
+
+    // Afinidade: as listas valem dentro da máscara da partida (taskset,
+    // cpuset do cgroup). O thread principal vai para as CPUs de fundo
+    // antes de criar o logger, e os threads de fundo herdam a máscara.
+    AffinityOptions &affinity = pipelineOpts.Affinity;
+    if (affinity.enabled()) {
+        const CpuSet allowed = CpuSet::current();
+        const std::pair<const char*, const CpuSet*> stages[] = {
+            {"--cpu-io", &affinity.Io}, {"--cpu-workers", &affinity.Workers},
+            {"--cpu-publisher", &affinity.Publisher}, {"--cpu-background", &affinity.Background}
+        };
+        for (const auto &stage : stages) {
+            if (stage.second->subsetOf(allowed)) continue;
+            std::cerr << stage.first << " " << stage.second->str() << ": fora das CPUs permitidas ao processo ("
+                      << allowed.str() << ")" << std::endl;
+            return 1;
+        }
+        if (!affinity.Background.empty()) {
+            affinity.Fallback = allowed;
+            pinCurrentThread(affinity.Background);
+        }
+    }
+    logger().setLevel(logLevel);
+
+    // Rotas (a padrão, a do arquivo de configuração ou a do --routes) e decoders
+    RoutingTables tables;
+    try {
+        if (!routesFile.empty()) cfg.Routes = RouteTable::parseRules(readJsonFile(routesFile));
+        tables = compileRouting(cfg);
+    }
+    catch (const std::exception &ex) {
+        std::cerr << "Tabela de rotas inválida: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    // Arquivos do replay: cada --replay é uma sequência de segmentos
+    std::vector<std::vector<std::string>> replaySources;
+    for (const auto &path : replayPaths) {
+        auto files = captureFiles(path);
+        if (files.empty()) {
+            std::cerr << "Captura não encontrada: " << path << std::endl;
+            return 1;
+        }
+        replaySources.push_back(std::move(files));
+    }
+
+    // Sem --workers, os núcleos são divididos entre os shards
+    if (!workersSet && shardCount > 1) {
+        pipelineOpts.Workers = std::max<size_t>(1, pipelineOpts.Workers / shardCount);
+    }
+
+    LOG_INFO("Iniciando a lógica MQTT em C++...");
+    if (pipelineOpts.Workers > 0) {
+        LOG_INFO("Processamento em " << pipelineOpts.Workers << " worker(s) por conexão, fila de "
+                 << pipelineOpts.QueueCapacity << " mensagens por worker.");
+    } else {
+        LOG_INFO("Processamento inline no thread de callback.");
+    }
+    if (affinity.enabled()) {
+        auto show = [](const CpuSet& cpus) { return cpus.empty() ? std::string("-") : cpus.str(); };
+        LOG_INFO("Afinidade: io " << show(affinity.io()) << ", workers " << show(affinity.worker(0))
+                 << (affinity.Workers.count() > 1 ? " (rodízio em " + affinity.Workers.str() + ")" : std::string())
+                 << ", publicador " << show(affinity.publisher()) << ", fundo " << show(affinity.Background) << ".");
+    }
+
+    // Um shard por conexão: client, pipeline e publicador próprios. Com
+    // mais de um, cada shard usa um client ID distinto e assina via
+    // assinatura compartilhada do MQTT 5 ($share/grupo/filtro), e o broker
+    // reparte as mensagens entre eles, em rodízio dentro de cada tópico:
+    // frames do mesmo ArbitrationId podem sair fora de ordem. As métricas
+    // são do processo todo e só o primeiro shard as publica.
+    struct Shard {
+        std::unique_ptr<mqtt::async_client> Client;
+        std::unique_ptr<BrokerLogicCallback> Callback;
+    };
+    // O temporizador das métricas fica no laço de eventos, não no pipeline
+    std::chrono::milliseconds metricsInterval = pipelineOpts.Metrics.Interval;
+    pipelineOpts.Metrics.Interval = std::chrono::seconds(0);
+    // A fusão também: uma tabela só para todos os shards (o broker reparte
+    // as mensagens de um veículo entre eles), publicada pelo primeiro. O
+    // dedup idem: com o estado por shard, um frame repetido que caísse em
+    // outra conexão sairia de novo.
+    const FusionOptions fusionOpts = pipelineOpts.Fusion;
+    pipelineOpts.Fusion.Interval = std::chrono::milliseconds(0);
+    auto attachShared = [&](RoutingTables& t) {
+        if (fusionOpts.enabled()) t.Fusion = std::make_shared<FusionTable>(*t.Decoders, fusionOpts);
+        if (pipelineOpts.Dedup.Enabled) t.Changes = std::make_shared<ChangeFilter>(*t.Decoders, pipelineOpts.Dedup);
+    };
+    attachShared(tables);
+    // MQTT 5 por padrão (aliases de tópico, content type, expiração);
+    // o 3.1.1 fica para brokers antigos
+    const bool mqtt5 = cfg.MqttVersion == 5;
+    if (!mqtt5 && shardCount > 1) {
+        std::cerr << "--shards precisa de MQTT 5 (assinatura compartilhada)" << std::endl;
+        return 1;
+    }
+    if (shardCount > 1) {
+        LOG_WARN("Com " << shardCount << " shards o broker reparte as mensagens de cada tópico entre as conexões:"
+                 " a ordem por ArbitrationId não é mais garantida.");
+    }
+    if (!mqtt5 && usesMessageExpiry(tables)) {
+        LOG_WARN("expiry_s só vale numa conexão MQTT 5 (connection.mqtt_version).");
+    }
+    pipelineOpts.Publisher.Mqtt5 = mqtt5;
+    std::vector<Shard> shards(shardCount);
+    for (size_t i = 0; i < shardCount; ++i) {
+        PipelineOptions shardOpts = pipelineOpts;
+        if (i > 0) shardOpts.Metrics.HttpPort = 0;
+        shardOpts.Affinity.WorkerOffset = i * pipelineOpts.Workers;
+        // Cada shard grava a sua captura (o replay as intercala de novo)
+        if (shardCount > 1 && !shardOpts.Capture.Prefix.empty()) {
+            shardOpts.Capture.Prefix += "-" + std::to_string(i);
+        }
+        // E o seu spool: cada um reenvia pela própria conexão
+        if (shardCount > 1 && shardOpts.Publisher.Spool.enabled()) {
+            shardOpts.Publisher.Spool.Path += "-" + std::to_string(i);
+        }
+        if (shardCount == 1 && !mqtt5) {
+            // Cria cliente MQTT
+            shards[i].Client.reset(new mqtt::async_client(address, clientId));
+        } else if (shardCount == 1) {
+            shards[i].Client.reset(new mqtt::async_client(address, clientId, mqtt::create_options(MQTTVERSION_5)));
+        } else {
+            shards[i].Client.reset(new mqtt::async_client(address, clientId + "-" + std::to_string(i),
+                                                          mqtt::create_options(MQTTVERSION_5)));
+        }
+        // Instancia callback com nossa lógica
+        try {
+            shards[i].Callback.reset(new BrokerLogicCallback(*shards[i].Client, shardOpts, tables));
+        }
+        catch (const std::exception &ex) {
+            std::cerr << ex.what() << std::endl;
+            return 1;
+        }
+        shards[i].Client->set_callback(*shards[i].Callback);
+    }
+
+    // Opções de conexão
+    mqtt::connect_options connOpts;
+    if (!mqtt5) {
+        connOpts.set_clean_session(true);
+    } else {
+        connOpts = mqtt::connect_options::v5();
+        connOpts.set_clean_start(true);
+    }
+    connOpts.set_connect_timeout(cfg.Reconnect.ConnectTimeout);
+
+    auto subscriptionOf = [&](const std::string& filter) {
+        return shardCount == 1 ? filter : "$share/" + shareGroup + "/" + filter;
+    };
+    std::vector<std::string> filters;
+    std::mutex filtersMutex;   // a reconexão assina os filtros de agora
+
+    // Uma conexão pronta: CONNACK lido (aliases), assinaturas refeitas
+    // (a sessão é limpa) e o publicador liberado. Lança mqtt::exception.
+    // Se só a assinatura falhar, a próxima tentativa não reconecta.
+    auto connectShard = [&](Shard& shard) {
+        if (!shard.Client->is_connected()) {
+            mqtt::token_ptr tok = shard.Client->connect(connOpts);
+            tok->wait();
+            // Sem a propriedade no CONNACK, o broker não aceita aliases
+            uint16_t brokerAliases = 0;
+            if (mqtt5) {
+                const mqtt::connect_response rsp = tok->get_connect_response();
+                const mqtt::properties &props = rsp.get_properties();
+                if (props.contains(mqtt::property::TOPIC_ALIAS_MAXIMUM)) {
+                    brokerAliases = mqtt::get<uint16_t>(props, mqtt::property::TOPIC_ALIAS_MAXIMUM);
+                }
+            }
+            uint16_t aliases = shard.Callback->setTopicAliasMaximum(brokerAliases);
+            if (mqtt5) {
+                LOG_DEBUG("Aliases de tópico: " << aliases << " (o broker aceita " << brokerAliases << ").");
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(filtersMutex);
+            for (const auto &filter : filters) shard.Client->subscribe(subscriptionOf(filter), 1)->wait();
+        }
+        shard.Callback->setConnected(true);
+    };
+
+    // Assinatura e remoção na recarga: um shard sem conexão (ou que não
+    // responde no prazo de uma conexão) fica de fora, e a reconexão assina
+    // de novo os filtros em vigor. Roda no laço de eventos, sob filtersMutex.
+    auto updateSubscription = [&](Shard& shard, const std::string& filter, bool subscribe) {
+        std::string reason;
+        try {
+            mqtt::token_ptr tok = subscribe ? shard.Client->subscribe(subscriptionOf(filter), 1)
+                                            : shard.Client->unsubscribe(subscriptionOf(filter));
+            if (tok->wait_for(cfg.Reconnect.ConnectTimeout)) return;
+            reason = "sem resposta em " + std::to_string(cfg.Reconnect.ConnectTimeout.count()) + " ms";
+        }
+        catch (const mqtt::exception &ex) {
+            reason = ex.what();
+        }
+        LOG_WARN("Sem conexão para " << (subscribe ? "assinar " : "deixar ") << subscriptionOf(filter)
+                 << " (" << reason << "); vale na reconexão.");
+    };
+
+    // Recarga (SIGHUP): relê o arquivo e troca as tabelas sem parar o fluxo
+    auto reloadTables = [&] {
+        LOG_INFO("Recarregando rotas e decoders...");
+        BrokerConfig fresh;
+        json freshJson;
+        RoutingTables next;
+        try {
+            next = loadRouting(configFile, routesFile, fresh, freshJson);
+            attachShared(next);
+        }
+        catch (const std::exception &ex) {
+            LOG_ERROR("Recarga rejeitada, as tabelas atuais continuam: " << ex.what());
+            return;
+        }
+        if (!mqtt5 && usesMessageExpiry(next)) {
+            LOG_WARN("expiry_s só vale numa conexão MQTT 5 (connection.mqtt_version).");
+        }
+        std::string restartOnly = restartOnlyChanges(fileJson, freshJson);
+        if (!restartOnly.empty()) {
+            LOG_WARN("Mudanças em " << restartOnly << " só valem depois de reiniciar.");
+        }
+
+        // Assina os filtros novos antes da troca e só depois dela deixa
+        // os que saíram, para nenhuma rota ficar sem mensagens no meio
+        std::vector<std::string> nextFilters = next.Routes->subscriptions();
+        auto contains = [](const std::vector<std::string>& v, const std::string& f) {
+            return std::find(v.begin(), v.end(), f) != v.end();
+        };
+        std::lock_guard<std::mutex> lock(filtersMutex);
+        for (const auto &filter : nextFilters) {
+            if (contains(filters, filter)) continue;
+            for (auto &shard : shards) updateSubscription(shard, filter, true);
+            LOG_DEBUG("Assinado: " << subscriptionOf(filter));
+        }
+        for (auto &shard : shards) shard.Callback->reload(next);
+        for (const auto &filter : filters) {
+            if (contains(nextFilters, filter)) continue;
+            for (auto &shard : shards) updateSubscription(shard, filter, false);
+            LOG_DEBUG("Assinatura removida: " << subscriptionOf(filter));
+        }
+        filters = std::move(nextFilters);
+        LOG_INFO("Recarga concluída: " << next.Routes->size() << " rota(s), "
+                 << next.Decoders->size() << " decoder(s).");
+    };
+
+    try {
+        EventLoop loop;
+
+        // Uma queda depois da primeira conexão é refeita em segundo plano.
+        // Os supervisores terminam no fim deste bloco, antes de connectShard;
+        // o callback só os alcança enquanto existirem.
+        std::vector<std::shared_ptr<ConnectionSupervisor>> supervisors;
+        for (size_t i = 0; i < shardCount; ++i) {
+            Shard *shard = &shards[i];
+            std::string name = shardCount == 1 ? std::string("Conexão") : "Conexão " + std::to_string(i);
+            auto supervisor = std::make_shared<ConnectionSupervisor>(name, cfg.Reconnect,
+                                                                     [&connectShard, shard] { connectShard(*shard); });
+            std::weak_ptr<ConnectionSupervisor> weak = supervisor;
+            shard->Callback->setConnectionLostHandler([weak] {
+                if (auto s = weak.lock()) s->connectionLost();
+            });
+            supervisors.push_back(std::move(supervisor));
+        }
+        if (pipelineOpts.Publisher.Spool.enabled()) {
+            LOG_INFO("Spool em disco: " << pipelineOpts.Publisher.Spool.Path << " ("
+                     << (pipelineOpts.Publisher.Spool.Bytes >> 20) << " MB por conexão), esvaziado a "
+                     << pipelineOpts.Publisher.Spool.DrainRate << " msg/s.");
+        }
+
+        LOG_INFO("Conectando ao broker " << address << " (" << shardCount << " conexão(ões))...");
+        {
+            // O Paho C cria os threads de envio e recepção (onde rodam os
+            // callbacks) na primeira conexão; eles herdam esta máscara
+            ScopedThreadAffinity placement(affinity.io());
+            for (auto &shard : shards) connectShard(shard);
+        }
+        LOG_INFO("Conectado ao broker.");
+
+        // Replay: as mensagens gravadas entram no pipeline no lugar das
+        // assinaturas, num thread próprio; cada tópico vai sempre para o
+        // mesmo shard. No fim o laço encerra o processo normalmente.
+        std::unique_ptr<CaptureReplayer> replayer;
+        std::atomic<bool> replayCancel{false};
+        std::thread replayThread;
+        if (!replaySources.empty()) {
+            if (replaySpeed > 0) {
+                LOG_INFO("Reproduzindo " << replaySources.size() << " captura(s) a " << replaySpeed << "x.");
+            } else {
+                LOG_INFO("Reproduzindo " << replaySources.size() << " captura(s) sem espera.");
+            }
+            replayer.reset(new CaptureReplayer(std::move(replaySources)));
+            ScopedThreadAffinity placement(affinity.io());
+            replayThread = std::thread([&] {
+                auto start = std::chrono::steady_clock::now();
+                size_t count = replayer->run([&](mqtt::const_message_ptr msg) {
+                    size_t s = shardCount == 1 ? 0 : std::hash<std::string>()(msg->get_topic()) % shardCount;
+                    shards[s].Callback->message_arrived(std::move(msg));
+                }, replaySpeed, &replayCancel);
+                double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                LOG_INFO("Replay concluído: " << count << " mensagens em " << secs << " s ("
+                         << static_cast<uint64_t>(secs > 0 ? static_cast<double>(count) / secs : 0) << " msg/s).");
+                loop.stop();
+            });
+        } else {
+            // Assina nos filtros das rotas (os cobertos por outro ficam de fora)
+            std::lock_guard<std::mutex> lock(filtersMutex);
+            filters = tables.Routes->subscriptions();
+            for (const auto &filter : filters) {
+                for (auto &shard : shards) shard.Client->subscribe(subscriptionOf(filter), 1)->wait();
+                LOG_DEBUG("Assinado: " << subscriptionOf(filter));
+            }
+            loop.onSignal(SIGHUP, reloadTables);
+            LOG_INFO("Assinatura concluída. Aguardando mensagens...");
+            LOG_INFO("Pressione CTRL+C para encerrar (SIGHUP recarrega as rotas e os decoders).");
+        }
+
+        // Temporizadores do processo: as métricas saem pelo primeiro shard
+        if (metricsInterval.count() > 0) {
+            loop.every(metricsInterval, [&] { shards[0].Callback->publishMetrics(); });
+        }
+        if (fusionOpts.enabled()) {
+            loop.every(fusionOpts.Interval, [&] { shards[0].Callback->publishFusion(); });
+        }
+        auto terminate = [&] {
+            LOG_INFO("Sinal de término recebido; encerrando...");
+            loop.stop();
+        };
+        loop.onSignal(SIGTERM, terminate);
+        loop.onSignal(SIGINT, terminate);
+
+        loop.run();
+
+        // Encerramento ordenado, tudo dentro do prazo. Um segundo sinal
+        // volta à ação padrão e encerra na hora.
+        EventLoop::unblockSignals({SIGTERM, SIGINT});
+        auto deadline = std::chrono::steady_clock::now() + shutdownTimeout;
+        auto remaining = [&] {
+            return std::max(std::chrono::milliseconds(0), std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()));
+        };
+        replayCancel.store(true);
+        if (replayThread.joinable()) replayThread.join();
+
+        // 1. Para de reconectar e de receber; 2. esvazia os workers e as
+        // publicações (confirmações QoS1; sem conexão, vão para o spool);
+        // 3. desconecta
+        for (auto &supervisor : supervisors) supervisor->stop();
+        for (const auto &filter : filters) {
+            for (auto &shard : shards) {
+                if (shard.Client->is_connected()) shard.Client->unsubscribe(subscriptionOf(filter))->wait_for(remaining());
+            }
+        }
+        bool clean = true;
+        for (auto &shard : shards) clean = shard.Callback->shutdown(remaining()) && clean;
+        for (auto &shard : shards) {
+            if (!shard.Client->is_connected()) continue;
+            auto ms = static_cast<int>(remaining().count());
+            shard.Client->disconnect(ms)->wait_for(std::chrono::milliseconds(ms));
+        }
+        if (clean) {
+            LOG_INFO("Encerrado: todas as publicações foram confirmadas.");
+        } else {
+            LOG_WARN("Encerrado com publicações sem confirmação (prazo de "
+                     << shutdownTimeout.count() << " ms esgotado).");
+        }
+    }
+    catch(const mqtt::exception &ex) {
+        LOG_ERROR("Erro na conexão MQTT: " << ex.what());
+        return 1;
+    }
+    catch(const std::runtime_error &ex) {
+        LOG_ERROR(ex.what());
         return 1;
     }
 
     return 0;
 }
+#endif // BROKER_NO_MAIN